@@ -140,4 +140,5 @@ const struct fastrpc_interface apps_mem_interface = {
 	.name = "apps_mem",
 	.n_procs = 6,
 	.procs = apps_mem_procs,
+	.prio = FASTRPC_PRIO_HIGH,
 };
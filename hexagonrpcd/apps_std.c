@@ -32,11 +32,14 @@
 #include "iobuffer.h"
 #include "listener.h"
 
+#define ADSP_AVS_CFG_PATH "/vendor/etc/acdbdata/"
+#define ADSP_LIBRARY_PATH "/usr/lib/qcom/adsp/"
+
 struct apps_std_ctx {
 	int rootfd;
 	int adsp_avs_cfg_dirfd;
 	int adsp_library_dirfd;
-	struct hexagonfs_fd *fds[HEXAGONFS_MAX_FD];
+	struct hexagonfs_fd_table fds;
 };
 
 static const int apps_std_whence_table[] = {
@@ -73,7 +76,7 @@ static uint32_t apps_std_fclose(void *data,
 	const uint32_t *first_in = inbufs[0].p;
 	int ret;
 
-	ret = hexagonfs_close(ctx->fds, *first_in);
+	ret = hexagonfs_close(&ctx->fds, *first_in);
 	if (ret) {
 		fprintf(stderr, "Could not close: %s\n", strerror(-ret));
 		return AEE_EFAILED;
@@ -101,7 +104,7 @@ static uint32_t apps_std_fread(void *data,
 	} *first_out = outbufs[0].p;
 	ssize_t ret;
 
-	ret = hexagonfs_read(ctx->fds, first_in->fd,
+	ret = hexagonfs_read(&ctx->fds, first_in->fd,
 			     first_in->buf_size, outbufs[1].p);
 	if (ret < 0) {
 		fprintf(stderr, "Could not read file: %s\n", strerror(-ret));
@@ -135,7 +138,7 @@ static uint32_t apps_std_fseek(void *data,
 
 	whence = apps_std_whence_table[first_in->whence];
 
-	ret = hexagonfs_lseek(ctx->fds, first_in->fd, first_in->pos, whence);
+	ret = hexagonfs_lseek(&ctx->fds, first_in->fd, first_in->pos, whence);
 	if (ret) {
 		fprintf(stderr, "Could not seek stream: %s\n", strerror(-ret));
 		return AEE_EFAILED;
@@ -156,6 +159,7 @@ static uint32_t apps_std_fopen_with_env(void *data,
 {
 	struct apps_std_ctx *ctx = data;
 	uint32_t *out = outbufs[0].p;
+	const char *dir;
 	char rw_mode;
 	int dirfd, fd;
 
@@ -173,8 +177,10 @@ static uint32_t apps_std_fopen_with_env(void *data,
 	}
 
 	if (!strcmp(inbufs[1].p, "ADSP_LIBRARY_PATH")) {
+		dir = ADSP_LIBRARY_PATH;
 		dirfd = ctx->adsp_library_dirfd;
 	} else if (!strcmp(inbufs[1].p, "ADSP_AVS_CFG_PATH")) {
+		dir = ADSP_AVS_CFG_PATH;
 		dirfd = ctx->adsp_avs_cfg_dirfd;
 	} else {
 		fprintf(stderr, "Unknown search directory %s\n",
@@ -188,19 +194,33 @@ static uint32_t apps_std_fopen_with_env(void *data,
 		return AEE_EFAILED;
 	}
 
-	fd = hexagonfs_openat(ctx->fds, ctx->rootfd, dirfd, inbufs[3].p);
-	if (fd < 0) {
+	fd = hexagonfs_openat(&ctx->fds, ctx->rootfd, dirfd, inbufs[3].p);
+	/*
+	 * The remote processor looks for libraries in every directory of its
+	 * search path, so missing files are expected.
+	 */
+	if (fd == -ENOENT) {
+#ifdef HEXAGONRPC_VERBOSE
+		printf("openat($%s, %s, %c) -> ENOENT\n", (const char *) inbufs[1].p,
+							  (const char *) inbufs[3].p,
+							  rw_mode);
+#endif
+		return AEE_EFAILED;
+	} else if (fd < 0) {
 		fprintf(stderr, "Could not open %s: %s\n",
 				(const char *) inbufs[3].p,
-				strerror(errno));
+				strerror(-fd));
 		return AEE_EFAILED;
 	}
 
+	hexagonfs_prefetch_record(dir, inbufs[3].p);
+
 #ifdef HEXAGONRPC_VERBOSE
-	printf("openat($%s, %s, %c) -> %d\n", (const char *) inbufs[1].p,
-					      (const char *) inbufs[3].p,
-					      rw_mode,
-					      fd);
+	printf("openat($%s, %s, %c) -> %d (%zu open)\n", (const char *) inbufs[1].p,
+							(const char *) inbufs[3].p,
+							rw_mode,
+							fd,
+							hexagonfs_fd_table_count(&ctx->fds));
 #endif
 
 	*out = fd;
@@ -220,7 +240,7 @@ static uint32_t apps_std_opendir(void *data,
 	if (((const char *) inbufs[1].p)[inbufs[1].s - 1] != 0)
 		return AEE_EBADPARM;
 
-	ret = hexagonfs_openat(ctx->fds, ctx->rootfd, ctx->rootfd, inbufs[1].p);
+	ret = hexagonfs_openat(&ctx->fds, ctx->rootfd, ctx->rootfd, inbufs[1].p);
 	if (ret < 0) {
 		fprintf(stderr, "Could not open %s: %s\n",
 				(const char *) inbufs[1].p,
@@ -245,7 +265,7 @@ static uint32_t apps_std_closedir(void *data,
 	const uint64_t *dir = inbufs[0].p;
 	int ret;
 
-	ret = hexagonfs_close(ctx->fds, *dir);
+	ret = hexagonfs_close(&ctx->fds, *dir);
 	if (ret)
 		return AEE_EFAILED;
 
@@ -269,7 +289,7 @@ static uint32_t apps_std_readdir(void *data,
 	} *first_out = outbufs[0].p;
 	int ret;
 
-	ret = hexagonfs_readdir(ctx->fds, *dir, 255, first_out->name);
+	ret = hexagonfs_readdir(&ctx->fds, *dir, 255, first_out->name);
 	if (ret < 0) {
 		fprintf(stderr, "Could not read from directory: %s\n",
 				strerror(-ret));
@@ -308,27 +328,20 @@ static uint32_t apps_std_stat(void *data,
 	} *first_out = outbufs[0].p;
 	const char *pathname = inbufs[1].p;
 	struct stat stats;
-	int fd, ret;
+	int ret;
 
 	if (((const char *) inbufs[1].p)[inbufs[1].s - 1] != 0)
 		return AEE_EBADPARM;
 
-	fd = hexagonfs_openat(ctx->fds, ctx->rootfd, ctx->adsp_library_dirfd, pathname);
-	if (fd < 0) {
-		fprintf(stderr, "Could not open %s: %s\n",
-				pathname, strerror(-fd));
-		return AEE_EFAILED;
-	}
+	ret = hexagonfs_statat(&ctx->fds, ctx->rootfd, ctx->adsp_library_dirfd,
+			       pathname, &stats);
 
-	ret = hexagonfs_fstat(ctx->fds, fd, &stats);
 	if (ret) {
 		fprintf(stderr, "Could not stat %s: %s\n",
-				pathname, strerror(-fd));
+				pathname, strerror(-ret));
 		return AEE_EFAILED;
 	}
 
-	hexagonfs_close(ctx->fds, fd);
-
 #ifdef HEXAGONRPC_VERBOSE
 	printf("stat(%s)\n", pathname);
 #endif
@@ -351,7 +364,8 @@ static uint32_t apps_std_stat(void *data,
 	return 0;
 }
 
-struct fastrpc_interface *fastrpc_apps_std_init(struct hexagonfs_dirent *root)
+struct fastrpc_interface *fastrpc_apps_std_init(struct hexagonfs_dirent *root,
+						size_t max_files)
 {
 	struct fastrpc_interface *iface;
 	struct apps_std_ctx *ctx;
@@ -366,23 +380,28 @@ struct fastrpc_interface *fastrpc_apps_std_init(struct hexagonfs_dirent *root)
 
 	memcpy(iface, &apps_std_interface, sizeof(struct fastrpc_interface));
 
-	ctx->rootfd = hexagonfs_open_root(ctx->fds, root);
-	if (ctx->rootfd < 0)
+	if (hexagonfs_fd_table_init(&ctx->fds, max_files))
 		goto err_free_ctx;
 
-	ctx->adsp_avs_cfg_dirfd = hexagonfs_openat(ctx->fds,
+	ctx->rootfd = hexagonfs_open_root(&ctx->fds, root);
+	if (ctx->rootfd < 0)
+		goto err_deinit_fds;
+
+	ctx->adsp_avs_cfg_dirfd = hexagonfs_openat(&ctx->fds,
 						   ctx->rootfd,
 						   ctx->rootfd,
-						   "/vendor/etc/acdbdata/");
-	ctx->adsp_library_dirfd = hexagonfs_openat(ctx->fds,
+						   ADSP_AVS_CFG_PATH);
+	ctx->adsp_library_dirfd = hexagonfs_openat(&ctx->fds,
 						   ctx->rootfd,
 						   ctx->rootfd,
-						   "/usr/lib/qcom/adsp/");
+						   ADSP_LIBRARY_PATH);
 
 	iface->data = ctx;
 
 	return iface;
 
+err_deinit_fds:
+	hexagonfs_fd_table_deinit(&ctx->fds);
 err_free_ctx:
 	free(ctx);
 err_free_iface:
@@ -394,12 +413,8 @@ err_free_iface:
 void fastrpc_apps_std_deinit(struct fastrpc_interface *iface)
 {
 	struct apps_std_ctx *ctx = iface->data;
-	int i;
 
-	for (i = 0; i < HEXAGONFS_MAX_FD; i++) {
-		if (ctx->fds[i] != NULL)
-			hexagonfs_close(ctx->fds, i);
-	}
+	hexagonfs_fd_table_deinit(&ctx->fds);
 
 	free(iface->data);
 	free(iface);
@@ -419,6 +434,7 @@ static const struct fastrpc_function_impl apps_std_procs[] = {
 	{
 		.def = &apps_std_fread_def,
 		.impl = apps_std_fread,
+		.prio = FASTRPC_PRIO_BULK,
 	},
 	{ .def = NULL, .impl = NULL, },
 	{ .def = NULL, .impl = NULL, },
@@ -0,0 +1,194 @@
+/*
+ * FastRPC reverse tunnel handle table
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handles.h"
+#include "listener.h"
+
+/*
+ * Every open of a local interface by the remote processor gets its own
+ * instance, so the table changes while requests run on other threads. Each
+ * entry is counted once for the table and once for every request that uses
+ * it, and the last one to drop it closes the instance.
+ */
+struct fastrpc_handles {
+	pthread_mutex_t lock;
+
+	size_t n_handles;
+	struct fastrpc_handle **handles;
+};
+
+struct fastrpc_handles *fastrpc_handles_create(void)
+{
+	struct fastrpc_handles *handles;
+
+	handles = calloc(1, sizeof(*handles));
+	if (handles == NULL)
+		return NULL;
+
+	pthread_mutex_init(&handles->lock, NULL);
+
+	return handles;
+}
+
+static void close_handle(struct fastrpc_handle *ref)
+{
+	if (ref->close != NULL)
+		ref->close(ref->iface);
+
+	free(ref);
+}
+
+void fastrpc_handles_destroy(struct fastrpc_handles *handles)
+{
+	size_t i;
+
+	if (handles == NULL)
+		return;
+
+	for (i = 0; i < handles->n_handles; i++) {
+		if (handles->handles[i] != NULL)
+			close_handle(handles->handles[i]);
+	}
+
+	pthread_mutex_destroy(&handles->lock);
+
+	free(handles->handles);
+	free(handles);
+}
+
+int fastrpc_handles_add(struct fastrpc_handles *handles,
+			struct fastrpc_interface *iface,
+			void (*close)(struct fastrpc_interface *iface),
+			uint32_t *handle)
+{
+	struct fastrpc_handle **tmp, *ref;
+	size_t i, n_handles;
+	int ret;
+
+	ref = malloc(sizeof(*ref));
+	if (ref == NULL)
+		return -ENOMEM;
+
+	ref->iface = iface;
+	ref->close = close;
+	ref->refs = 1;
+
+	pthread_mutex_lock(&handles->lock);
+
+	for (i = 0; i < handles->n_handles; i++) {
+		if (handles->handles[i] == NULL)
+			break;
+	}
+
+	if (i == handles->n_handles) {
+		if (handles->n_handles >= FASTRPC_MAX_HANDLES) {
+			ret = -EMFILE;
+			goto err_unlock;
+		}
+
+		n_handles = handles->n_handles ? handles->n_handles * 2 : 4;
+		if (n_handles > FASTRPC_MAX_HANDLES)
+			n_handles = FASTRPC_MAX_HANDLES;
+
+		tmp = realloc(handles->handles, sizeof(*tmp) * n_handles);
+		if (tmp == NULL) {
+			ret = -ENOMEM;
+			goto err_unlock;
+		}
+
+		memset(&tmp[handles->n_handles], 0,
+		       sizeof(*tmp) * (n_handles - handles->n_handles));
+
+		handles->handles = tmp;
+		handles->n_handles = n_handles;
+	}
+
+	handles->handles[i] = ref;
+	*handle = i;
+
+	pthread_mutex_unlock(&handles->lock);
+
+	return 0;
+
+err_unlock:
+	pthread_mutex_unlock(&handles->lock);
+	free(ref);
+	return ret;
+}
+
+int fastrpc_handles_remove(struct fastrpc_handles *handles, uint32_t handle)
+{
+	struct fastrpc_handle *ref;
+
+	pthread_mutex_lock(&handles->lock);
+
+	if (handle >= handles->n_handles || handles->handles[handle] == NULL) {
+		pthread_mutex_unlock(&handles->lock);
+		return -EBADF;
+	}
+
+	ref = handles->handles[handle];
+	handles->handles[handle] = NULL;
+
+	pthread_mutex_unlock(&handles->lock);
+
+	fastrpc_handle_put(handles, ref);
+
+	return 0;
+}
+
+struct fastrpc_handle *fastrpc_handle_get(struct fastrpc_handles *handles,
+					  uint32_t handle)
+{
+	struct fastrpc_handle *ref = NULL;
+
+	pthread_mutex_lock(&handles->lock);
+
+	if (handle < handles->n_handles) {
+		ref = handles->handles[handle];
+		if (ref != NULL)
+			ref->refs++;
+	}
+
+	pthread_mutex_unlock(&handles->lock);
+
+	return ref;
+}
+
+void fastrpc_handle_put(struct fastrpc_handles *handles,
+			struct fastrpc_handle *ref)
+{
+	bool last;
+
+	pthread_mutex_lock(&handles->lock);
+	last = --ref->refs == 0;
+	pthread_mutex_unlock(&handles->lock);
+
+	if (last)
+		close_handle(ref);
+}
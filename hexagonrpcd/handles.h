@@ -0,0 +1,76 @@
+/*
+ * FastRPC reverse tunnel handle table
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HANDLES_H
+#define HANDLES_H
+
+#include <stdint.h>
+
+#include "listener.h"
+
+#define FASTRPC_MAX_HANDLES 256
+
+/*
+ * An interface instance that the remote processor can invoke by handle. The
+ * instance is closed when its handle has been removed and no request is
+ * using it any more.
+ */
+struct fastrpc_handle {
+	struct fastrpc_interface *iface;
+	void (*close)(struct fastrpc_interface *iface);
+
+	// Protected by the lock of the table
+	unsigned int refs;
+};
+
+struct fastrpc_handles;
+
+struct fastrpc_handles *fastrpc_handles_create(void);
+
+/*
+ * Close every instance that is still in the table. No request may be using
+ * the table any more.
+ */
+void fastrpc_handles_destroy(struct fastrpc_handles *handles);
+
+/*
+ * Give an interface instance the lowest free handle. The table takes
+ * ownership of the instance, and closes it with the close function, which may
+ * be NULL if nothing needs to be freed.
+ */
+int fastrpc_handles_add(struct fastrpc_handles *handles,
+			struct fastrpc_interface *iface,
+			void (*close)(struct fastrpc_interface *iface),
+			uint32_t *handle);
+
+int fastrpc_handles_remove(struct fastrpc_handles *handles, uint32_t handle);
+
+/*
+ * Look up a handle for a request. The instance stays open until the request
+ * drops it with fastrpc_handle_put(), even if the handle is removed in the
+ * meantime.
+ */
+struct fastrpc_handle *fastrpc_handle_get(struct fastrpc_handles *handles,
+					  uint32_t handle);
+void fastrpc_handle_put(struct fastrpc_handles *handles,
+			struct fastrpc_handle *ref);
+
+#endif
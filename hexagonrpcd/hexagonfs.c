@@ -20,15 +20,378 @@
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "hexagonfs.h"
 
+#define PATH_CACHE_BUCKETS 64
+#define PATH_CACHE_MAX_ENTRIES 1024
+
+#define POOL_SLAB_OBJECTS 32
+
+/*
+ * The remote processor opens the same files relative to the same directories
+ * over and over, so the results of walking a path are remembered in the
+ * directory the walk started from. Only files that are not directories are
+ * remembered, because directories opened this way would not know their
+ * parent.
+ *
+ * It also probes for many files that do not exist, like libraries in each
+ * directory of its search path. These are remembered until the physical
+ * directory that did not contain them is modified.
+ *
+ * When the physical directory of an entry is watched, the entry is dropped as
+ * soon as the directory changes, and the status of files that exist is kept
+ * with the entry. Otherwise, files that exist are checked when they are
+ * opened again, and missing files when their directory is stat'd. Symbolic
+ * links are never watched, because their target can be replaced without a
+ * change to the directory of the link.
+ */
+struct path_cache_entry {
+	struct path_cache_entry *next;
+
+	bool expect_dir;
+
+	/*
+	 * Files that exist have the operations and data to open them again.
+	 * Files that do not exist have no operations, and the path and
+	 * identity of the directory they were missing from.
+	 */
+	struct hexagonfs_file_ops *ops;
+	char *dirent_data;
+
+	struct hexagonfs_watch_ref dir_watch;
+	bool has_stats;
+	struct stat stats;
+
+	dev_t dir_dev;
+	ino_t dir_ino;
+	struct timespec dir_mtim;
+
+	char path[];
+};
+
+struct hexagonfs_path_cache {
+	size_t n_entries;
+	struct path_cache_entry *buckets[PATH_CACHE_BUCKETS];
+};
+
+/*
+ * Write the path with empty and "." segments removed to out. Paths that leave
+ * a directory with ".." depend on how the starting directory was opened, and
+ * are never cached.
+ */
+static bool normalize_path(const char *path, char *out, size_t size,
+			   bool *expect_dir)
+{
+	const char *seg = path;
+	size_t seg_len, len = 0;
+
+	*expect_dir = false;
+
+	while (*seg != '\0') {
+		seg_len = strcspn(seg, "/");
+
+		if (seg_len == 2 && !strncmp(seg, "..", 2))
+			return false;
+
+		if (seg_len && !(seg_len == 1 && *seg == '.')) {
+			if (len + seg_len + 2 > size)
+				return false;
+
+			if (len)
+				out[len++] = '/';
+
+			memcpy(&out[len], seg, seg_len);
+			len += seg_len;
+
+			*expect_dir = seg[seg_len] == '/';
+		}
+
+		seg += seg_len;
+		while (*seg == '/')
+			seg++;
+	}
+
+	out[len] = '\0';
+
+	return len != 0;
+}
+
+static uint32_t hash_path(const char *path)
+{
+	uint32_t hash = 2166136261;
+
+	while (*path != '\0') {
+		hash ^= (unsigned char) *path++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static void free_path_cache(struct hexagonfs_path_cache *cache)
+{
+	struct path_cache_entry *entry, *next;
+	size_t i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+		for (entry = cache->buckets[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			free(entry->dirent_data);
+			free(entry);
+		}
+	}
+
+	free(cache);
+}
+
+static struct path_cache_entry **lookup_path(struct hexagonfs_fd *dir,
+					     const char *path,
+					     bool expect_dir)
+{
+	struct path_cache_entry **entry;
+
+	if (dir->paths == NULL)
+		return NULL;
+
+	entry = &dir->paths->buckets[hash_path(path) % PATH_CACHE_BUCKETS];
+	while (*entry != NULL) {
+		if ((*entry)->expect_dir == expect_dir
+		 && !strcmp((*entry)->path, path))
+			return entry;
+
+		entry = &(*entry)->next;
+	}
+
+	return NULL;
+}
+
+static void forget_path(struct hexagonfs_fd *dir, struct path_cache_entry **slot)
+{
+	struct path_cache_entry *entry = *slot;
+
+	*slot = entry->next;
+	dir->paths->n_entries--;
+
+	free(entry->dirent_data);
+	free(entry);
+}
+
+static struct path_cache_entry *add_path(struct hexagonfs_fd *dir,
+					 const char *path,
+					 bool expect_dir,
+					 struct hexagonfs_file_ops *ops,
+					 char *dirent_data)
+{
+	struct path_cache_entry *entry;
+	size_t bucket;
+
+	if (dir->paths != NULL
+	 && dir->paths->n_entries >= PATH_CACHE_MAX_ENTRIES) {
+		free_path_cache(dir->paths);
+		dir->paths = NULL;
+	}
+
+	if (dir->paths == NULL) {
+		dir->paths = calloc(1, sizeof(*dir->paths));
+		if (dir->paths == NULL)
+			return NULL;
+	}
+
+	entry = malloc(sizeof(*entry) + strlen(path) + 1);
+	if (entry == NULL)
+		return NULL;
+
+	entry->expect_dir = expect_dir;
+	entry->ops = ops;
+	entry->dirent_data = dirent_data;
+	entry->dir_watch.watch = NULL;
+	entry->has_stats = false;
+	strcpy(entry->path, path);
+
+	bucket = hash_path(path) % PATH_CACHE_BUCKETS;
+	entry->next = dir->paths->buckets[bucket];
+	dir->paths->buckets[bucket] = entry;
+	dir->paths->n_entries++;
+
+	return entry;
+}
+
+/*
+ * Remember how to open a file again. Backends that describe files with
+ * to_dirent() serve physical files, and the data is their physical path.
+ */
+static void remember_path(struct hexagonfs_fd *dir,
+			  const char *path,
+			  bool expect_dir,
+			  struct hexagonfs_fd *fd)
+{
+	struct path_cache_entry *entry;
+	struct hexagonfs_watch_ref watch;
+	struct stat stats;
+	char *dirent_data;
+	int ret;
+
+	if (fd->ops->to_dirent == NULL || fd->ops->stat == NULL)
+		return;
+
+	ret = fd->ops->stat(fd, &stats);
+	if (ret || S_ISDIR(stats.st_mode))
+		return;
+
+	ret = fd->ops->to_dirent(fd, &dirent_data);
+	if (ret)
+		return;
+
+	// Any change after the watch is taken is noticed
+	hexagonfs_watch_parent(dirent_data, &watch);
+
+	if (lstat(dirent_data, &stats) || S_ISLNK(stats.st_mode))
+		watch.watch = NULL;
+
+	pthread_mutex_lock(&dir->lock);
+
+	entry = add_path(dir, path, expect_dir, fd->ops, dirent_data);
+	if (entry != NULL)
+		entry->dir_watch = watch;
+
+	pthread_mutex_unlock(&dir->lock);
+
+	if (entry == NULL)
+		free(dirent_data);
+}
+
+/*
+ * Remember that a segment is missing from a physical directory. Virtual
+ * directories are not remembered, because their entries can point to
+ * physical files that do not exist yet.
+ */
+static void remember_missing(struct hexagonfs_fd *dir,
+			     const char *path,
+			     bool expect_dir,
+			     struct hexagonfs_fd *parent,
+			     const char *segment)
+{
+	struct path_cache_entry *entry;
+	struct hexagonfs_watch_ref watch;
+	struct timespec now;
+	struct stat stats;
+	char *dir_path, *seg_path;
+	int ret;
+
+	if (parent->ops->to_dirent == NULL)
+		return;
+
+	ret = parent->ops->to_dirent(parent, &dir_path);
+	if (ret)
+		return;
+
+	// Any change after the watch is taken is noticed
+	hexagonfs_watch_dir(dir_path, &watch);
+
+	ret = stat(dir_path, &stats);
+	if (ret || !S_ISDIR(stats.st_mode))
+		goto err;
+
+	/*
+	 * Timestamps are coarse, so a file created right after this lookup
+	 * could leave the directory with the same modification time. Only
+	 * directories that have not been modified recently are trusted.
+	 */
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (watch.watch == NULL && now.tv_sec - stats.st_mtim.tv_sec < 2)
+		goto err;
+
+	// A dangling symbolic link can start to exist without a modification
+	seg_path = malloc(strlen(dir_path) + strlen(segment) + 2);
+	if (seg_path == NULL)
+		goto err;
+
+	sprintf(seg_path, "%s/%s", dir_path, segment);
+	ret = lstat(seg_path, &(struct stat) {0});
+	free(seg_path);
+
+	if (!ret || errno != ENOENT)
+		goto err;
+
+	pthread_mutex_lock(&dir->lock);
+
+	entry = add_path(dir, path, expect_dir, NULL, dir_path);
+	if (entry != NULL) {
+		entry->dir_watch = watch;
+		entry->dir_dev = stats.st_dev;
+		entry->dir_ino = stats.st_ino;
+		entry->dir_mtim = stats.st_mtim;
+	}
+
+	pthread_mutex_unlock(&dir->lock);
+
+	if (entry == NULL)
+		goto err;
+
+	return;
+
+err:
+	free(dir_path);
+}
+
+static bool is_current(const struct path_cache_entry *entry)
+{
+	struct stat stats;
+	int ret;
+
+	if (entry->dir_watch.watch != NULL)
+		return !hexagonfs_watch_changed(&entry->dir_watch);
+
+	if (entry->ops != NULL)
+		return true;
+
+	ret = stat(entry->dirent_data, &stats);
+
+	return !ret
+	    && stats.st_dev == entry->dir_dev
+	    && stats.st_ino == entry->dir_ino
+	    && stats.st_mtim.tv_sec == entry->dir_mtim.tv_sec
+	    && stats.st_mtim.tv_nsec == entry->dir_mtim.tv_nsec;
+}
+
+static int open_cached_path(struct hexagonfs_fd_table *table,
+			    const struct path_cache_entry *entry,
+			    struct hexagonfs_fd **out)
+{
+	struct hexagonfs_fd *fd;
+	int ret;
+
+	fd = hexagonfs_fd_alloc(table, NULL, entry->ops);
+	if (fd == NULL)
+		return -ENOMEM;
+
+	ret = entry->ops->from_dirent(entry->dirent_data, entry->expect_dir,
+				      fd->data);
+	if (ret) {
+		hexagonfs_fd_free(fd);
+		return ret;
+	}
+
+	*out = fd;
+
+	return 0;
+}
+
 static char *copy_segment_and_advance(const char *path,
 				      bool *trailing_slash,
 				      const char **next)
@@ -72,7 +435,7 @@ static struct hexagonfs_fd *pop_dir(struct hexagonfs_fd *dir,
 
 		if (!dir->is_assigned) {
 			dir->ops->close(dir->data);
-			free(dir);
+			hexagonfs_fd_free(dir);
 		}
 	} else {
 		up = dir;
@@ -81,20 +444,330 @@ static struct hexagonfs_fd *pop_dir(struct hexagonfs_fd *dir,
 	return up;
 }
 
-static int allocate_file_number(struct hexagonfs_fd **fds,
+/*
+ * Every segment of a path that is walked opens a file descriptor, so file
+ * descriptors are allocated from pools of the file descriptor table instead of
+ * with malloc(). The data of the backend is allocated right after the file
+ * descriptor, so there is one pool for each size of backend data. Objects are
+ * allocated in slabs, which are only freed with the table.
+ */
+struct pooled_fd {
+	struct hexagonfs_fd fd;
+	max_align_t data[];
+};
+
+struct pool_slab {
+	struct pool_slab *next;
+	max_align_t objs[];
+};
+
+struct hexagonfs_pool {
+	struct hexagonfs_pool *next;
+	size_t obj_size;
+
+	// Free objects are linked through their first bytes
+	void *free_objs;
+	struct pool_slab *slabs;
+};
+
+static struct hexagonfs_pool *get_pool(struct hexagonfs_fd_table *table,
+				       size_t data_size)
+{
+	struct hexagonfs_pool *pool;
+	size_t obj_size;
+
+	obj_size = offsetof(struct pooled_fd, data) + data_size;
+	obj_size = (obj_size + sizeof(max_align_t) - 1)
+		 / sizeof(max_align_t) * sizeof(max_align_t);
+
+	for (pool = table->pools; pool != NULL; pool = pool->next) {
+		if (pool->obj_size == obj_size)
+			return pool;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->obj_size = obj_size;
+	pool->next = table->pools;
+	table->pools = pool;
+
+	return pool;
+}
+
+static void *pool_alloc(struct hexagonfs_pool *pool)
+{
+	struct pool_slab *slab;
+	char *obj;
+	size_t i;
+
+	if (pool->free_objs == NULL) {
+		slab = malloc(sizeof(*slab) + pool->obj_size * POOL_SLAB_OBJECTS);
+		if (slab == NULL)
+			return NULL;
+
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+
+		for (i = POOL_SLAB_OBJECTS; i > 0; i--) {
+			obj = (char *) slab->objs + pool->obj_size * (i - 1);
+			*(void **) obj = pool->free_objs;
+			pool->free_objs = obj;
+		}
+	}
+
+	obj = pool->free_objs;
+	pool->free_objs = *(void **) obj;
+
+	return obj;
+}
+
+static void free_pools(struct hexagonfs_pool *pools)
+{
+	struct hexagonfs_pool *pool, *next_pool;
+	struct pool_slab *slab, *next_slab;
+
+	for (pool = pools; pool != NULL; pool = next_pool) {
+		next_pool = pool->next;
+
+		for (slab = pool->slabs; slab != NULL; slab = next_slab) {
+			next_slab = slab->next;
+			free(slab);
+		}
+
+		free(pool);
+	}
+}
+
+struct hexagonfs_fd *hexagonfs_fd_alloc(struct hexagonfs_fd_table *table,
+					struct hexagonfs_fd *up,
+					struct hexagonfs_file_ops *ops)
+{
+	struct hexagonfs_pool *pool;
+	struct pooled_fd *obj = NULL;
+
+	pthread_mutex_lock(&table->lock);
+
+	pool = get_pool(table, ops->data_size);
+	if (pool != NULL)
+		obj = pool_alloc(pool);
+
+	pthread_mutex_unlock(&table->lock);
+
+	if (obj == NULL)
+		return NULL;
+
+	obj->fd.is_assigned = false;
+	obj->fd.up = up;
+	obj->fd.data = ops->data_size ? obj->data : NULL;
+	obj->fd.ops = ops;
+	pthread_mutex_init(&obj->fd.lock, NULL);
+	obj->fd.refs = 0;
+	obj->fd.paths = NULL;
+	obj->fd.table = table;
+	obj->fd.pool = pool;
+
+	return &obj->fd;
+}
+
+void hexagonfs_fd_free(struct hexagonfs_fd *fd)
+{
+	struct hexagonfs_fd_table *table = fd->table;
+	struct hexagonfs_pool *pool = fd->pool;
+
+	pthread_mutex_destroy(&fd->lock);
+
+	pthread_mutex_lock(&table->lock);
+
+	*(void **) fd = pool->free_objs;
+	pool->free_objs = fd;
+
+	pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Grow the table, doubling its size up to the limit, and add the new slots to
+ * the free list in ascending order.
+ */
+static int grow_fd_table(struct hexagonfs_fd_table *table)
+{
+	struct hexagonfs_fd **fds;
+	int *next_free;
+	size_t size, i;
+
+	if (table->size >= table->limit)
+		return -EMFILE;
+
+	size = table->size ? table->size * 2 : HEXAGONFS_FD_TABLE_INITIAL_SIZE;
+	if (size > table->limit)
+		size = table->limit;
+
+	fds = realloc(table->fds, sizeof(*fds) * size);
+	if (fds == NULL)
+		return -ENOMEM;
+
+	table->fds = fds;
+
+	next_free = realloc(table->next_free, sizeof(*next_free) * size);
+	if (next_free == NULL)
+		return -ENOMEM;
+
+	table->next_free = next_free;
+
+	for (i = size; i > table->size; i--) {
+		fds[i - 1] = NULL;
+		next_free[i - 1] = table->first_free;
+		table->first_free = i - 1;
+	}
+
+	table->size = size;
+
+	return 0;
+}
+
+/*
+ * Give a file a file number, which counts as a reference to it. This must be
+ * called with the lock of the table held.
+ */
+static int allocate_file_number(struct hexagonfs_fd_table *table,
 				struct hexagonfs_fd *fd)
+{
+	int ret, i;
+
+	if (table->first_free < 0) {
+		ret = grow_fd_table(table);
+		if (ret) {
+			if (ret == -EMFILE)
+				fprintf(stderr, "Too many open files (limit: %zu)\n",
+						table->limit);
+			return ret;
+		}
+	}
+
+	i = table->first_free;
+	table->first_free = table->next_free[i];
+
+	fd->is_assigned = true;
+	fd->refs++;
+	table->fds[i] = fd;
+	table->n_open++;
+
+	return i;
+}
+
+static void release_file_number(struct hexagonfs_fd_table *table, int fileno)
+{
+	table->fds[fileno] = NULL;
+	table->next_free[fileno] = table->first_free;
+	table->first_free = fileno;
+	table->n_open--;
+}
+
+static struct hexagonfs_fd *get_fd(const struct hexagonfs_fd_table *table,
+				   int fileno)
+{
+	if (fileno < 0 || (size_t) fileno >= table->size)
+		return NULL;
+
+	return table->fds[fileno];
+}
+
+static void destroy_file_descriptor(struct hexagonfs_fd *fd);
+
+/*
+ * Look up a file by number for an operation. The file stays open until the
+ * operation drops it with put_fd(), even if it is closed in the meantime.
+ */
+static struct hexagonfs_fd *hold_fd(struct hexagonfs_fd_table *table,
+				    int fileno)
+{
+	struct hexagonfs_fd *fd;
+
+	pthread_mutex_lock(&table->lock);
+
+	fd = get_fd(table, fileno);
+	if (fd != NULL)
+		fd->refs++;
+
+	pthread_mutex_unlock(&table->lock);
+
+	return fd;
+}
+
+static void put_fd(struct hexagonfs_fd *fd)
+{
+	struct hexagonfs_fd_table *table = fd->table;
+	bool last;
+
+	pthread_mutex_lock(&table->lock);
+	last = --fd->refs == 0;
+	pthread_mutex_unlock(&table->lock);
+
+	if (!last)
+		return;
+
+	free_path_cache(fd->paths);
+	fd->paths = NULL;
+
+	fd->is_assigned = false;
+	destroy_file_descriptor(fd);
+}
+
+int hexagonfs_fd_table_init(struct hexagonfs_fd_table *table, size_t limit)
+{
+	if (limit == 0 || limit > INT_MAX)
+		return -EINVAL;
+
+	pthread_mutex_init(&table->lock, NULL);
+
+	table->fds = NULL;
+	table->next_free = NULL;
+	table->first_free = -1;
+	table->size = 0;
+	table->limit = limit;
+	table->n_open = 0;
+	table->pools = NULL;
+
+	return 0;
+}
+
+void hexagonfs_fd_table_deinit(struct hexagonfs_fd_table *table)
 {
 	size_t i;
 
-	for (i = 0; i < HEXAGONFS_MAX_FD; i++) {
-		if (fds[i] == NULL) {
-			fd->is_assigned = true;
-			fds[i] = fd;
-			return i;
+	/*
+	 * Files can refer to the directories they were opened from, which can
+	 * have any file number, so detach them before anything is closed.
+	 */
+	for (i = 0; i < table->size; i++) {
+		if (table->fds[i] != NULL) {
+			destroy_file_descriptor(table->fds[i]->up);
+			table->fds[i]->up = NULL;
 		}
 	}
 
-	return -EMFILE;
+	for (i = 0; i < table->size; i++) {
+		if (table->fds[i] != NULL)
+			hexagonfs_close(table, i);
+	}
+
+	free(table->next_free);
+	free(table->fds);
+	free_pools(table->pools);
+
+	pthread_mutex_destroy(&table->lock);
+}
+
+size_t hexagonfs_fd_table_count(struct hexagonfs_fd_table *table)
+{
+	size_t n_open;
+
+	pthread_mutex_lock(&table->lock);
+	n_open = table->n_open;
+	pthread_mutex_unlock(&table->lock);
+
+	return n_open;
 }
 
 static void destroy_file_descriptor(struct hexagonfs_fd *fd)
@@ -105,30 +778,28 @@ static void destroy_file_descriptor(struct hexagonfs_fd *fd)
 	while (curr != NULL && !curr->is_assigned) {
 		next = curr->up;
 		curr->ops->close(curr->data);
-		free(curr);
+		hexagonfs_fd_free(curr);
 
 		curr = next;
 	}
 }
 
-int hexagonfs_open_root(struct hexagonfs_fd **fds, struct hexagonfs_dirent *root)
+int hexagonfs_open_root(struct hexagonfs_fd_table *fds, struct hexagonfs_dirent *root)
 {
 	struct hexagonfs_fd *fd;
 	int ret;
 
-	fd = malloc(sizeof(struct hexagonfs_fd));
+	fd = hexagonfs_fd_alloc(fds, NULL, root->ops);
 	if (fd == NULL)
 		return -ENOMEM;
 
-	fd->is_assigned = false;
-	fd->up = NULL;
-	fd->ops = root->ops;
-
-	ret = root->ops->from_dirent(root->u.ptr, true, &fd->data);
+	ret = root->ops->from_dirent(root->u.ptr, true, fd->data);
 	if (ret)
-		goto err;
+		goto err_free_fd;
 
+	pthread_mutex_lock(&fds->lock);
 	ret = allocate_file_number(fds, fd);
+	pthread_mutex_unlock(&fds->lock);
 	if (ret < 0)
 		goto err;
 
@@ -137,143 +808,416 @@ int hexagonfs_open_root(struct hexagonfs_fd **fds, struct hexagonfs_dirent *root
 err:
 	destroy_file_descriptor(fd);
 	return ret;
+
+err_free_fd:
+	hexagonfs_fd_free(fd);
+	return ret;
 }
 
-int hexagonfs_openat(struct hexagonfs_fd **fds, int rootfd, int dirfd, const char *name)
-{
+/*
+ * State of a lookup of a path, from the directory it starts in to the file
+ * that was opened last.
+ */
+struct path_walk {
+	struct hexagonfs_fd *root;
+	struct hexagonfs_fd *start;
 	struct hexagonfs_fd *fd;
-	const char *curr = name;
-	char *segment;
+	const char *curr;
+
+	// The normalized path identifies the file in the path cache
+	bool cacheable;
 	bool expect_dir;
+	char normalized[PATH_MAX];
+};
+
+static int begin_walk(struct hexagonfs_fd_table *fds, int rootfd, int dirfd,
+		      const char *name, struct path_walk *walk)
+{
 	int selected = dirfd;
-	int ret = 0;
 
-	if (*curr == '/') {
+	walk->curr = name;
+
+	if (*walk->curr == '/') {
 		selected = rootfd;
 
-		while (*curr == '/')
-			curr++;
+		while (*walk->curr == '/')
+			walk->curr++;
 	}
 
-	fd = fds[selected];
+	walk->root = hold_fd(fds, rootfd);
+	if (walk->root == NULL)
+		return -EBADF;
 
-	while (*curr != '\0' && !ret) {
-		segment = copy_segment_and_advance(curr, &expect_dir, &curr);
-		if (segment == NULL) {
-			ret = -ENOMEM;
-			goto err;
-		}
+	walk->start = hold_fd(fds, selected);
+	if (walk->start == NULL) {
+		put_fd(walk->root);
+		return -EBADF;
+	}
+
+	walk->fd = walk->start;
+
+	walk->cacheable = normalize_path(walk->curr, walk->normalized,
+					 sizeof(walk->normalized),
+					 &walk->expect_dir);
+
+	return 0;
+}
+
+static void end_walk(struct path_walk *walk)
+{
+	put_fd(walk->start);
+	put_fd(walk->root);
+}
+
+/*
+ * Look the path up in the cache of the starting directory. Entries whose
+ * directory changed are forgotten, and files that are remembered to be missing
+ * fail with -ENOENT. This must be called with the lock of the starting
+ * directory held, for as long as the entry is used.
+ */
+static int lookup_walk(struct path_walk *walk, struct path_cache_entry ***out)
+{
+	struct path_cache_entry **cached = NULL;
+
+	if (walk->cacheable)
+		cached = lookup_path(walk->start, walk->normalized,
+				     walk->expect_dir);
+
+	if (cached != NULL && !is_current(*cached)) {
+		forget_path(walk->start, cached);
+		cached = NULL;
+	}
+
+	if (cached != NULL && (*cached)->ops == NULL)
+		return -ENOENT;
+
+	*out = cached;
+
+	return 0;
+}
+
+static void walk_missing(struct path_walk *walk, const char *segment)
+{
+	if (walk->cacheable)
+		remember_missing(walk->start, walk->normalized,
+				 walk->expect_dir, walk->fd, segment);
+}
+
+/*
+ * Open the segments of the path until the given end, or until the end of the
+ * path if it is NULL.
+ */
+static int walk_segments(struct path_walk *walk, const char *end)
+{
+	char *segment;
+	bool seg_expect_dir;
+	int ret = 0;
+
+	while (*walk->curr != '\0' && walk->curr != end && !ret) {
+		segment = copy_segment_and_advance(walk->curr, &seg_expect_dir,
+						   &walk->curr);
+		if (segment == NULL)
+			return -ENOMEM;
 
 		if (!strcmp(segment, ".")) {
 			goto next;
 		} else if (!strcmp(segment, "..")) {
-			fd = pop_dir(fd, fds[rootfd]);
+			walk->fd = pop_dir(walk->fd, walk->root);
 		} else {
-			ret = fd->ops->openat(fd, segment, expect_dir, &fd);
+			ret = walk->fd->ops->openat(walk->fd, segment,
+						    seg_expect_dir, &walk->fd);
+			if (ret == -ENOENT)
+				walk_missing(walk, segment);
 		}
 
 	next:
 		free(segment);
 	}
 
+	return ret;
+}
+
+int hexagonfs_openat(struct hexagonfs_fd_table *fds, int rootfd, int dirfd, const char *name)
+{
+	struct path_cache_entry **cached;
+	struct path_walk walk;
+	bool found = false;
+	int ret;
+
+	ret = begin_walk(fds, rootfd, dirfd, name, &walk);
 	if (ret)
-		goto err;
+		return ret;
+
+	pthread_mutex_lock(&walk.start->lock);
+
+	/*
+	 * If the file cannot be opened again, for example because it was
+	 * removed, walk the path to get the same error as without the cache.
+	 */
+	ret = lookup_walk(&walk, &cached);
+	if (!ret && cached != NULL) {
+		found = !open_cached_path(fds, *cached, &walk.fd);
+		if (!found)
+			forget_path(walk.start, cached);
+	}
+
+	pthread_mutex_unlock(&walk.start->lock);
 
-	ret = allocate_file_number(fds, fd);
+	if (ret)
+		goto out;
+
+	if (found)
+		goto allocate;
+
+	ret = walk_segments(&walk, NULL);
 	if (ret)
 		goto err;
 
-	return ret;
+	if (walk.cacheable)
+		remember_path(walk.start, walk.normalized, walk.expect_dir,
+			      walk.fd);
+
+allocate:
+	pthread_mutex_lock(&fds->lock);
+	ret = allocate_file_number(fds, walk.fd);
+	pthread_mutex_unlock(&fds->lock);
+	if (ret < 0)
+		goto err;
+
+	goto out;
 
 err:
-	destroy_file_descriptor(fd);
+	destroy_file_descriptor(walk.fd);
+out:
+	end_walk(&walk);
+
+	return ret;
+}
+
+/*
+ * Find the last segment of a path. Paths that end with "." or ".." have no
+ * segment that can be looked up in a parent directory, so the directory they
+ * refer to is stat'd after it is walked to.
+ */
+static const char *find_last_segment(const char *path)
+{
+	size_t start, end;
+
+	end = strlen(path);
+	while (end && path[end - 1] == '/')
+		end--;
+
+	start = end;
+	while (start && path[start - 1] != '/')
+		start--;
+
+	if (end == start
+	 || (end - start == 1 && path[start] == '.')
+	 || (end - start == 2 && !strncmp(&path[start], "..", 2)))
+		return NULL;
+
+	return &path[start];
+}
+
+static int stat_fd(struct hexagonfs_fd *fd, struct stat *stats)
+{
+	if (fd->ops->stat == NULL)
+		return -ENOSYS;
+
+	return fd->ops->stat(fd, stats);
+}
+
+/*
+ * Stat a file without opening it. Only the directories before the last
+ * segment are opened, and the last segment is looked up in place by backends
+ * that support it. Files that are in the path cache are not looked up at all.
+ */
+int hexagonfs_statat(struct hexagonfs_fd_table *fds, int rootfd, int dirfd,
+		     const char *name, struct stat *stats)
+{
+	struct path_cache_entry **cached;
+	struct path_walk walk;
+	const char *last;
+	char *segment;
+	bool seg_expect_dir;
+	bool found = false;
+	int ret;
+
+	ret = begin_walk(fds, rootfd, dirfd, name, &walk);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&walk.start->lock);
+
+	ret = lookup_walk(&walk, &cached);
+
+	if (!ret && cached != NULL && (*cached)->has_stats) {
+		*stats = (*cached)->stats;
+		found = true;
+	}
+
+	/*
+	 * The watch was taken before the file is stat'd, so the status can be
+	 * kept until the directory changes.
+	 */
+	if (!ret && cached != NULL && !found
+	 && (*cached)->ops->stat_dirent != NULL) {
+		found = !(*cached)->ops->stat_dirent((*cached)->dirent_data,
+						     (*cached)->expect_dir,
+						     stats);
+		if (found && (*cached)->dir_watch.watch != NULL) {
+			(*cached)->stats = *stats;
+			(*cached)->has_stats = true;
+		} else if (!found) {
+			forget_path(walk.start, cached);
+		}
+	}
+
+	pthread_mutex_unlock(&walk.start->lock);
+
+	if (ret || found)
+		goto out;
+
+	last = find_last_segment(walk.curr);
+
+	ret = walk_segments(&walk, last);
+	if (ret)
+		goto out;
+
+	if (last == NULL) {
+		ret = stat_fd(walk.fd, stats);
+		goto out;
+	}
+
+	segment = copy_segment_and_advance(walk.curr, &seg_expect_dir,
+					   &walk.curr);
+	if (segment == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (walk.fd->ops->statat != NULL) {
+		ret = walk.fd->ops->statat(walk.fd, segment, seg_expect_dir,
+					   stats);
+		if (ret == -ENOENT)
+			walk_missing(&walk, segment);
+
+		if (ret != -ENOSYS)
+			goto out_free_segment;
+	}
+
+	ret = walk.fd->ops->openat(walk.fd, segment, seg_expect_dir, &walk.fd);
+	if (ret == -ENOENT)
+		walk_missing(&walk, segment);
+	else if (!ret)
+		ret = stat_fd(walk.fd, stats);
+
+out_free_segment:
+	free(segment);
+out:
+	destroy_file_descriptor(walk.fd);
+	end_walk(&walk);
 
 	return ret;
 }
 
-int hexagonfs_close(struct hexagonfs_fd **fds, int fileno)
+int hexagonfs_close(struct hexagonfs_fd_table *fds, int fileno)
 {
 	struct hexagonfs_fd *fd;
 
-	if (fileno < 0 || fileno >= HEXAGONFS_MAX_FD)
-		return -EBADF;
+	pthread_mutex_lock(&fds->lock);
 
-	fd = fds[fileno];
-	if (fd == NULL || fd->ops == NULL)
+	fd = get_fd(fds, fileno);
+	if (fd == NULL || fd->ops == NULL) {
+		pthread_mutex_unlock(&fds->lock);
 		return -EBADF;
+	}
 
-	fd->is_assigned = false;
-	destroy_file_descriptor(fd);
+	release_file_number(fds, fileno);
+
+	pthread_mutex_unlock(&fds->lock);
 
-	fds[fileno] = NULL;
+	put_fd(fd);
 
 	return 0;
 }
 
-int hexagonfs_lseek(struct hexagonfs_fd **fds, int fileno, off_t off, int whence)
+int hexagonfs_lseek(struct hexagonfs_fd_table *fds, int fileno, off_t off, int whence)
 {
 	struct hexagonfs_fd *fd;
+	int ret = -ENOSYS;
 
-	if (fileno < 0 || fileno >= HEXAGONFS_MAX_FD)
-		return -EBADF;
-
-	fd = fds[fileno];
+	fd = hold_fd(fds, fileno);
 	if (fd == NULL)
 		return -EBADF;
 
-	if (fd->ops->seek == NULL)
-		return -ENOSYS;
+	if (fd->ops->seek != NULL) {
+		pthread_mutex_lock(&fd->lock);
+		ret = fd->ops->seek(fd, off, whence);
+		pthread_mutex_unlock(&fd->lock);
+	}
+
+	put_fd(fd);
 
-	return fd->ops->seek(fd, off, whence);
+	return ret;
 }
 
-ssize_t hexagonfs_read(struct hexagonfs_fd **fds, int fileno, size_t size, void *ptr)
+ssize_t hexagonfs_read(struct hexagonfs_fd_table *fds, int fileno, size_t size, void *ptr)
 {
 	struct hexagonfs_fd *fd;
+	ssize_t ret = -ENOSYS;
 
-	if (fileno < 0 || fileno >= HEXAGONFS_MAX_FD)
-		return -EBADF;
-
-	fd = fds[fileno];
+	fd = hold_fd(fds, fileno);
 	if (fd == NULL)
 		return -EBADF;
 
-	if (fd->ops->read == NULL)
-		return -ENOSYS;
+	if (fd->ops->read != NULL) {
+		pthread_mutex_lock(&fd->lock);
+		ret = fd->ops->read(fd, size, ptr);
+		pthread_mutex_unlock(&fd->lock);
+	}
+
+	put_fd(fd);
 
-	return fd->ops->read(fd, size, ptr);
+	return ret;
 }
 
-int hexagonfs_readdir(struct hexagonfs_fd **fds, int fileno, size_t ent_size, char *ent)
+int hexagonfs_readdir(struct hexagonfs_fd_table *fds, int fileno, size_t ent_size, char *ent)
 {
 	struct hexagonfs_fd *fd;
+	int ret = -ENOSYS;
 
-	if (fileno < 0 || fileno >= HEXAGONFS_MAX_FD)
-		return -EBADF;
-
-	fd = fds[fileno];
+	fd = hold_fd(fds, fileno);
 	if (fd == NULL)
 		return -EBADF;
 
-	if (fd->ops->readdir == NULL)
-		return -ENOSYS;
+	if (fd->ops->readdir != NULL) {
+		pthread_mutex_lock(&fd->lock);
+		ret = fd->ops->readdir(fd, ent_size, ent);
+		pthread_mutex_unlock(&fd->lock);
+	}
+
+	put_fd(fd);
 
-	return fd->ops->readdir(fd, ent_size, ent);
+	return ret;
 }
 
-int hexagonfs_fstat(struct hexagonfs_fd **fds, int fileno, struct stat *stats)
+int hexagonfs_fstat(struct hexagonfs_fd_table *fds, int fileno, struct stat *stats)
 {
 	struct hexagonfs_fd *fd;
+	int ret = -ENOSYS;
 
-	if (fileno < 0 || fileno >= HEXAGONFS_MAX_FD)
-		return -EBADF;
-
-	fd = fds[fileno];
+	fd = hold_fd(fds, fileno);
 	if (fd == NULL)
 		return -EBADF;
 
-	if (fd->ops->stat == NULL)
-		return -ENOSYS;
+	if (fd->ops->stat != NULL) {
+		pthread_mutex_lock(&fd->lock);
+		ret = fd->ops->stat(fd, stats);
+		pthread_mutex_unlock(&fd->lock);
+	}
 
-	return fd->ops->stat(fd, stats);
+	put_fd(fd);
+
+	return ret;
 }
@@ -22,18 +22,33 @@
 #ifndef HEXAGONFS_H
 #define HEXAGONFS_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
-#define HEXAGONFS_MAX_FD 256
+#define HEXAGONFS_DEFAULT_MAX_FD 1024
+#define HEXAGONFS_FD_TABLE_INITIAL_SIZE 16
 
 struct hexagonfs_fd;
+struct hexagonfs_fd_table;
+struct hexagonfs_image;
+struct hexagonfs_path_cache;
+struct hexagonfs_pool;
+struct hexagonfs_watch;
 
 struct hexagonfs_file_ops {
+	/*
+	 * Size of the data of an open file. It is allocated right after the
+	 * file descriptor, from the pools of the file descriptor table, and
+	 * initialized by from_dirent() or openat().
+	 */
+	size_t data_size;
+
 	void (*close)(void *fd_data);
-	int (*from_dirent)(const void *dirent_data, bool dir, void **fd_data);
+	int (*from_dirent)(const void *dirent_data, bool dir, void *fd_data);
 	int (*openat)(struct hexagonfs_fd *dir,
 		      const char *segment,
 		      bool expect_dir,
@@ -42,6 +57,25 @@ struct hexagonfs_file_ops {
 	ssize_t (*read)(struct hexagonfs_fd *fd, size_t size, void *ptr);
 	int (*stat)(struct hexagonfs_fd *fd, struct stat *stats);
 	int (*seek)(struct hexagonfs_fd *fd, off_t off, int whence);
+
+	/*
+	 * Optionally, describe an open file with data that from_dirent() can
+	 * open again, so that the path to it does not need to be walked. The
+	 * data is allocated and freed by the caller.
+	 */
+	int (*to_dirent)(struct hexagonfs_fd *fd, char **dirent_data);
+
+	/*
+	 * Optionally, stat a file without opening it, either as a child of an
+	 * open directory or from the data of its directory entry. Lookups in
+	 * directories that cannot stat a child fail with -ENOSYS.
+	 */
+	int (*statat)(struct hexagonfs_fd *dir,
+		      const char *segment,
+		      bool expect_dir,
+		      struct stat *stats);
+	int (*stat_dirent)(const void *dirent_data, bool dir,
+			   struct stat *stats);
 };
 
 struct hexagonfs_dirent {
@@ -50,32 +84,205 @@ struct hexagonfs_dirent {
 	struct hexagonfs_file_ops *ops;
 	union hexagonfs_dirent_data {
 		void *ptr;
-		struct hexagonfs_dirent **dir;
+		struct hexagonfs_virt_dir *dir;
 		const char *phys;
 	} u;
 };
 
+/*
+ * Children of a virtual directory. They are sorted by name with
+ * hexagonfs_virt_dir_sort() when the directory is created, so that they can
+ * be looked up with a binary search. Names that are not children are looked
+ * up in the directory below, if there is one, so that files can be added to a
+ * mapped directory.
+ */
+struct hexagonfs_virt_dir {
+	size_t n_ents;
+	struct hexagonfs_dirent **ents;
+	const struct hexagonfs_dirent *below;
+};
+
 struct hexagonfs_fd {
 	bool is_assigned;
 	struct hexagonfs_fd *up;
 	void *data;
 
 	struct hexagonfs_file_ops *ops;
+
+	/*
+	 * Serializes the operations on the file, and protects the path cache.
+	 * Files with a file number are counted once for the number and once
+	 * for every operation that uses them, under the lock of the table.
+	 */
+	pthread_mutex_t lock;
+	unsigned int refs;
+
+	// Files recently opened relative to this directory
+	struct hexagonfs_path_cache *paths;
+
+	// Table and pool that the file descriptor was allocated from
+	struct hexagonfs_fd_table *table;
+	struct hexagonfs_pool *pool;
+};
+
+/*
+ * File descriptors of one remote processor. The table grows as needed up to
+ * the limit, and free file numbers are kept in a list so that they can be
+ * allocated without a search.
+ *
+ * Operations on different files can run at the same time. The lock of the
+ * table is only held to look up, add and remove file numbers and to allocate
+ * file descriptors, never while a file is read or opened.
+ */
+struct hexagonfs_fd_table {
+	pthread_mutex_t lock;
+
+	struct hexagonfs_fd **fds;
+	int *next_free;
+	int first_free;
+
+	size_t size;
+	size_t limit;
+	size_t n_open;
+
+	// Pools of file descriptors, one for each size of backend data
+	struct hexagonfs_pool *pools;
+};
+
+/*
+ * Contents of a physical file that are kept in memory, shared between all
+ * file descriptors that read it. Large files can still be loading when they
+ * are returned, and hexagonfs_cache_wait() must be called before reading a
+ * range of the data.
+ *
+ * The contents of a directory are the names of its entries, sorted and
+ * separated by null characters, with the offset of each name in names.
+ */
+struct hexagonfs_cache_entry {
+	char *data;
+	size_t size;
+
+	size_t n_names;
+	uint32_t *names;
+};
+
+#define HEXAGONFS_CACHE_DEFAULT_BUDGET (32 * 1024 * 1024)
+
+/*
+ * Generation of a watched physical directory at the time something was found
+ * in it. The generation changes whenever the directory or the path to it
+ * changes.
+ */
+struct hexagonfs_watch_ref {
+	struct hexagonfs_watch *watch;
+	uint64_t gen;
+};
+
+/*
+ * File in a packed image, which is the directory entry data of the image
+ * backend. Files that are not in the image fail to open with -ENOENT.
+ */
+struct hexagonfs_image_file {
+	const struct hexagonfs_image *image;
+	uint32_t node;
+	bool exists;
 };
 
+/*
+ * File with generated contents, which is the directory entry data of the
+ * synthetic backend. The contents are generated the first time the file is
+ * opened or stat'd, and kept for the lifetime of the process, so generate()
+ * is called at most once unless it fails. It returns the contents in a buffer
+ * allocated with malloc(), or a negative error number, like -ENOENT if the
+ * file should not exist.
+ */
+struct hexagonfs_synthetic_file {
+	int (*generate)(const void *arg, char **data, size_t *size);
+	const void *arg;
+
+	bool generated;
+	char *data;
+	size_t size;
+};
+
+extern struct hexagonfs_file_ops hexagonfs_image_ops;
 extern struct hexagonfs_file_ops hexagonfs_mapped_ops;
 extern struct hexagonfs_file_ops hexagonfs_mapped_or_empty_ops;
 extern struct hexagonfs_file_ops hexagonfs_mapped_sysfs_ops;
-extern struct hexagonfs_file_ops hexagonfs_plat_subtype_name_ops;
+extern struct hexagonfs_file_ops hexagonfs_synthetic_ops;
 extern struct hexagonfs_file_ops hexagonfs_virt_dir_ops;
 
-int hexagonfs_open_root(struct hexagonfs_fd **fds, struct hexagonfs_dirent *root);
-int hexagonfs_openat(struct hexagonfs_fd **fds, int rootfd, int dirfd, const char *name);
-int hexagonfs_close(struct hexagonfs_fd **fds, int fileno);
+int hexagonfs_plat_subtype_name_generate(const void *source, char **data,
+					 size_t *size);
+
+int hexagonfs_fd_table_init(struct hexagonfs_fd_table *table, size_t limit);
+void hexagonfs_fd_table_deinit(struct hexagonfs_fd_table *table);
+size_t hexagonfs_fd_table_count(struct hexagonfs_fd_table *table);
+
+struct hexagonfs_fd *hexagonfs_fd_alloc(struct hexagonfs_fd_table *table,
+					struct hexagonfs_fd *up,
+					struct hexagonfs_file_ops *ops);
+void hexagonfs_fd_free(struct hexagonfs_fd *fd);
+
+int hexagonfs_open_root(struct hexagonfs_fd_table *fds, struct hexagonfs_dirent *root);
+int hexagonfs_openat(struct hexagonfs_fd_table *fds, int rootfd, int dirfd, const char *name);
+int hexagonfs_close(struct hexagonfs_fd_table *fds, int fileno);
+int hexagonfs_statat(struct hexagonfs_fd_table *fds, int rootfd, int dirfd,
+		     const char *name, struct stat *stats);
+
+int hexagonfs_fstat(struct hexagonfs_fd_table *fds, int fileno, struct stat *stats);
+int hexagonfs_lseek(struct hexagonfs_fd_table *fds, int fileno, off_t pos, int whence);
+int hexagonfs_readdir(struct hexagonfs_fd_table *fds, int fileno, size_t size, char *name);
+ssize_t hexagonfs_read(struct hexagonfs_fd_table *fds, int fileno, size_t size, void *ptr);
+
+int hexagonfs_virt_dir_sort(struct hexagonfs_virt_dir *dir);
+
+int hexagonfs_image_open(const char *path, struct hexagonfs_image **out);
+void hexagonfs_image_close(struct hexagonfs_image *image);
+int hexagonfs_image_lookup(const struct hexagonfs_image *image,
+			   const char *path,
+			   struct hexagonfs_image_file **out);
+
+void hexagonfs_cache_set_budget(size_t budget);
+const struct hexagonfs_cache_entry *hexagonfs_cache_get(int fd,
+							const struct stat *phys);
+int hexagonfs_cache_wait(const struct hexagonfs_cache_entry *entry, size_t end);
+int hexagonfs_cache_get_dir(int fd, const struct stat *phys,
+			    const struct hexagonfs_watch_ref *watch,
+			    const struct hexagonfs_cache_entry **out);
+void hexagonfs_cache_put(const struct hexagonfs_cache_entry *entry);
+
+int hexagonfs_fd_cache_take(const char *path, struct hexagonfs_watch_ref *watch);
+void hexagonfs_fd_cache_put(const char *path, int fd,
+			    const struct hexagonfs_watch_ref *watch);
+
+/*
+ * Read that is submitted to the io_uring. The completion function is called
+ * with the result by whichever thread is waiting for completions, with the
+ * lock of the ring held, so it must not submit other reads.
+ */
+struct hexagonfs_uring_req {
+	struct hexagonfs_uring_req *next;
+
+	int fd;
+	void *buf;
+	uint32_t len;
+	uint64_t off;
+
+	void (*complete)(struct hexagonfs_uring_req *req, int res);
+};
+
+int hexagonfs_prefetch_open(const char *list);
+void hexagonfs_prefetch_record(const char *dir, const char *name);
+int hexagonfs_prefetch_start(size_t n_roots, struct hexagonfs_dirent *const *roots);
+
+int hexagonfs_uring_init(unsigned int entries);
+bool hexagonfs_uring_enabled(void);
+void hexagonfs_uring_read(struct hexagonfs_uring_req *req);
+int hexagonfs_uring_wait(bool (*done)(const void *arg), const void *arg);
 
-int hexagonfs_fstat(struct hexagonfs_fd **fds, int fileno, struct stat *stats);
-int hexagonfs_lseek(struct hexagonfs_fd **fds, int fileno, off_t pos, int whence);
-int hexagonfs_readdir(struct hexagonfs_fd **fds, int fileno, size_t size, char *name);
-ssize_t hexagonfs_read(struct hexagonfs_fd **fds, int fileno, size_t size, void *ptr);
+int hexagonfs_watch_dir(const char *path, struct hexagonfs_watch_ref *ref);
+int hexagonfs_watch_parent(const char *path, struct hexagonfs_watch_ref *ref);
+bool hexagonfs_watch_changed(const struct hexagonfs_watch_ref *ref);
 
 #endif
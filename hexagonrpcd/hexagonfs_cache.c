@@ -0,0 +1,705 @@
+/*
+ * HexagonFS file content cache
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hexagonfs.h"
+
+#define CACHE_BUCKETS 256
+#define DIR_READ_SIZE 32768
+#define LOAD_CHUNK_SIZE (128 * 1024)
+
+/*
+ * The remote processor reads the same registry, configuration and calibration
+ * files every time a protection domain starts, so whole files are kept in
+ * memory. Entries are identified by the physical file and invalidated when
+ * its size or modification time changes.
+ *
+ * Directories are scanned one entry per request, so their sorted list of
+ * names is kept the same way.
+ *
+ * With io_uring, files larger than one chunk are read asynchronously, with
+ * every chunk in flight at once. The entry is returned as soon as the reads
+ * are submitted, and readers only wait for the chunks they need, so that the
+ * remote processor can process the start of a library while the rest is read
+ * from storage.
+ */
+struct load_chunk {
+	struct hexagonfs_uring_req req;
+	struct cache_entry *entry;
+	bool done;
+};
+
+struct load_wait {
+	const struct cache_entry *entry;
+	size_t end;
+};
+
+struct cache_entry {
+	struct hexagonfs_cache_entry pub;
+
+	dev_t dev;
+	ino_t ino;
+	off_t phys_size;
+	struct timespec mtim;
+
+	// Directory the entry was read from, if it is watched for changes
+	struct hexagonfs_watch_ref watch;
+
+	// Bytes of memory that count towards the budget
+	size_t cost;
+
+	/*
+	 * Length of the data at the start that has been read. The chunks are
+	 * only changed by completions, with the lock of the ring held.
+	 */
+	size_t loaded;
+	int load_fd;
+	int load_error;
+	struct load_chunk *chunks;
+	size_t n_chunks;
+	size_t n_done;
+	size_t n_completed;
+
+	unsigned int refs;
+	bool stale;
+
+	struct cache_entry *hash_next;
+	struct cache_entry *lru_prev;
+	struct cache_entry *lru_next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache_buckets[CACHE_BUCKETS];
+
+// The head of the list is the most recently used entry
+static struct cache_entry *lru_head;
+static struct cache_entry *lru_tail;
+
+static size_t cache_used;
+static size_t cache_budget = HEXAGONFS_CACHE_DEFAULT_BUDGET;
+
+static struct cache_entry **bucket_of(dev_t dev, ino_t ino)
+{
+	return &cache_buckets[(ino ^ dev) % CACHE_BUCKETS];
+}
+
+static void free_entry(struct cache_entry *entry)
+{
+	if (entry->load_fd != -1)
+		close(entry->load_fd);
+
+	free(entry->chunks);
+	free(entry->pub.names);
+	free(entry->pub.data);
+	free(entry);
+}
+
+static void lru_unlink(struct cache_entry *entry)
+{
+	if (entry->lru_prev != NULL)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		lru_head = entry->lru_next;
+
+	if (entry->lru_next != NULL)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		lru_tail = entry->lru_prev;
+}
+
+static void lru_push(struct cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = lru_head;
+
+	if (lru_head != NULL)
+		lru_head->lru_prev = entry;
+	else
+		lru_tail = entry;
+
+	lru_head = entry;
+}
+
+/*
+ * Remove an entry from the cache. Entries that are still being read from are
+ * freed when the last reader puts them.
+ */
+static void remove_entry(struct cache_entry *entry)
+{
+	struct cache_entry **curr;
+
+	curr = bucket_of(entry->dev, entry->ino);
+	while (*curr != entry)
+		curr = &(*curr)->hash_next;
+
+	*curr = entry->hash_next;
+
+	lru_unlink(entry);
+	cache_used -= entry->cost;
+
+	if (entry->refs)
+		entry->stale = true;
+	else
+		free_entry(entry);
+}
+
+static struct cache_entry *lookup(const struct stat *phys)
+{
+	struct cache_entry *entry;
+
+	for (entry = *bucket_of(phys->st_dev, phys->st_ino);
+	     entry != NULL;
+	     entry = entry->hash_next) {
+		if (entry->dev == phys->st_dev && entry->ino == phys->st_ino)
+			break;
+	}
+
+	if (entry == NULL)
+		return NULL;
+
+	if (entry->phys_size != phys->st_size
+	 || entry->mtim.tv_sec != phys->st_mtim.tv_sec
+	 || entry->mtim.tv_nsec != phys->st_mtim.tv_nsec
+	 || (entry->watch.watch != NULL && hexagonfs_watch_changed(&entry->watch))) {
+		remove_entry(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/*
+ * Evict the least recently used entries that are not being read from until
+ * the given number of bytes fits in the budget.
+ */
+static bool make_room(size_t size)
+{
+	struct cache_entry *entry = lru_tail;
+	struct cache_entry *prev;
+
+	if (size > cache_budget)
+		return false;
+
+	while (entry != NULL && cache_used + size > cache_budget) {
+		prev = entry->lru_prev;
+
+		if (!entry->refs)
+			remove_entry(entry);
+
+		entry = prev;
+	}
+
+	return cache_used + size <= cache_budget;
+}
+
+/*
+ * Read a whole file. Files that are shorter than their reported size, like
+ * sysfs attributes, are not cached because their size cannot be checked for
+ * changes.
+ */
+static char *read_whole_file(int fd, size_t size)
+{
+	size_t off = 0;
+	ssize_t ret;
+	char *data;
+
+	data = malloc(size);
+	if (data == NULL)
+		return NULL;
+
+	// Let the kernel read further ahead than it would for random reads
+	posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+	while (off < size) {
+		ret = pread(fd, &data[off], size - off, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			goto err;
+
+		off += ret;
+	}
+
+	return data;
+
+err:
+	free(data);
+	return NULL;
+}
+
+static struct cache_entry *alloc_entry(void)
+{
+	struct cache_entry *entry;
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		return NULL;
+
+	entry->load_fd = -1;
+
+	return entry;
+}
+
+void hexagonfs_cache_set_budget(size_t budget)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	cache_budget = budget;
+	make_room(0);
+
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static struct cache_entry *get_entry(const struct stat *phys)
+{
+	struct cache_entry *entry;
+
+	pthread_mutex_lock(&cache_lock);
+
+	entry = lookup(phys);
+	if (entry != NULL) {
+		entry->refs++;
+		lru_unlink(entry);
+		lru_push(entry);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return entry;
+}
+
+/*
+ * Add an entry that was read while the lock was not held, unless another
+ * reader added the same file in the meantime.
+ */
+static struct cache_entry *insert_entry(struct cache_entry *entry,
+					const struct stat *phys,
+					bool cacheable)
+{
+	struct cache_entry *existing;
+
+	entry->dev = phys->st_dev;
+	entry->ino = phys->st_ino;
+	entry->phys_size = phys->st_size;
+	entry->mtim = phys->st_mtim;
+	entry->refs = 1;
+
+	pthread_mutex_lock(&cache_lock);
+
+	existing = lookup(phys);
+	if (existing != NULL) {
+		existing->refs++;
+		lru_unlink(existing);
+		lru_push(existing);
+		pthread_mutex_unlock(&cache_lock);
+
+		free_entry(entry);
+		return existing;
+	}
+
+	/*
+	 * If the cache is full of files that are being read from, the file is
+	 * still served from this copy, which is freed when it is put.
+	 */
+	if (!cacheable || !make_room(entry->cost)) {
+		entry->stale = true;
+		pthread_mutex_unlock(&cache_lock);
+		return entry;
+	}
+
+	entry->hash_next = *bucket_of(entry->dev, entry->ino);
+	*bucket_of(entry->dev, entry->ino) = entry;
+	lru_push(entry);
+	cache_used += entry->cost;
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return entry;
+}
+
+/*
+ * Handle a completed chunk. Entries that could not be read are removed from
+ * the cache, and their readers fall back to reading the file themselves.
+ */
+static void load_complete(struct hexagonfs_uring_req *req, int res)
+{
+	struct load_chunk *chunk = (struct load_chunk *) req;
+	struct cache_entry *entry = chunk->entry;
+	size_t loaded;
+
+	if (res != (int) req->len && !entry->load_error) {
+		__atomic_store_n(&entry->load_error, res < 0 ? res : -EIO,
+				 __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&cache_lock);
+		if (!entry->stale)
+			remove_entry(entry);
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	chunk->done = true;
+
+	while (entry->n_done < entry->n_chunks && entry->chunks[entry->n_done].done)
+		entry->n_done++;
+
+	loaded = entry->n_done * LOAD_CHUNK_SIZE;
+	if (loaded > entry->pub.size)
+		loaded = entry->pub.size;
+
+	__atomic_store_n(&entry->loaded, loaded, __ATOMIC_RELEASE);
+
+	// The reference of the reads is dropped with the last one
+	if (++entry->n_completed == entry->n_chunks) {
+		close(entry->load_fd);
+		entry->load_fd = -1;
+
+		hexagonfs_cache_put(&entry->pub);
+	}
+}
+
+/*
+ * Submit reads of every chunk of a file. The file descriptor is duplicated,
+ * because the file can be closed before the reads complete.
+ */
+static const struct hexagonfs_cache_entry *load_async(int fd,
+						      const struct stat *phys)
+{
+	struct cache_entry *entry, *inserted;
+	size_t i, off;
+
+	entry = alloc_entry();
+	if (entry == NULL)
+		return NULL;
+
+	entry->pub.size = phys->st_size;
+	entry->cost = phys->st_size;
+	entry->n_chunks = (phys->st_size + LOAD_CHUNK_SIZE - 1) / LOAD_CHUNK_SIZE;
+
+	entry->pub.data = malloc(phys->st_size);
+	entry->chunks = calloc(entry->n_chunks, sizeof(*entry->chunks));
+	if (entry->pub.data == NULL || entry->chunks == NULL)
+		goto err;
+
+	entry->load_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (entry->load_fd == -1)
+		goto err;
+
+	inserted = insert_entry(entry, phys, true);
+	if (inserted != entry)
+		return &inserted->pub;
+
+	pthread_mutex_lock(&cache_lock);
+	entry->refs++;
+	pthread_mutex_unlock(&cache_lock);
+
+	for (i = 0; i < entry->n_chunks; i++) {
+		off = i * LOAD_CHUNK_SIZE;
+
+		entry->chunks[i].entry = entry;
+		entry->chunks[i].req.fd = entry->load_fd;
+		entry->chunks[i].req.buf = &entry->pub.data[off];
+		entry->chunks[i].req.len = entry->pub.size - off < LOAD_CHUNK_SIZE
+					 ? entry->pub.size - off
+					 : LOAD_CHUNK_SIZE;
+		entry->chunks[i].req.off = off;
+		entry->chunks[i].req.complete = load_complete;
+	}
+
+	for (i = 0; i < entry->n_chunks; i++)
+		hexagonfs_uring_read(&entry->chunks[i].req);
+
+	return &entry->pub;
+
+err:
+	free_entry(entry);
+	return NULL;
+}
+
+const struct hexagonfs_cache_entry *hexagonfs_cache_get(int fd,
+							const struct stat *phys)
+{
+	struct cache_entry *entry;
+	char *data;
+
+	if (!S_ISREG(phys->st_mode) || phys->st_size <= 0)
+		return NULL;
+
+	pthread_mutex_lock(&cache_lock);
+
+	if ((size_t) phys->st_size > cache_budget) {
+		pthread_mutex_unlock(&cache_lock);
+		return NULL;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	entry = get_entry(phys);
+	if (entry != NULL)
+		return &entry->pub;
+
+	if (hexagonfs_uring_enabled() && phys->st_size > LOAD_CHUNK_SIZE)
+		return load_async(fd, phys);
+
+	// Other requests can be handled while the file is read
+	data = read_whole_file(fd, phys->st_size);
+	if (data == NULL)
+		return NULL;
+
+	entry = alloc_entry();
+	if (entry == NULL) {
+		free(data);
+		return NULL;
+	}
+
+	entry->pub.data = data;
+	entry->pub.size = phys->st_size;
+	entry->cost = phys->st_size;
+	entry->loaded = phys->st_size;
+
+	return &insert_entry(entry, phys, true)->pub;
+}
+
+static bool is_loaded(const void *arg)
+{
+	const struct cache_entry *entry = ((const struct load_wait *) arg)->entry;
+	size_t end = ((const struct load_wait *) arg)->end;
+
+	return entry->loaded >= end || entry->load_error;
+}
+
+int hexagonfs_cache_wait(const struct hexagonfs_cache_entry *pub, size_t end)
+{
+	const struct cache_entry *entry = (const struct cache_entry *) pub;
+	struct load_wait wait = {
+		.entry = entry,
+		.end = end < pub->size ? end : pub->size,
+	};
+	int ret;
+
+	if (__atomic_load_n(&entry->loaded, __ATOMIC_ACQUIRE) >= wait.end)
+		return 0;
+
+	ret = hexagonfs_uring_wait(is_loaded, &wait);
+	if (ret)
+		return ret;
+
+	return __atomic_load_n(&entry->load_error, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Layout of the records returned by getdents64(), which is called directly
+ * because not every C library provides it.
+ */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static int compare_names(const void *a, const void *b)
+{
+	const char *const *name_a = a;
+	const char *const *name_b = b;
+
+	return strcmp(*name_a, *name_b);
+}
+
+static int grow(void **ptr, size_t *cap, size_t needed, size_t elem_size)
+{
+	size_t new_cap = *cap ? *cap : 64;
+	void *new_ptr;
+
+	if (needed <= *cap)
+		return 0;
+
+	while (new_cap < needed)
+		new_cap *= 2;
+
+	new_ptr = realloc(*ptr, new_cap * elem_size);
+	if (new_ptr == NULL)
+		return -ENOMEM;
+
+	*ptr = new_ptr;
+	*cap = new_cap;
+
+	return 0;
+}
+
+/*
+ * Read the names of all entries of a directory in one pass. They are collected
+ * in one buffer and copied to the entry in sorted order.
+ */
+static int read_whole_dir(int fd, struct cache_entry *entry)
+{
+	struct linux_dirent64 *ent;
+	const char **sorted = NULL;
+	char *buf, *names = NULL;
+	uint32_t *offsets = NULL;
+	size_t len = 0, cap = 0, n = 0, n_cap = 0;
+	size_t name_len, off, i;
+	long ret;
+
+	buf = malloc(DIR_READ_SIZE);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		ret = -errno;
+		goto err;
+	}
+
+	while ((ret = syscall(SYS_getdents64, fd, buf, DIR_READ_SIZE)) > 0) {
+		for (off = 0; off < (size_t) ret; off += ent->d_reclen) {
+			ent = (struct linux_dirent64 *) &buf[off];
+			name_len = strlen(ent->d_name) + 1;
+
+			if (grow((void **) &names, &cap, len + name_len, 1)
+			 || grow((void **) &offsets, &n_cap, n + 1, sizeof(*offsets))) {
+				ret = -ENOMEM;
+				goto err;
+			}
+
+			memcpy(&names[len], ent->d_name, name_len);
+			offsets[n++] = len;
+			len += name_len;
+		}
+	}
+
+	if (ret < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	sorted = malloc(sizeof(*sorted) * n);
+	entry->pub.data = malloc(len);
+	if ((n && sorted == NULL) || (len && entry->pub.data == NULL)) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < n; i++)
+		sorted[i] = &names[offsets[i]];
+
+	qsort(sorted, n, sizeof(*sorted), compare_names);
+
+	for (i = 0, off = 0; i < n; i++) {
+		name_len = strlen(sorted[i]) + 1;
+		memcpy(&entry->pub.data[off], sorted[i], name_len);
+		offsets[i] = off;
+		off += name_len;
+	}
+
+	entry->pub.size = len;
+	entry->pub.n_names = n;
+	entry->pub.names = offsets;
+	entry->cost = len + sizeof(*offsets) * n;
+
+	free(sorted);
+	free(names);
+	free(buf);
+
+	return 0;
+
+err:
+	free(entry->pub.data);
+	entry->pub.data = NULL;
+	free(sorted);
+	free(offsets);
+	free(names);
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Get a snapshot of the contents of a directory. Unlike files, directories
+ * are always read, and their snapshot is freed when it is put if it does not
+ * fit in the cache.
+ *
+ * A name added right after the snapshot could leave the directory with the
+ * same modification time, so recently modified directories are only cached
+ * if they are watched. The watch must be taken before the directory is read.
+ */
+int hexagonfs_cache_get_dir(int fd, const struct stat *phys,
+			    const struct hexagonfs_watch_ref *watch,
+			    const struct hexagonfs_cache_entry **out)
+{
+	struct cache_entry *entry;
+	struct timespec now;
+	int ret;
+
+	if (!S_ISDIR(phys->st_mode))
+		return -ENOTDIR;
+
+	entry = get_entry(phys);
+	if (entry != NULL) {
+		*out = &entry->pub;
+		return 0;
+	}
+
+	entry = alloc_entry();
+	if (entry == NULL)
+		return -ENOMEM;
+
+	ret = read_whole_dir(fd, entry);
+	if (ret) {
+		free(entry);
+		return ret;
+	}
+
+	if (watch != NULL && watch->watch != NULL)
+		entry->watch = *watch;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	*out = &insert_entry(entry, phys,
+			     entry->watch.watch != NULL
+			     || now.tv_sec - phys->st_mtim.tv_sec >= 2)->pub;
+
+	return 0;
+}
+
+void hexagonfs_cache_put(const struct hexagonfs_cache_entry *pub)
+{
+	struct cache_entry *entry = (struct cache_entry *) pub;
+	bool last;
+
+	pthread_mutex_lock(&cache_lock);
+	last = --entry->refs == 0 && entry->stale;
+	pthread_mutex_unlock(&cache_lock);
+
+	if (last)
+		free_entry(entry);
+}
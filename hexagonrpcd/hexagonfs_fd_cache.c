@@ -0,0 +1,187 @@
+/*
+ * HexagonFS cache of physical files that were closed recently
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hexagonfs.h"
+
+#define FD_CACHE_MAX 32
+
+/*
+ * The remote processor opens, reads and closes the same few files over and
+ * over. Instead of closing the physical file, the last few regular files are
+ * kept open, by physical path, and handed to the next open of the same path.
+ * Files are read at their own offset with pread(), so a reused file does not
+ * depend on where the previous reader stopped.
+ *
+ * An entry is only used if the directory of the path has not changed since
+ * the file was first opened, so that a file that was replaced or removed is
+ * opened again instead. The entries are kept in order of use, and the least
+ * recently closed one is closed when the cache is full.
+ */
+struct fd_cache_entry {
+	struct fd_cache_entry *next;
+
+	int fd;
+	struct hexagonfs_watch_ref watch;
+
+	uint32_t hash;
+	char path[];
+};
+
+static pthread_mutex_t fd_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fd_cache_entry *fd_cache;
+static size_t n_cached;
+
+static uint32_t hash_path(const char *path)
+{
+	uint32_t hash = 2166136261;
+
+	for (; *path != '\0'; path++) {
+		hash ^= (unsigned char) *path;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+/*
+ * Remove the entry for a path from the cache. This must be called with the
+ * lock held.
+ */
+static struct fd_cache_entry *unlink_entry(const char *path, uint32_t hash)
+{
+	struct fd_cache_entry **link, *entry;
+
+	for (link = &fd_cache; *link != NULL; link = &(*link)->next) {
+		entry = *link;
+
+		if (entry->hash == hash && !strcmp(entry->path, path)) {
+			*link = entry->next;
+			n_cached--;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove the least recently closed entry from a full cache. This must be
+ * called with the lock held.
+ */
+static struct fd_cache_entry *unlink_oldest(void)
+{
+	struct fd_cache_entry **link, *entry;
+
+	if (n_cached <= FD_CACHE_MAX)
+		return NULL;
+
+	for (link = &fd_cache; (*link)->next != NULL; link = &(*link)->next);
+
+	entry = *link;
+	*link = NULL;
+	n_cached--;
+
+	return entry;
+}
+
+static void close_entry(struct fd_cache_entry *entry)
+{
+	if (entry == NULL)
+		return;
+
+	close(entry->fd);
+	free(entry);
+}
+
+/*
+ * Take the file that was last closed at a path, if it can still be used. The
+ * file is removed from the cache, and the caller owns it. Returns -1 if the
+ * file has to be opened.
+ */
+int hexagonfs_fd_cache_take(const char *path, struct hexagonfs_watch_ref *watch)
+{
+	struct fd_cache_entry *entry;
+	int fd;
+
+	pthread_mutex_lock(&fd_cache_lock);
+	entry = unlink_entry(path, hash_path(path));
+	pthread_mutex_unlock(&fd_cache_lock);
+
+	if (entry == NULL)
+		return -1;
+
+	if (hexagonfs_watch_changed(&entry->watch)) {
+		close_entry(entry);
+		return -1;
+	}
+
+	fd = entry->fd;
+	*watch = entry->watch;
+
+	free(entry);
+
+	return fd;
+}
+
+/*
+ * Keep a regular file that is being closed for the next open of its path. The
+ * watch must have been taken on the parent directory before the file was
+ * opened. The file is closed if it cannot be kept.
+ */
+void hexagonfs_fd_cache_put(const char *path, int fd,
+			    const struct hexagonfs_watch_ref *watch)
+{
+	struct fd_cache_entry *entry, *old, *oldest;
+	size_t len = strlen(path);
+
+	entry = malloc(sizeof(*entry) + len + 1);
+	if (entry == NULL) {
+		close(fd);
+		return;
+	}
+
+	entry->fd = fd;
+	entry->watch = *watch;
+	entry->hash = hash_path(path);
+	memcpy(entry->path, path, len + 1);
+
+	pthread_mutex_lock(&fd_cache_lock);
+
+	old = unlink_entry(path, entry->hash);
+
+	entry->next = fd_cache;
+	fd_cache = entry;
+	n_cached++;
+
+	oldest = unlink_oldest();
+
+	pthread_mutex_unlock(&fd_cache_lock);
+
+	close_entry(old);
+	close_entry(oldest);
+}
@@ -0,0 +1,528 @@
+/*
+ * HexagonFS packed image backend
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "hexagonfs.h"
+#include "hexagonfs_image.h"
+
+/*
+ * The image normally stays mapped until the process exits, like the rest of
+ * the virtual filesystem.
+ */
+struct hexagonfs_image {
+	const char *base;
+	size_t size;
+
+	const struct hexagonfs_image_node *nodes;
+	uint32_t n_nodes;
+
+	const char *names;
+};
+
+struct image_ctx {
+	const struct hexagonfs_image *image;
+	const struct hexagonfs_image_node *node;
+
+	// Offset in the contents of files, or index of the next entry in directories
+	uint64_t off;
+};
+
+/*
+ * Nodes are used in place in the mapping, so their fields are converted from
+ * little-endian each time they are read.
+ */
+static bool is_dir(const struct hexagonfs_image_node *node)
+{
+	return le32toh(node->flags) & HEXAGONFS_IMAGE_NODE_DIR;
+}
+
+static const char *node_name(const struct hexagonfs_image *image,
+			     const struct hexagonfs_image_node *node)
+{
+	return &image->names[le32toh(node->name)];
+}
+
+static uint32_t node_first_child(const struct hexagonfs_image_node *node)
+{
+	return le32toh(node->first_child);
+}
+
+static uint32_t node_n_children(const struct hexagonfs_image_node *node)
+{
+	return le32toh(node->n_children);
+}
+
+static uint64_t node_data_off(const struct hexagonfs_image_node *node)
+{
+	return le64toh(node->data_off);
+}
+
+static uint64_t node_size(const struct hexagonfs_image_node *node)
+{
+	return le64toh(node->size);
+}
+
+/*
+ * Check every offset in the image once, so that nodes can be used without
+ * bounds checks afterwards.
+ */
+static int validate_image(struct hexagonfs_image *image)
+{
+	const struct hexagonfs_image_header *header;
+	const struct hexagonfs_image_node *node, *prev;
+	uint64_t nodes_end, names_off, names_size;
+	uint32_t i, j, first_child, n_children;
+
+	if (image->size < sizeof(*header))
+		return -EINVAL;
+
+	header = (const struct hexagonfs_image_header *) image->base;
+	if (memcmp(header->magic, HEXAGONFS_IMAGE_MAGIC, sizeof(header->magic))
+	 || le32toh(header->version) != HEXAGONFS_IMAGE_VERSION
+	 || le32toh(header->n_nodes) == 0)
+		return -EINVAL;
+
+	names_off = le64toh(header->names_off);
+	names_size = le64toh(header->names_size);
+
+	nodes_end = sizeof(*header)
+		  + (uint64_t) le32toh(header->n_nodes) * sizeof(struct hexagonfs_image_node);
+	if (nodes_end > image->size
+	 || names_off < nodes_end
+	 || names_off > image->size
+	 || names_size == 0
+	 || names_size > image->size - names_off)
+		return -EINVAL;
+
+	image->nodes = (const struct hexagonfs_image_node *) &image->base[sizeof(*header)];
+	image->n_nodes = le32toh(header->n_nodes);
+	image->names = &image->base[names_off];
+
+	if (image->names[names_size - 1] != '\0'
+	 || !is_dir(&image->nodes[0]))
+		return -EINVAL;
+
+	for (i = 0; i < image->n_nodes; i++) {
+		node = &image->nodes[i];
+
+		if (le32toh(node->name) >= names_size)
+			return -EINVAL;
+
+		if (!is_dir(node)) {
+			if (node_data_off(node) > image->size
+			 || node_size(node) > image->size - node_data_off(node))
+				return -EINVAL;
+
+			continue;
+		}
+
+		first_child = node_first_child(node);
+		n_children = node_n_children(node);
+
+		// Children come after their parent, so there are no cycles
+		if (n_children
+		 && (first_child <= i
+		  || first_child > image->n_nodes
+		  || n_children > image->n_nodes - first_child))
+			return -EINVAL;
+
+		for (j = 1; j < n_children; j++) {
+			prev = &image->nodes[first_child + j - 1];
+			if (strcmp(node_name(image, prev),
+				   node_name(image, prev + 1)) >= 0)
+				return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+int hexagonfs_image_open(const char *path, struct hexagonfs_image **out)
+{
+	struct hexagonfs_image *image;
+	struct stat stats;
+	void *map;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	ret = fstat(fd, &stats);
+	if (ret) {
+		ret = -errno;
+		goto err_close;
+	}
+
+	if (!S_ISREG(stats.st_mode) || stats.st_size <= 0) {
+		ret = -EINVAL;
+		goto err_close;
+	}
+
+	image = malloc(sizeof(*image));
+	if (image == NULL) {
+		ret = -ENOMEM;
+		goto err_close;
+	}
+
+	map = mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto err_free;
+	}
+
+	image->base = map;
+	image->size = stats.st_size;
+
+	ret = validate_image(image);
+	if (ret)
+		goto err_unmap;
+
+	close(fd);
+
+	*out = image;
+
+	return 0;
+
+err_unmap:
+	munmap(map, stats.st_size);
+err_free:
+	free(image);
+err_close:
+	close(fd);
+	return ret;
+}
+
+void hexagonfs_image_close(struct hexagonfs_image *image)
+{
+	munmap((void *) image->base, image->size);
+	free(image);
+}
+
+static const struct hexagonfs_image_node *find_child(const struct hexagonfs_image *image,
+						     const struct hexagonfs_image_node *dir,
+						     const char *name)
+{
+	const struct hexagonfs_image_node *children = &image->nodes[node_first_child(dir)];
+	uint32_t low = 0, high = node_n_children(dir), mid;
+	int cmp;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+
+		cmp = strcmp(name, node_name(image, &children[mid]));
+		if (cmp == 0)
+			return &children[mid];
+		else if (cmp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	return NULL;
+}
+
+int hexagonfs_image_lookup(const struct hexagonfs_image *image,
+			   const char *path,
+			   struct hexagonfs_image_file **out)
+{
+	const struct hexagonfs_image_node *node = &image->nodes[0];
+	struct hexagonfs_image_file *file;
+	char segment[256];
+	size_t len;
+
+	file = malloc(sizeof(*file));
+	if (file == NULL)
+		return -ENOMEM;
+
+	file->image = image;
+	file->node = 0;
+	file->exists = false;
+
+	while (*path != '\0' && node != NULL) {
+		len = strcspn(path, "/");
+
+		if (len >= sizeof(segment) || (len == 2 && !strncmp(path, "..", 2))) {
+			node = NULL;
+		} else if (len && !(len == 1 && *path == '.')) {
+			memcpy(segment, path, len);
+			segment[len] = '\0';
+
+			node = is_dir(node) ? find_child(image, node, segment) : NULL;
+		}
+
+		path += len;
+		while (*path == '/')
+			path++;
+	}
+
+	if (node != NULL) {
+		file->node = node - image->nodes;
+		file->exists = true;
+	}
+
+	*out = file;
+
+	return 0;
+}
+
+static void image_fill_stat(const struct hexagonfs_image_node *node,
+			    struct stat *stats)
+{
+	stats->st_dev = 0;
+	stats->st_rdev = 0;
+
+	stats->st_ino = 0;
+	stats->st_nlink = 0;
+
+	if (is_dir(node)) {
+		stats->st_size = 0;
+		stats->st_mode = S_IFDIR
+			       | S_IRUSR | S_IXUSR
+			       | S_IRGRP | S_IXGRP
+			       | S_IROTH | S_IXOTH;
+	} else {
+		stats->st_size = node_size(node);
+		stats->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+	}
+
+	stats->st_atim.tv_sec = (int64_t) le64toh(node->mtime_sec);
+	stats->st_atim.tv_nsec = (int64_t) le64toh(node->mtime_nsec);
+	stats->st_ctim = stats->st_atim;
+	stats->st_mtim = stats->st_atim;
+}
+
+static void image_close(void *fd_data)
+{
+}
+
+static int image_from_dirent(const void *dirent_data, bool dir, void *fd_data)
+{
+	const struct hexagonfs_image_file *file = dirent_data;
+	struct image_ctx *ctx = fd_data;
+
+	if (!file->exists)
+		return -ENOENT;
+
+	ctx->image = file->image;
+	ctx->node = &file->image->nodes[file->node];
+	ctx->off = 0;
+
+	if (dir && !is_dir(ctx->node))
+		return -ENOTDIR;
+
+	return 0;
+}
+
+static int image_lookup_child(struct hexagonfs_fd *dir,
+			      const char *segment,
+			      bool expect_dir,
+			      const struct hexagonfs_image_node **out)
+{
+	struct image_ctx *dir_ctx = dir->data;
+	const struct hexagonfs_image_node *node;
+
+	if (!is_dir(dir_ctx->node))
+		return -ENOTDIR;
+
+	node = find_child(dir_ctx->image, dir_ctx->node, segment);
+	if (node == NULL)
+		return -ENOENT;
+
+	if (expect_dir && !is_dir(node))
+		return -ENOTDIR;
+
+	*out = node;
+
+	return 0;
+}
+
+static int image_openat(struct hexagonfs_fd *dir,
+			const char *segment,
+			bool expect_dir,
+			struct hexagonfs_fd **out)
+{
+	struct image_ctx *dir_ctx = dir->data;
+	const struct hexagonfs_image_node *node;
+	struct hexagonfs_fd *fd;
+	struct image_ctx *ctx;
+	int ret;
+
+	ret = image_lookup_child(dir, segment, expect_dir, &node);
+	if (ret)
+		return ret;
+
+	fd = hexagonfs_fd_alloc(dir->table, dir, &hexagonfs_image_ops);
+	if (fd == NULL)
+		return -ENOMEM;
+
+	ctx = fd->data;
+	ctx->image = dir_ctx->image;
+	ctx->node = node;
+	ctx->off = 0;
+
+	*out = fd;
+
+	return 0;
+}
+
+static ssize_t image_read(struct hexagonfs_fd *fd, size_t size, void *out)
+{
+	struct image_ctx *ctx = fd->data;
+	const struct hexagonfs_image_node *node = ctx->node;
+
+	if (is_dir(node))
+		return -EISDIR;
+
+	if (ctx->off >= node_size(node))
+		return 0;
+
+	if (size > node_size(node) - ctx->off)
+		size = node_size(node) - ctx->off;
+
+	memcpy(out, &ctx->image->base[node_data_off(node) + ctx->off], size);
+	ctx->off += size;
+
+	return size;
+}
+
+/*
+ * Children are sorted by name, and listed after the entries for the directory
+ * itself and its parent.
+ */
+static int image_readdir(struct hexagonfs_fd *fd, size_t size, char *out)
+{
+	struct image_ctx *ctx = fd->data;
+	const struct hexagonfs_image_node *node = ctx->node;
+	const char *name;
+
+	if (!is_dir(node))
+		return -ENOTDIR;
+
+	if (ctx->off == 0)
+		name = ".";
+	else if (ctx->off == 1)
+		name = "..";
+	else if (ctx->off - 2 < node_n_children(node))
+		name = node_name(ctx->image, &ctx->image->nodes[node_first_child(node) + ctx->off - 2]);
+	else
+		name = "";
+
+	strncpy(out, name, size);
+	out[size - 1] = '\0';
+
+	if (*name != '\0')
+		ctx->off++;
+
+	return 0;
+}
+
+static int image_seek(struct hexagonfs_fd *fd, off_t off, int whence)
+{
+	struct image_ctx *ctx = fd->data;
+	off_t base;
+
+	if (is_dir(ctx->node))
+		return -EISDIR;
+
+	if (whence == SEEK_SET)
+		base = 0;
+	else if (whence == SEEK_CUR)
+		base = ctx->off;
+	else if (whence == SEEK_END)
+		base = node_size(ctx->node);
+	else
+		return -EINVAL;
+
+	if (off < -base)
+		return -EINVAL;
+
+	ctx->off = base + off;
+
+	return 0;
+}
+
+static int image_stat(struct hexagonfs_fd *fd, struct stat *stats)
+{
+	struct image_ctx *ctx = fd->data;
+
+	image_fill_stat(ctx->node, stats);
+
+	return 0;
+}
+
+static int image_statat(struct hexagonfs_fd *dir,
+			const char *segment,
+			bool expect_dir,
+			struct stat *stats)
+{
+	const struct hexagonfs_image_node *node;
+	int ret;
+
+	ret = image_lookup_child(dir, segment, expect_dir, &node);
+	if (ret)
+		return ret;
+
+	image_fill_stat(node, stats);
+
+	return 0;
+}
+
+static int image_stat_dirent(const void *dirent_data, bool dir,
+			     struct stat *stats)
+{
+	const struct hexagonfs_image_file *file = dirent_data;
+	const struct hexagonfs_image_node *node;
+
+	if (!file->exists)
+		return -ENOENT;
+
+	node = &file->image->nodes[file->node];
+	if (dir && !is_dir(node))
+		return -ENOTDIR;
+
+	image_fill_stat(node, stats);
+
+	return 0;
+}
+
+struct hexagonfs_file_ops hexagonfs_image_ops = {
+	.data_size = sizeof(struct image_ctx),
+	.close = image_close,
+	.from_dirent = image_from_dirent,
+	.openat = image_openat,
+	.read = image_read,
+	.readdir = image_readdir,
+	.seek = image_seek,
+	.stat = image_stat,
+	.statat = image_statat,
+	.stat_dirent = image_stat_dirent,
+};
@@ -0,0 +1,71 @@
+/*
+ * HexagonFS packed image format
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HEXAGONFS_IMAGE_H
+#define HEXAGONFS_IMAGE_H
+
+#include <stdint.h>
+
+/*
+ * An image holds a whole directory tree in one file, so that it can be mapped
+ * once and served without any system calls. All values are little-endian.
+ *
+ * The header is followed by the table of nodes, the table of names and the
+ * contents of the files. Node 0 is the root directory. The children of a
+ * directory are consecutive nodes, sorted by name, and always come after their
+ * parent.
+ */
+#define HEXAGONFS_IMAGE_MAGIC "HEXFSIMG"
+#define HEXAGONFS_IMAGE_VERSION 1
+
+// Contents of files are aligned to this many bytes
+#define HEXAGONFS_IMAGE_ALIGN 8
+
+struct hexagonfs_image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_nodes;
+
+	// Offset and size of the table of null-terminated names
+	uint64_t names_off;
+	uint64_t names_size;
+};
+
+#define HEXAGONFS_IMAGE_NODE_DIR 1
+
+struct hexagonfs_image_node {
+	// Offset of the name in the table of names
+	uint32_t name;
+	uint32_t flags;
+
+	// Directories: index of the first child and number of children
+	uint32_t first_child;
+	uint32_t n_children;
+
+	// Files: offset and size of the contents in the image
+	uint64_t data_off;
+	uint64_t size;
+
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+#endif
@@ -19,177 +19,516 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "hexagonfs.h"
 
+#define READ_BUFFER_MIN 4096
+#define READ_BUFFER_MAX 32768
+#define SNAPSHOT_MAX (1024 * 1024)
+
 struct mapped_ctx {
 	int fd;
-	DIR *dir;
+
+	// Physical path, so that the file can be opened again directly
+	char *path;
+
+	/*
+	 * Regular files are kept open when they are closed, for the next open
+	 * of the same path, if the watch on their directory was taken before
+	 * they were opened.
+	 */
+	bool regular;
+	struct hexagonfs_watch_ref watch;
+
+	/*
+	 * On the first read or seek, regular files are looked up in the
+	 * content cache, and read from memory at the given offset if they
+	 * are cached. Other files, like files that are not cached and sysfs
+	 * attributes, are read through a buffer. Both are read at this
+	 * offset, and never at the offset of the physical file, which can be
+	 * left over from an earlier open of the same path.
+	 */
+	bool contents_checked;
+	const char *contents;
+	size_t size;
+	const struct hexagonfs_cache_entry *cached;
+	off_t off;
+
+	// Sysfs attributes are read whole when opened, and served from a copy
+	char *snapshot;
+
+	// Other files are read through a buffer, which is allocated when needed
+	char *buf;
+	size_t buf_size;
+	size_t buf_pos;
+	size_t buf_len;
+
+	// Directories are listed from a sorted snapshot
+	const struct hexagonfs_cache_entry *listing;
+	size_t listing_pos;
 };
 
 static void mapped_close(void *fd_data)
 {
 	struct mapped_ctx *ctx = fd_data;
 
-	if (ctx->dir != NULL)
-		closedir(ctx->dir);
+	if (ctx->cached != NULL)
+		hexagonfs_cache_put(ctx->cached);
+
+	if (ctx->listing != NULL)
+		hexagonfs_cache_put(ctx->listing);
+
+	free(ctx->snapshot);
+	free(ctx->buf);
+
+	if (ctx->regular && ctx->watch.watch != NULL)
+		hexagonfs_fd_cache_put(ctx->path, ctx->fd, &ctx->watch);
 	else
 		close(ctx->fd);
 
-	free(ctx);
+	free(ctx->path);
 }
 
-static int mapped_from_dirent(const void *dirent_data, bool dir, void **fd_data)
+static char *join_path(const char *dir, const char *segment)
 {
-	struct mapped_ctx *ctx;
-	const char *name = dirent_data;
-	int flags = O_RDONLY;
-	int ret;
+	size_t dir_len = strlen(dir);
+	size_t segment_len = strlen(segment);
+	char *path;
 
-	ctx = malloc(sizeof(struct mapped_ctx));
-	if (ctx == NULL)
-		return -ENOMEM;
+	if (dir_len && dir[dir_len - 1] == '/')
+		dir_len--;
+
+	path = malloc(dir_len + segment_len + 2);
+	if (path == NULL)
+		return NULL;
+
+	memcpy(path, dir, dir_len);
+	path[dir_len] = '/';
+	memcpy(&path[dir_len + 1], segment, segment_len + 1);
+
+	return path;
+}
+
+/*
+ * Initialize the state of a file before it is opened, so that files that could
+ * not be opened, like missing sysfs directories, are in a known state.
+ */
+static void mapped_init_ctx(struct mapped_ctx *ctx)
+{
+	ctx->fd = -1;
+	ctx->path = NULL;
+	ctx->regular = false;
+	ctx->watch.watch = NULL;
+	ctx->listing = NULL;
+	ctx->contents_checked = false;
+	ctx->contents = NULL;
+	ctx->cached = NULL;
+	ctx->off = 0;
+	ctx->snapshot = NULL;
+	ctx->buf = NULL;
+	ctx->buf_size = 0;
+	ctx->buf_pos = 0;
+	ctx->buf_len = 0;
+}
+
+/*
+ * Open a physical file relative to a directory. Regular files can be taken
+ * from the files that were closed recently, if they are allowed to be reused.
+ * The path must already be set.
+ */
+static int mapped_open_phys(struct mapped_ctx *ctx, int dirfd,
+			    const char *name, bool dir, bool reuse)
+{
+	int flags = O_RDONLY;
 
 	if (dir)
 		flags |= O_DIRECTORY;
 
-	ctx->fd = open(name, flags);
-	if (ctx->fd == -1) {
-		ret = -errno;
-		goto err;
+	if (!dir && reuse) {
+		ctx->fd = hexagonfs_fd_cache_take(ctx->path, &ctx->watch);
+		if (ctx->fd != -1) {
+			ctx->regular = true;
+			return 0;
+		}
+
+		// Any change after the watch is taken is noticed
+		hexagonfs_watch_parent(ctx->path, &ctx->watch);
+
+		/*
+		 * The target of a symbolic link is in a directory that is
+		 * not watched, so links are opened normally and not reused.
+		 */
+		ctx->fd = openat(dirfd, name, flags | O_NOFOLLOW);
+		if (ctx->fd != -1)
+			return 0;
+
+		if (errno != ELOOP)
+			return -errno;
+
+		ctx->watch.watch = NULL;
 	}
 
-	ctx->dir = NULL;
+	ctx->fd = openat(dirfd, name, flags);
+	if (ctx->fd == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int mapped_from_path(const char *name, bool dir, bool reuse,
+			    struct mapped_ctx *ctx)
+{
+	int ret;
+
+	mapped_init_ctx(ctx);
 
-	*fd_data = ctx;
+	ctx->path = strdup(name);
+	if (ctx->path == NULL)
+		return -ENOMEM;
+
+	ret = mapped_open_phys(ctx, AT_FDCWD, name, dir, reuse);
+	if (ret) {
+		free(ctx->path);
+		ctx->path = NULL;
+		return ret;
+	}
 
 	return 0;
+}
 
-err:
-	free(ctx);
-	return ret;
+static int mapped_from_dirent(const void *dirent_data, bool dir, void *fd_data)
+{
+	return mapped_from_path(dirent_data, dir, true, fd_data);
 }
 
-static int mapped_openat(struct hexagonfs_fd *dir,
-			 const char *segment,
-			 bool expect_dir,
-			 struct hexagonfs_fd **out)
+static int mapped_open_child(struct hexagonfs_fd *dir,
+			     const char *segment,
+			     bool expect_dir,
+			     bool reuse,
+			     struct hexagonfs_file_ops *ops,
+			     struct hexagonfs_fd **out)
 {
 	struct mapped_ctx *dir_ctx = dir->data;
 	struct hexagonfs_fd *fd;
 	struct mapped_ctx *ctx;
-	int flags = O_RDONLY;
 	int ret;
 
-	ctx = malloc(sizeof(struct mapped_ctx));
-	if (ctx == NULL)
+	fd = hexagonfs_fd_alloc(dir->table, dir, ops);
+	if (fd == NULL)
 		return -ENOMEM;
 
-	fd = malloc(sizeof(struct hexagonfs_fd));
-	if (fd == NULL) {
-		ret = -ENOMEM;
-		goto err;
-	}
+	ctx = fd->data;
 
-	if (expect_dir)
-		flags |= O_DIRECTORY;
+	mapped_init_ctx(ctx);
 
-	ctx->fd = openat(dir_ctx->fd, segment, flags);
-	if (ctx->fd == -1) {
-		ret = -errno;
+	ctx->path = join_path(dir_ctx->path, segment);
+	if (ctx->path == NULL) {
+		ret = -ENOMEM;
 		goto err_free_fd;
 	}
 
-	ctx->dir = NULL;
-
-	fd->is_assigned = false;
-	fd->up = dir;
-	fd->ops = &hexagonfs_mapped_ops;
-	fd->data = ctx;
+	ret = mapped_open_phys(ctx, dir_ctx->fd, segment, expect_dir, reuse);
+	if (ret)
+		goto err_free_path;
 
 	*out = fd;
 
 	return 0;
 
+err_free_path:
+	free(ctx->path);
 err_free_fd:
-	free(fd);
-err:
-	free(ctx);
+	hexagonfs_fd_free(fd);
 	return ret;
 }
 
-static ssize_t mapped_read(struct hexagonfs_fd *fd, size_t size, void *out)
+static int mapped_openat(struct hexagonfs_fd *dir,
+			 const char *segment,
+			 bool expect_dir,
+			 struct hexagonfs_fd **out)
 {
-	struct mapped_ctx *ctx = fd->data;
+	return mapped_open_child(dir, segment, expect_dir, true,
+				 &hexagonfs_mapped_ops, out);
+}
+
+/*
+ * Files that are not cached are read with pread() rather than mapped. Served
+ * files can be rewritten in place, and a mapping of a file that is truncated
+ * raises SIGBUS when it is read.
+ */
+static void mapped_check_contents(struct mapped_ctx *ctx)
+{
+	struct stat phys;
+	int ret;
+
+	ctx->contents_checked = true;
+
+	ret = fstat(ctx->fd, &phys);
+	if (ret || !S_ISREG(phys.st_mode))
+		return;
+
+	ctx->regular = true;
+
+	if (phys.st_size <= 0)
+		return;
+
+	ctx->cached = hexagonfs_cache_get(ctx->fd, &phys);
+	if (ctx->cached != NULL) {
+		ctx->contents = ctx->cached->data;
+		ctx->size = ctx->cached->size;
+		return;
+	}
+
+	// Libraries and calibration files are read from start to end
+	posix_fadvise(ctx->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/*
+ * Stop reading from a cached copy that could not be loaded, and read from the
+ * file instead, at the same offset.
+ */
+static void mapped_drop_cached(struct mapped_ctx *ctx)
+{
+	hexagonfs_cache_put(ctx->cached);
+
+	ctx->cached = NULL;
+	ctx->contents = NULL;
+}
+
+/*
+ * Read from the offset of the file descriptor. Files that cannot seek are
+ * read in order.
+ */
+static ssize_t mapped_pread(struct mapped_ctx *ctx, void *buf, size_t size)
+{
+	ssize_t ret;
+
+	ret = pread(ctx->fd, buf, size, ctx->off);
+	if (ret < 0 && errno == ESPIPE)
+		ret = read(ctx->fd, buf, size);
+
+	if (ret > 0)
+		ctx->off += ret;
+
+	return ret;
+}
+
+/*
+ * Read the next part of a file into the buffer. The buffer starts small,
+ * because most files that are not in memory are short sysfs attributes, and
+ * doubles each time it is refilled.
+ */
+static ssize_t mapped_fill_buffer(struct mapped_ctx *ctx)
+{
+	size_t size;
 	ssize_t ret;
+	char *buf;
+
+	size = ctx->buf_size ? ctx->buf_size * 2 : READ_BUFFER_MIN;
+	if (size > READ_BUFFER_MAX)
+		size = READ_BUFFER_MAX;
+
+	if (size != ctx->buf_size) {
+		buf = realloc(ctx->buf, size);
+		if (buf == NULL)
+			return -ENOMEM;
+
+		ctx->buf = buf;
+		ctx->buf_size = size;
+	}
 
-	ret = read(ctx->fd, out, size);
+	ret = mapped_pread(ctx, ctx->buf, ctx->buf_size);
 	if (ret < 0)
 		return -errno;
 
+	ctx->buf_pos = 0;
+	ctx->buf_len = ret;
+
 	return ret;
 }
 
+/*
+ * Serve small reads from the buffer, so that they do not each need a system
+ * call. Reads that are at least as large as the buffer bypass it. A short
+ * read usually means the end of the file, so the buffer is not refilled after
+ * one until the next call.
+ */
+static ssize_t mapped_read_buffered(struct mapped_ctx *ctx,
+				    size_t size, char *out)
+{
+	size_t n = 0, avail, bypass;
+	bool short_fill = false;
+	ssize_t ret;
+
+	while (n < size) {
+		if (ctx->buf_pos == ctx->buf_len) {
+			bypass = ctx->buf_size ? ctx->buf_size : READ_BUFFER_MIN;
+			if (short_fill)
+				break;
+
+			if (size - n >= bypass) {
+				ret = mapped_pread(ctx, &out[n], size - n);
+				if (ret < 0)
+					return n ? (ssize_t) n : -errno;
+
+				return n + ret;
+			}
+
+			ret = mapped_fill_buffer(ctx);
+			if (ret < 0)
+				return n ? (ssize_t) n : ret;
+
+			if (!ret)
+				break;
+
+			short_fill = (size_t) ret < ctx->buf_size;
+		}
+
+		avail = ctx->buf_len - ctx->buf_pos;
+		if (avail > size - n)
+			avail = size - n;
+
+		memcpy(&out[n], &ctx->buf[ctx->buf_pos], avail);
+		ctx->buf_pos += avail;
+		n += avail;
+	}
+
+	return n;
+}
+
+static ssize_t mapped_read(struct hexagonfs_fd *fd, size_t size, void *out)
+{
+	struct mapped_ctx *ctx = fd->data;
+
+	if (!ctx->contents_checked)
+		mapped_check_contents(ctx);
+
+	if (ctx->contents != NULL) {
+		if ((size_t) ctx->off >= ctx->size)
+			return 0;
+
+		if (size > ctx->size - ctx->off)
+			size = ctx->size - ctx->off;
+
+		// Cached copies can still be loading in the background
+		if (ctx->cached != NULL
+		 && hexagonfs_cache_wait(ctx->cached, ctx->off + size)) {
+			mapped_drop_cached(ctx);
+			return mapped_read(fd, size, out);
+		}
+
+		memcpy(out, &ctx->contents[ctx->off], size);
+		ctx->off += size;
+
+		return size;
+	}
+
+	return mapped_read_buffered(ctx, size, out);
+}
+
+/*
+ * The directory is read and sorted in one pass on the first call, and the
+ * names are returned from the snapshot. Snapshots are shared between all
+ * file descriptors of the directory until it changes.
+ */
 static int mapped_readdir(struct hexagonfs_fd *fd, size_t size, char *out)
 {
 	struct mapped_ctx *ctx = fd->data;
-	struct dirent *ent;
+	const struct hexagonfs_cache_entry *listing;
+	struct hexagonfs_watch_ref watch;
+	struct stat phys;
+	int ret;
 
-	if (ctx->dir == NULL) {
-		ctx->dir = fdopendir(ctx->fd);
-		if (ctx->dir == NULL)
-			return -errno;
+	if (ctx->listing == NULL) {
+		hexagonfs_watch_dir(ctx->path, &watch);
 
-		ctx->fd = dirfd(ctx->dir);
-		if (ctx->fd == -1)
+		ret = fstat(ctx->fd, &phys);
+		if (ret)
 			return -errno;
+
+		ret = hexagonfs_cache_get_dir(ctx->fd, &phys, &watch,
+					      &ctx->listing);
+		if (ret) {
+			out[0] = '\0';
+			return ret;
+		}
+
+		ctx->listing_pos = 0;
 	}
 
-	errno = 0;
+	listing = ctx->listing;
 
-	ent = readdir(ctx->dir);
-	if (ent == NULL) {
+	if (ctx->listing_pos >= listing->n_names) {
 		out[0] = '\0';
-		return -errno;
+		return 0;
 	}
 
-	strncpy(out, ent->d_name, size);
+	strncpy(out, &listing->data[listing->names[ctx->listing_pos]], size);
 	out[size - 1] = '\0';
 
+	ctx->listing_pos++;
+
 	return 0;
 }
 
 static int mapped_seek(struct hexagonfs_fd *fd, off_t off, int whence)
 {
 	struct mapped_ctx *ctx = fd->data;
-	int ret;
+	off_t base;
 
-	ret = lseek(ctx->fd, off, whence);
-	if (ret == -1)
-		return -errno;
+	if (!ctx->contents_checked)
+		mapped_check_contents(ctx);
+
+	if (ctx->contents != NULL) {
+		if (whence == SEEK_SET)
+			base = 0;
+		else if (whence == SEEK_CUR)
+			base = ctx->off;
+		else if (whence == SEEK_END)
+			base = ctx->size;
+		else
+			return -EINVAL;
+
+		if (off < -base)
+			return -EINVAL;
+
+		ctx->off = base + off;
+
+		return 0;
+	}
+
+	if (whence == SEEK_SET) {
+		base = 0;
+	} else if (whence == SEEK_CUR) {
+		// The offset is ahead of the reader by the data left in the buffer
+		base = ctx->off - (ctx->buf_len - ctx->buf_pos);
+	} else {
+		base = lseek(ctx->fd, 0, whence);
+		if (base == -1)
+			return -errno;
+	}
+
+	if (off < -base)
+		return -EINVAL;
+
+	ctx->off = base + off;
+	ctx->buf_pos = 0;
+	ctx->buf_len = 0;
 
 	return 0;
 }
 
-static int mapped_stat(struct hexagonfs_fd *fd, struct stat *stats)
+static void mapped_fill_stat(const struct stat *phys, struct stat *stats)
 {
-	struct mapped_ctx *ctx = fd->data;
-	struct stat phys;
-	int ret;
-
-	ret = fstat(ctx->fd, &phys);
-	if (ret)
-		return -errno;
-
-	stats->st_size = phys.st_size;
+	stats->st_size = phys->st_size;
 
 	stats->st_dev = 0;
 	stats->st_rdev = 0;
@@ -197,7 +536,7 @@ static int mapped_stat(struct hexagonfs_fd *fd, struct stat *stats)
 	stats->st_ino = 0;
 	stats->st_nlink = 0;
 
-	if (phys.st_mode & S_IFDIR) {
+	if (phys->st_mode & S_IFDIR) {
 		stats->st_mode = S_IFDIR
 			       | S_IRUSR | S_IXUSR
 			       | S_IRGRP | S_IXGRP
@@ -206,29 +545,111 @@ static int mapped_stat(struct hexagonfs_fd *fd, struct stat *stats)
 		stats->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
 	}
 
-	stats->st_atim.tv_sec = phys.st_atim.tv_sec;
-	stats->st_atim.tv_nsec = phys.st_atim.tv_nsec;
-	stats->st_ctim.tv_sec = phys.st_ctim.tv_sec;
-	stats->st_ctim.tv_nsec = phys.st_ctim.tv_nsec;
-	stats->st_mtim.tv_sec = phys.st_mtim.tv_sec;
-	stats->st_mtim.tv_nsec = phys.st_mtim.tv_nsec;
+	stats->st_atim.tv_sec = phys->st_atim.tv_sec;
+	stats->st_atim.tv_nsec = phys->st_atim.tv_nsec;
+	stats->st_ctim.tv_sec = phys->st_ctim.tv_sec;
+	stats->st_ctim.tv_nsec = phys->st_ctim.tv_nsec;
+	stats->st_mtim.tv_sec = phys->st_mtim.tv_sec;
+	stats->st_mtim.tv_nsec = phys->st_mtim.tv_nsec;
+}
+
+static int mapped_stat(struct hexagonfs_fd *fd, struct stat *stats)
+{
+	struct mapped_ctx *ctx = fd->data;
+	struct stat phys;
+	int ret;
+
+	ret = fstat(ctx->fd, &phys);
+	if (ret)
+		return -errno;
+
+	mapped_fill_stat(&phys, stats);
 
 	return 0;
 }
 
+static int mapped_check_stat(const struct stat *phys, bool expect_dir,
+			     struct stat *stats)
+{
+	if (expect_dir && !S_ISDIR(phys->st_mode))
+		return -ENOTDIR;
+
+	mapped_fill_stat(phys, stats);
+
+	return 0;
+}
+
+/*
+ * Children of physical directories are opened with the plain mapped
+ * operations, so they are stat'd the same way.
+ */
+static int mapped_statat(struct hexagonfs_fd *dir,
+			 const char *segment,
+			 bool expect_dir,
+			 struct stat *stats)
+{
+	struct mapped_ctx *ctx = dir->data;
+	struct stat phys;
+	int ret;
+
+	ret = fstatat(ctx->fd, segment, &phys, 0);
+	if (ret)
+		return -errno;
+
+	return mapped_check_stat(&phys, expect_dir, stats);
+}
+
+static int mapped_stat_dirent(const void *dirent_data, bool dir,
+			      struct stat *stats)
+{
+	struct stat phys;
+	int ret;
+
+	ret = stat(dirent_data, &phys);
+	if (ret)
+		return -errno;
+
+	return mapped_check_stat(&phys, dir, stats);
+}
+
+static int mapped_to_dirent(struct hexagonfs_fd *fd, char **dirent_data)
+{
+	struct mapped_ctx *ctx = fd->data;
+
+	*dirent_data = strdup(ctx->path);
+	if (*dirent_data == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Files that could not be opened are empty directories. They are marked with
+ * a negative file descriptor.
+ */
+static bool mapped_or_empty_exists(const struct hexagonfs_fd *fd)
+{
+	const struct mapped_ctx *ctx = fd->data;
+
+	return ctx->fd != -1;
+}
+
 static void mapped_or_empty_close(void *fd_data)
 {
-	if (fd_data)
+	struct mapped_ctx *ctx = fd_data;
+
+	if (ctx->fd != -1)
 		mapped_close(fd_data);
 }
 
-static int mapped_or_empty_from_dirent(const void *dirent_data, bool dir, void **fd_data)
+static int mapped_or_empty_from_dirent(const void *dirent_data, bool dir, void *fd_data)
 {
+	struct mapped_ctx *ctx = fd_data;
 	int ret;
 
 	ret = mapped_from_dirent(dirent_data, dir, fd_data);
 	if (ret)
-		*fd_data = NULL;
+		ctx->fd = -1;
 
 	return 0;
 }
@@ -238,7 +659,7 @@ static int mapped_or_empty_openat(struct hexagonfs_fd *dir,
 				  bool expect_dir,
 				  struct hexagonfs_fd **out)
 {
-	if (dir->data)
+	if (mapped_or_empty_exists(dir))
 		return mapped_openat(dir, segment, expect_dir, out);
 	else
 		return -ENOENT;
@@ -247,7 +668,7 @@ static int mapped_or_empty_openat(struct hexagonfs_fd *dir,
 static ssize_t mapped_or_empty_read(struct hexagonfs_fd *fd,
 				    size_t size, void *out)
 {
-	if (fd->data)
+	if (mapped_or_empty_exists(fd))
 		return mapped_read(fd, size, out);
 
 	return 0;
@@ -256,7 +677,7 @@ static ssize_t mapped_or_empty_read(struct hexagonfs_fd *fd,
 static int mapped_or_empty_readdir(struct hexagonfs_fd *fd,
 				   size_t size, char *out)
 {
-	if (fd->data) {
+	if (mapped_or_empty_exists(fd)) {
 		return mapped_readdir(fd, size, out);
 	} else {
 		out[0] = '\0';
@@ -266,63 +687,252 @@ static int mapped_or_empty_readdir(struct hexagonfs_fd *fd,
 
 static int mapped_or_empty_seek(struct hexagonfs_fd *fd, off_t off, int whence)
 {
-	if (fd->data)
+	if (mapped_or_empty_exists(fd))
 		return mapped_seek(fd, off, whence);
 	else
 		return 0;
 }
 
+static int mapped_or_empty_to_dirent(struct hexagonfs_fd *fd, char **dirent_data)
+{
+	if (mapped_or_empty_exists(fd))
+		return mapped_to_dirent(fd, dirent_data);
+	else
+		return -ENOENT;
+}
+
+static void mapped_or_empty_fill_empty(struct stat *stats)
+{
+	stats->st_size = 0;
+	stats->st_dev = 0;
+	stats->st_rdev = 0;
+	stats->st_ino = 0;
+	stats->st_nlink = 0;
+
+	stats->st_mode = S_IFDIR
+		       | S_IRUSR | S_IXUSR
+		       | S_IRGRP | S_IXGRP
+		       | S_IROTH | S_IXOTH;
+
+	stats->st_atim.tv_sec = 0;
+	stats->st_atim.tv_nsec = 0;
+	stats->st_ctim.tv_sec = 0;
+	stats->st_ctim.tv_nsec = 0;
+	stats->st_mtim.tv_sec = 0;
+	stats->st_mtim.tv_nsec = 0;
+}
+
 static int mapped_or_empty_stat(struct hexagonfs_fd *fd, struct stat *stats)
 {
-	if (fd->data) {
+	if (mapped_or_empty_exists(fd)) {
 		return mapped_stat(fd, stats);
 	} else {
-		stats->st_size = 0;
-		stats->st_dev = 0;
-		stats->st_rdev = 0;
-		stats->st_ino = 0;
-		stats->st_nlink = 0;
+		mapped_or_empty_fill_empty(stats);
+		return 0;
+	}
+}
 
-		stats->st_mode = S_IFDIR
-			       | S_IRUSR | S_IXUSR
-			       | S_IRGRP | S_IXGRP
-			       | S_IROTH | S_IXOTH;
+static int mapped_or_empty_statat(struct hexagonfs_fd *dir,
+				  const char *segment,
+				  bool expect_dir,
+				  struct stat *stats)
+{
+	if (mapped_or_empty_exists(dir))
+		return mapped_statat(dir, segment, expect_dir, stats);
+	else
+		return -ENOENT;
+}
 
-		stats->st_atim.tv_sec = 0;
-		stats->st_atim.tv_nsec = 0;
-		stats->st_ctim.tv_sec = 0;
-		stats->st_ctim.tv_nsec = 0;
-		stats->st_mtim.tv_sec = 0;
-		stats->st_mtim.tv_nsec = 0;
+static int mapped_or_empty_stat_dirent(const void *dirent_data, bool dir,
+				       struct stat *stats)
+{
+	int ret;
 
-		return 0;
+	ret = mapped_stat_dirent(dirent_data, dir, stats);
+	if (ret)
+		mapped_or_empty_fill_empty(stats);
+
+	return 0;
+}
+
+/*
+ * Sysfs attributes are generated by the kernel on every read, and report a
+ * size that has nothing to do with their contents. They are read whole when
+ * they are opened, so that the remote processor sees consistent contents and
+ * their exact size, and reads and seeks do not need system calls. Files that
+ * are not regular, or too large, are read normally.
+ */
+static void mapped_snapshot(struct mapped_ctx *ctx)
+{
+	size_t size = 0, alloc = READ_BUFFER_MIN;
+	struct stat phys;
+	char *buf, *tmp;
+	ssize_t ret;
+
+	if (fstat(ctx->fd, &phys) || !S_ISREG(phys.st_mode))
+		return;
+
+	buf = malloc(alloc);
+	if (buf == NULL)
+		return;
+
+	for (;;) {
+		if (size == alloc) {
+			if (alloc >= SNAPSHOT_MAX)
+				goto err;
+
+			alloc *= 2;
+			tmp = realloc(buf, alloc);
+			if (tmp == NULL)
+				goto err;
+
+			buf = tmp;
+		}
+
+		ret = pread(ctx->fd, &buf[size], alloc - size, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			goto err;
+
+		if (!ret)
+			break;
+
+		size += ret;
 	}
+
+	ctx->snapshot = buf;
+	ctx->contents = buf;
+	ctx->size = size;
+	ctx->off = 0;
+	ctx->contents_checked = true;
+
+	return;
+
+err:
+	free(buf);
 }
 
 /*
- * This is the sysfs variant of the stat function.
- *
- * The remote processor expects a non-zero size if the file is not empty, even
- * if a size cannot be determined without reading. The size is 256 on
- * downstream kernels, so set it to that.
- *
- * Otherwise, the existing stat() function can be used.
+ * Paths that are mapped with the sysfs operations may not exist, like with
+ * mapped_or_empty. Their children always exist once opened, so they only
+ * differ in how they are opened again from the path cache.
  */
+static struct hexagonfs_file_ops mapped_sysfs_child_ops;
+
+static int mapped_sysfs_from_dirent(const void *dirent_data, bool dir,
+				    void *fd_data)
+{
+	struct mapped_ctx *ctx = fd_data;
+	int ret;
+
+	ret = mapped_from_path(dirent_data, dir, false, ctx);
+	if (ret)
+		ctx->fd = -1;
+	else if (!dir)
+		mapped_snapshot(ctx);
+
+	return 0;
+}
+
+static int mapped_sysfs_child_from_dirent(const void *dirent_data, bool dir,
+					  void *fd_data)
+{
+	int ret;
+
+	ret = mapped_from_path(dirent_data, dir, false, fd_data);
+	if (ret)
+		return ret;
+
+	if (!dir)
+		mapped_snapshot(fd_data);
+
+	return 0;
+}
+
+static int mapped_sysfs_openat(struct hexagonfs_fd *dir,
+			       const char *segment,
+			       bool expect_dir,
+			       struct hexagonfs_fd **out)
+{
+	int ret;
+
+	if (!mapped_or_empty_exists(dir))
+		return -ENOENT;
+
+	ret = mapped_open_child(dir, segment, expect_dir, false,
+				&mapped_sysfs_child_ops, out);
+	if (ret)
+		return ret;
+
+	if (!expect_dir)
+		mapped_snapshot((*out)->data);
+
+	return 0;
+}
+
 static int mapped_sysfs_stat(struct hexagonfs_fd *fd, struct stat *stats)
 {
+	struct mapped_ctx *ctx = fd->data;
 	int ret;
 
-	ret = mapped_stat(fd, stats);
+	ret = mapped_or_empty_stat(fd, stats);
 	if (ret)
 		return ret;
 
-	if (!(stats->st_mode & S_IFDIR))
-		stats->st_size = 256;
+	if (ctx->snapshot != NULL)
+		stats->st_size = ctx->size;
 
 	return 0;
 }
 
+/*
+ * The size of an attribute is only known once it has been read, so files are
+ * stat'd by opening them.
+ */
+static int mapped_sysfs_check_stat(int ret, const struct stat *stats)
+{
+	if (!ret && !S_ISDIR(stats->st_mode))
+		return -ENOSYS;
+
+	return ret;
+}
+
+static int mapped_sysfs_statat(struct hexagonfs_fd *dir,
+			       const char *segment,
+			       bool expect_dir,
+			       struct stat *stats)
+{
+	int ret;
+
+	ret = mapped_or_empty_statat(dir, segment, expect_dir, stats);
+
+	return mapped_sysfs_check_stat(ret, stats);
+}
+
+static int mapped_sysfs_stat_dirent(const void *dirent_data, bool dir,
+				    struct stat *stats)
+{
+	int ret;
+
+	ret = mapped_or_empty_stat_dirent(dirent_data, dir, stats);
+
+	return mapped_sysfs_check_stat(ret, stats);
+}
+
+static int mapped_sysfs_child_stat_dirent(const void *dirent_data, bool dir,
+					  struct stat *stats)
+{
+	int ret;
+
+	ret = mapped_stat_dirent(dirent_data, dir, stats);
+
+	return mapped_sysfs_check_stat(ret, stats);
+}
+
 struct hexagonfs_file_ops hexagonfs_mapped_ops = {
+	.data_size = sizeof(struct mapped_ctx),
 	.close = mapped_close,
 	.from_dirent = mapped_from_dirent,
 	.openat = mapped_openat,
@@ -330,9 +940,13 @@ struct hexagonfs_file_ops hexagonfs_mapped_ops = {
 	.readdir = mapped_readdir,
 	.seek = mapped_seek,
 	.stat = mapped_stat,
+	.to_dirent = mapped_to_dirent,
+	.statat = mapped_statat,
+	.stat_dirent = mapped_stat_dirent,
 };
 
 struct hexagonfs_file_ops hexagonfs_mapped_or_empty_ops = {
+	.data_size = sizeof(struct mapped_ctx),
 	.close = mapped_or_empty_close,
 	.from_dirent = mapped_or_empty_from_dirent,
 	.openat = mapped_or_empty_openat,
@@ -340,14 +954,35 @@ struct hexagonfs_file_ops hexagonfs_mapped_or_empty_ops = {
 	.readdir = mapped_or_empty_readdir,
 	.seek = mapped_or_empty_seek,
 	.stat = mapped_or_empty_stat,
+	.to_dirent = mapped_or_empty_to_dirent,
+	.statat = mapped_or_empty_statat,
+	.stat_dirent = mapped_or_empty_stat_dirent,
 };
 
 struct hexagonfs_file_ops hexagonfs_mapped_sysfs_ops = {
-	.close = mapped_close,
-	.from_dirent = mapped_from_dirent,
-	.openat = mapped_openat,
-	.read = mapped_read,
-	.readdir = mapped_readdir,
-	.seek = mapped_seek,
+	.data_size = sizeof(struct mapped_ctx),
+	.close = mapped_or_empty_close,
+	.from_dirent = mapped_sysfs_from_dirent,
+	.openat = mapped_sysfs_openat,
+	.read = mapped_or_empty_read,
+	.readdir = mapped_or_empty_readdir,
+	.seek = mapped_or_empty_seek,
+	.stat = mapped_sysfs_stat,
+	.to_dirent = mapped_or_empty_to_dirent,
+	.statat = mapped_sysfs_statat,
+	.stat_dirent = mapped_sysfs_stat_dirent,
+};
+
+static struct hexagonfs_file_ops mapped_sysfs_child_ops = {
+	.data_size = sizeof(struct mapped_ctx),
+	.close = mapped_or_empty_close,
+	.from_dirent = mapped_sysfs_child_from_dirent,
+	.openat = mapped_sysfs_openat,
+	.read = mapped_or_empty_read,
+	.readdir = mapped_or_empty_readdir,
+	.seek = mapped_or_empty_seek,
 	.stat = mapped_sysfs_stat,
+	.to_dirent = mapped_or_empty_to_dirent,
+	.statat = mapped_sysfs_statat,
+	.stat_dirent = mapped_sysfs_child_stat_dirent,
 };
@@ -1,5 +1,5 @@
 /*
- * HexagonFS operations for a missing sysfs file
+ * HexagonFS contents of a missing sysfs file
  *
  * Copyright (C) 2023 The Sensor Shell Contributors
  *
@@ -20,84 +20,32 @@
  */
 
 #include <errno.h>
-#include <fcntl.h>
-#include <stdlib.h>
-#include <unistd.h>
+#include <sys/stat.h>
 
 #include "hexagonfs.h"
 
-struct plat_subtype_ctx {
-	int fd;
-	char *name;
-};
-
-static void plat_subtype_name_close(void *fd_data)
-{
-	struct plat_subtype_ctx *ctx = fd_data;
-
-	close(ctx->fd);
-
-	if (ctx->name != NULL)
-		free(ctx->name);
-}
-
-static int plat_subtype_name_from_dirent(const void *dirent_data,
-					 bool dir,
-					 void **fd_data)
-{
-	struct plat_subtype_ctx *ctx;
-
-	if (dir)
-		return -ENOTDIR;
-
-	ctx = malloc(sizeof(struct plat_subtype_ctx));
-	if (ctx == NULL)
-		return -ENOMEM;
-
-	ctx->fd = open(dirent_data, O_RDONLY);
-	if (ctx->fd == -1)
-		return -errno;
-
-	ctx->name = NULL;
-
-	*fd_data = ctx;
-
-	return 0;
-}
-
-static int plat_subtype_name_openat(struct hexagonfs_fd *dir,
-			const char *segment,
-			bool expect_dir,
-			struct hexagonfs_fd **out)
-{
-	return -ENOTDIR;
-}
-
-static int plat_subtype_stat(struct hexagonfs_fd *fd, struct stat *stats)
+/*
+ * The remote processor opens this file on downstream kernels, where it is
+ * part of socinfo, and only needs it to exist. It is served as an empty file
+ * when the sysfs attribute that it stands in for, given as a directory entry,
+ * exists.
+ */
+int hexagonfs_plat_subtype_name_generate(const void *source, char **data,
+					 size_t *size)
 {
-	stats->st_size = 0;
+	const struct hexagonfs_dirent *ent = source;
+	struct stat stats;
+	int ret;
 
-	stats->st_dev = 0;
-	stats->st_rdev = 0;
+	if (ent->ops->stat_dirent == NULL)
+		return -ENOSYS;
 
-	stats->st_ino = 0;
-	stats->st_nlink = 0;
+	ret = ent->ops->stat_dirent(ent->u.ptr, false, &stats);
+	if (ret)
+		return ret;
 
-	stats->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
-
-	stats->st_atim.tv_sec = 0;
-	stats->st_atim.tv_nsec = 0;
-	stats->st_ctim.tv_sec = 0;
-	stats->st_ctim.tv_nsec = 0;
-	stats->st_mtim.tv_sec = 0;
-	stats->st_mtim.tv_nsec = 0;
+	*data = NULL;
+	*size = 0;
 
 	return 0;
 }
-
-struct hexagonfs_file_ops hexagonfs_plat_subtype_name_ops = {
-	.close = plat_subtype_name_close,
-	.from_dirent = plat_subtype_name_from_dirent,
-	.openat = plat_subtype_name_openat,
-	.stat = plat_subtype_stat,
-};
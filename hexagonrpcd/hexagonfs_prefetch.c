@@ -0,0 +1,318 @@
+/*
+ * HexagonFS prefetching of files opened on previous runs
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hexagonfs.h"
+
+#define PREFETCH_BUCKETS 256
+#define PREFETCH_MAX 4096
+#define PREFETCH_READ_SIZE 65536
+#define PREFETCH_MAX_FD 16
+
+/*
+ * The remote processor opens the same libraries and calibration files in the
+ * same order every time it boots. The virtual path of every file that it
+ * opens is appended to a list the first time it is opened, and the files in
+ * the list are read in the background when the daemon starts, so that they
+ * are in memory before the remote processor asks for them.
+ */
+struct prefetch_path {
+	struct prefetch_path *next;
+	struct prefetch_path *hash_next;
+
+	char path[];
+};
+
+struct prefetch_job {
+	size_t n_roots;
+	struct hexagonfs_dirent **roots;
+
+	size_t n_paths;
+	struct prefetch_path **paths;
+};
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int list_fd = -1;
+
+static struct prefetch_path *paths;
+static struct prefetch_path **paths_tail = &paths;
+static struct prefetch_path *prefetch_buckets[PREFETCH_BUCKETS];
+static size_t n_paths;
+
+static uint32_t hash_path(const char *path, size_t len)
+{
+	uint32_t hash = 2166136261;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) path[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+/*
+ * Add a path to the list, unless it is already there. This must be called
+ * with the lock held.
+ */
+static int add_path(const char *path, size_t len)
+{
+	struct prefetch_path **bucket, *entry;
+
+	bucket = &prefetch_buckets[hash_path(path, len) % PREFETCH_BUCKETS];
+
+	for (entry = *bucket; entry != NULL; entry = entry->hash_next) {
+		if (!strncmp(entry->path, path, len) && entry->path[len] == '\0')
+			return -EEXIST;
+	}
+
+	if (n_paths >= PREFETCH_MAX)
+		return -ENOSPC;
+
+	entry = malloc(sizeof(*entry) + len + 1);
+	if (entry == NULL)
+		return -ENOMEM;
+
+	memcpy(entry->path, path, len);
+	entry->path[len] = '\0';
+
+	entry->next = NULL;
+	*paths_tail = entry;
+	paths_tail = &entry->next;
+
+	entry->hash_next = *bucket;
+	*bucket = entry;
+
+	n_paths++;
+
+	return 0;
+}
+
+static int read_list(int fd)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *file;
+	int dup_fd;
+
+	dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup_fd == -1)
+		return -errno;
+
+	file = fdopen(dup_fd, "r");
+	if (file == NULL) {
+		close(dup_fd);
+		return -errno;
+	}
+
+	while ((len = getline(&line, &size, file)) != -1) {
+		if (len && line[len - 1] == '\n')
+			len--;
+
+		if (len && line[0] == '/')
+			add_path(line, len);
+	}
+
+	free(line);
+	fclose(file);
+
+	return 0;
+}
+
+int hexagonfs_prefetch_open(const char *list)
+{
+	int ret;
+
+	if (list_fd != -1)
+		return -EBUSY;
+
+	list_fd = open(list, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (list_fd == -1)
+		return -errno;
+
+	ret = read_list(list_fd);
+	if (ret) {
+		close(list_fd);
+		list_fd = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Remember a file that the remote processor opened, by the name it used and
+ * the virtual directory it was opened from.
+ */
+void hexagonfs_prefetch_record(const char *dir, const char *name)
+{
+	char path[4096];
+	int len;
+
+	if (list_fd == -1)
+		return;
+
+	if (name[0] == '/')
+		len = snprintf(path, sizeof(path), "%s\n", name);
+	else
+		len = snprintf(path, sizeof(path), "%s%s\n", dir, name);
+
+	if (len < 0 || (size_t) len >= sizeof(path)
+	 || memchr(path, '\n', len - 1) != NULL)
+		return;
+
+	pthread_mutex_lock(&prefetch_lock);
+
+	// The list is appended to in one write, so it is never left half-written
+	if (!add_path(path, len - 1) && write(list_fd, path, len) != len)
+		fprintf(stderr, "Could not update prefetch list: %s\n",
+				strerror(errno));
+
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+static void read_file(struct hexagonfs_fd_table *fds, int rootfd,
+		      const char *path, char *buf)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = hexagonfs_openat(fds, rootfd, rootfd, path);
+	if (fd < 0)
+		return;
+
+	do {
+		ret = hexagonfs_read(fds, fd, PREFETCH_READ_SIZE, buf);
+	} while (ret > 0);
+
+	hexagonfs_close(fds, fd);
+}
+
+static void *prefetch_thread(void *data)
+{
+	struct prefetch_job *job = data;
+	struct hexagonfs_fd_table fds;
+	size_t i, j;
+	int rootfd;
+	char *buf;
+
+	buf = malloc(PREFETCH_READ_SIZE);
+	if (buf == NULL)
+		goto out;
+
+	for (i = 0; i < job->n_roots; i++) {
+		if (hexagonfs_fd_table_init(&fds, PREFETCH_MAX_FD))
+			break;
+
+		rootfd = hexagonfs_open_root(&fds, job->roots[i]);
+		if (rootfd >= 0) {
+			for (j = 0; j < job->n_paths; j++)
+				read_file(&fds, rootfd, job->paths[j]->path, buf);
+		}
+
+		hexagonfs_fd_table_deinit(&fds);
+	}
+
+	free(buf);
+
+out:
+	free(job->paths);
+	free(job->roots);
+	free(job);
+
+	return NULL;
+}
+
+/*
+ * Read the files in the list through each of the virtual filesystems in a
+ * background thread. This fills the content cache, or the page cache of the
+ * kernel if the files are not cached.
+ */
+int hexagonfs_prefetch_start(size_t n_roots, struct hexagonfs_dirent *const *roots)
+{
+	struct prefetch_path *entry;
+	struct prefetch_job *job;
+	pthread_attr_t attr;
+	pthread_t thread;
+	size_t i;
+	int ret;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL)
+		return -ENOMEM;
+
+	job->n_roots = n_roots;
+	job->roots = malloc(sizeof(*job->roots) * n_roots);
+	if (job->roots == NULL) {
+		ret = -ENOMEM;
+		goto err_free_job;
+	}
+
+	memcpy(job->roots, roots, sizeof(*job->roots) * n_roots);
+
+	pthread_mutex_lock(&prefetch_lock);
+
+	job->n_paths = n_paths;
+	job->paths = malloc(sizeof(*job->paths) * (n_paths ? n_paths : 1));
+	if (job->paths == NULL) {
+		pthread_mutex_unlock(&prefetch_lock);
+		ret = -ENOMEM;
+		goto err_free_roots;
+	}
+
+	for (entry = paths, i = 0; entry != NULL; entry = entry->next, i++)
+		job->paths[i] = entry;
+
+	pthread_mutex_unlock(&prefetch_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	ret = pthread_create(&thread, &attr, prefetch_thread, job);
+
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		ret = -ret;
+		goto err_free_paths;
+	}
+
+	return 0;
+
+err_free_paths:
+	free(job->paths);
+err_free_roots:
+	free(job->roots);
+err_free_job:
+	free(job);
+	return ret;
+}
@@ -0,0 +1,205 @@
+/*
+ * HexagonFS operations for files with generated contents
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "hexagonfs.h"
+
+struct synthetic_ctx {
+	const struct hexagonfs_synthetic_file *file;
+	off_t off;
+};
+
+// Serializes generation, so that each file is generated at most once
+static pthread_mutex_t synthetic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Generate the contents of a file if they have not been generated yet. Once
+ * they have, they never change, so they can be read without the lock. Errors
+ * are not remembered, and generation is tried again on the next access.
+ */
+static int synthetic_generate(const void *dirent_data)
+{
+	struct hexagonfs_synthetic_file *file = (void *) dirent_data;
+	size_t size;
+	char *data;
+	int ret = 0;
+
+	if (__atomic_load_n(&file->generated, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&synthetic_lock);
+
+	if (!file->generated) {
+		ret = file->generate(file->arg, &data, &size);
+		if (!ret) {
+			file->data = data;
+			file->size = size;
+			__atomic_store_n(&file->generated, true, __ATOMIC_RELEASE);
+		}
+	}
+
+	pthread_mutex_unlock(&synthetic_lock);
+
+	return ret;
+}
+
+static void synthetic_fill_stat(const struct hexagonfs_synthetic_file *file,
+				struct stat *stats)
+{
+	stats->st_size = file->size;
+
+	stats->st_dev = 0;
+	stats->st_rdev = 0;
+
+	stats->st_ino = 0;
+	stats->st_nlink = 0;
+
+	stats->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+
+	stats->st_atim.tv_sec = 0;
+	stats->st_atim.tv_nsec = 0;
+	stats->st_ctim.tv_sec = 0;
+	stats->st_ctim.tv_nsec = 0;
+	stats->st_mtim.tv_sec = 0;
+	stats->st_mtim.tv_nsec = 0;
+}
+
+static void synthetic_close(void *fd_data)
+{
+}
+
+static int synthetic_from_dirent(const void *dirent_data, bool dir,
+				 void *fd_data)
+{
+	struct synthetic_ctx *ctx = fd_data;
+	int ret;
+
+	if (dir)
+		return -ENOTDIR;
+
+	ret = synthetic_generate(dirent_data);
+	if (ret)
+		return ret;
+
+	ctx->file = dirent_data;
+	ctx->off = 0;
+
+	return 0;
+}
+
+static int synthetic_openat(struct hexagonfs_fd *dir,
+			    const char *segment,
+			    bool expect_dir,
+			    struct hexagonfs_fd **out)
+{
+	return -ENOTDIR;
+}
+
+static ssize_t synthetic_read(struct hexagonfs_fd *fd, size_t size, void *out)
+{
+	struct synthetic_ctx *ctx = fd->data;
+	const struct hexagonfs_synthetic_file *file = ctx->file;
+
+	if ((size_t) ctx->off >= file->size)
+		return 0;
+
+	if (size > file->size - ctx->off)
+		size = file->size - ctx->off;
+
+	memcpy(out, &file->data[ctx->off], size);
+	ctx->off += size;
+
+	return size;
+}
+
+static int synthetic_seek(struct hexagonfs_fd *fd, off_t off, int whence)
+{
+	struct synthetic_ctx *ctx = fd->data;
+	off_t base;
+
+	if (whence == SEEK_SET)
+		base = 0;
+	else if (whence == SEEK_CUR)
+		base = ctx->off;
+	else if (whence == SEEK_END)
+		base = ctx->file->size;
+	else
+		return -EINVAL;
+
+	if (off < -base)
+		return -EINVAL;
+
+	ctx->off = base + off;
+
+	return 0;
+}
+
+static int synthetic_stat(struct hexagonfs_fd *fd, struct stat *stats)
+{
+	struct synthetic_ctx *ctx = fd->data;
+
+	synthetic_fill_stat(ctx->file, stats);
+
+	return 0;
+}
+
+static int synthetic_statat(struct hexagonfs_fd *dir,
+			    const char *segment,
+			    bool expect_dir,
+			    struct stat *stats)
+{
+	return -ENOTDIR;
+}
+
+static int synthetic_stat_dirent(const void *dirent_data, bool dir,
+				 struct stat *stats)
+{
+	int ret;
+
+	if (dir)
+		return -ENOTDIR;
+
+	ret = synthetic_generate(dirent_data);
+	if (ret)
+		return ret;
+
+	synthetic_fill_stat(dirent_data, stats);
+
+	return 0;
+}
+
+struct hexagonfs_file_ops hexagonfs_synthetic_ops = {
+	.data_size = sizeof(struct synthetic_ctx),
+	.close = synthetic_close,
+	.from_dirent = synthetic_from_dirent,
+	.openat = synthetic_openat,
+	.read = synthetic_read,
+	.seek = synthetic_seek,
+	.stat = synthetic_stat,
+	.statat = synthetic_statat,
+	.stat_dirent = synthetic_stat_dirent,
+};
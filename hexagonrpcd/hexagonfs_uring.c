@@ -0,0 +1,330 @@
+/*
+ * HexagonFS asynchronous reads with io_uring
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "hexagonfs.h"
+
+/*
+ * One ring is shared by all devices. The system calls are made directly,
+ * because the interface is small and not every system has liburing.
+ *
+ * Reads that do not fit in the submission queue wait in a list until others
+ * complete, so that the completion queue, which is twice as large, never
+ * overflows. There is no thread for completions. A thread that needs one
+ * waits for it in the kernel, and handles every completion it finds while
+ * other threads wait for it to wake them.
+ */
+struct uring {
+	int fd;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_entries;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+
+	unsigned int in_flight;
+	unsigned int to_submit;
+
+	struct hexagonfs_uring_req *queued;
+	struct hexagonfs_uring_req **queued_tail;
+
+	bool reaping;
+};
+
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t uring_cond = PTHREAD_COND_INITIALIZER;
+static struct uring ring = { .fd = -1, };
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete,
+		       unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+int hexagonfs_uring_init(unsigned int entries)
+{
+	struct io_uring_params params;
+	void *ptr;
+	int ret;
+
+	if (ring.fd != -1)
+		return -EBUSY;
+
+	memset(&params, 0, sizeof(params));
+
+	ret = uring_setup(entries, &params);
+	if (ret == -1)
+		return -errno;
+
+	ring.fd = ret;
+
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_size > ring.sq_size)
+			ring.sq_size = ring.cq_size;
+		ring.cq_size = 0;
+	}
+
+	ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto err;
+
+	ring.sq_ptr = ptr;
+	ring.cq_ptr = ptr;
+
+	if (ring.cq_size) {
+		ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto err_unmap_sq;
+
+		ring.cq_ptr = ptr;
+	}
+
+	ptr = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto err_unmap_cq;
+
+	ring.sqes = ptr;
+
+	ring.sq_head = (unsigned int *) ((char *) ring.sq_ptr + params.sq_off.head);
+	ring.sq_tail = (unsigned int *) ((char *) ring.sq_ptr + params.sq_off.tail);
+	ring.sq_mask = (unsigned int *) ((char *) ring.sq_ptr + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *) ((char *) ring.sq_ptr + params.sq_off.array);
+	ring.sq_entries = params.sq_entries;
+
+	ring.cq_head = (unsigned int *) ((char *) ring.cq_ptr + params.cq_off.head);
+	ring.cq_tail = (unsigned int *) ((char *) ring.cq_ptr + params.cq_off.tail);
+	ring.cq_mask = (unsigned int *) ((char *) ring.cq_ptr + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) ((char *) ring.cq_ptr + params.cq_off.cqes);
+
+	ring.queued = NULL;
+	ring.queued_tail = &ring.queued;
+
+	return 0;
+
+err_unmap_cq:
+	if (ring.cq_ptr != ring.sq_ptr)
+		munmap(ring.cq_ptr, ring.cq_size);
+err_unmap_sq:
+	munmap(ring.sq_ptr, ring.sq_size);
+err:
+	ret = -errno;
+	close(ring.fd);
+	ring.fd = -1;
+	return ret;
+}
+
+bool hexagonfs_uring_enabled(void)
+{
+	return ring.fd != -1;
+}
+
+/*
+ * Move queued reads to the submission queue while there is room for their
+ * completions. This must be called with the lock held.
+ */
+static void fill_sq(void)
+{
+	struct hexagonfs_uring_req *req;
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	tail = *ring.sq_tail;
+
+	while (ring.queued != NULL && ring.in_flight < ring.sq_entries) {
+		req = ring.queued;
+		ring.queued = req->next;
+		if (ring.queued == NULL)
+			ring.queued_tail = &ring.queued;
+
+		idx = tail & *ring.sq_mask;
+		sqe = &ring.sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = req->fd;
+		sqe->addr = (uintptr_t) req->buf;
+		sqe->len = req->len;
+		sqe->off = req->off;
+		sqe->user_data = (uintptr_t) req;
+
+		ring.sq_array[idx] = idx;
+		tail++;
+
+		ring.in_flight++;
+		ring.to_submit++;
+	}
+
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit the reads in the submission queue. Reads that the kernel does not
+ * take, for example because the completion queue is full, stay in the queue
+ * and are submitted by the next wait.
+ */
+static void submit(void)
+{
+	int ret;
+
+	fill_sq();
+
+	while (ring.to_submit) {
+		ret = uring_enter(ring.to_submit, 0, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		ring.to_submit -= ret;
+	}
+}
+
+void hexagonfs_uring_read(struct hexagonfs_uring_req *req)
+{
+	pthread_mutex_lock(&uring_lock);
+
+	req->next = NULL;
+	*ring.queued_tail = req;
+	ring.queued_tail = &req->next;
+
+	submit();
+
+	pthread_mutex_unlock(&uring_lock);
+}
+
+/*
+ * Handle the completions in the queue. This must be called with the lock held
+ * by the thread that is reaping.
+ */
+static void reap(void)
+{
+	struct hexagonfs_uring_req *req;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		req = (struct hexagonfs_uring_req *) (uintptr_t) cqe->user_data;
+
+		ring.in_flight--;
+		req->complete(req, cqe->res);
+
+		head++;
+	}
+
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+int hexagonfs_uring_wait(bool (*done)(const void *arg), const void *arg)
+{
+	unsigned int to_submit;
+	int submitted, ret = 0;
+
+	pthread_mutex_lock(&uring_lock);
+
+	while (!done(arg)) {
+		if (ring.reaping) {
+			pthread_cond_wait(&uring_cond, &uring_lock);
+			continue;
+		}
+
+		// Nothing can complete, so whatever is waited for never will
+		if (!ring.in_flight) {
+			ret = -EIO;
+			break;
+		}
+
+		to_submit = ring.to_submit;
+		ring.reaping = true;
+		pthread_mutex_unlock(&uring_lock);
+
+		/*
+		 * Reads that are counted as in flight may not have been taken
+		 * by the kernel yet, and would never complete if they were not
+		 * submitted here. A full completion queue is emptied below.
+		 */
+		submitted = uring_enter(to_submit, 1, IORING_ENTER_GETEVENTS);
+		if (submitted < 0 && errno != EINTR && errno != EBUSY)
+			ret = -errno;
+
+		pthread_mutex_lock(&uring_lock);
+		ring.reaping = false;
+
+		// Other threads may have submitted some of them in the meantime
+		if (submitted > 0) {
+			if ((unsigned int) submitted > ring.to_submit)
+				submitted = ring.to_submit;
+
+			ring.to_submit -= submitted;
+		}
+
+		reap();
+		submit();
+
+		pthread_cond_broadcast(&uring_cond);
+
+		if (ret)
+			break;
+	}
+
+	pthread_mutex_unlock(&uring_lock);
+
+	return ret;
+}
@@ -27,62 +27,118 @@
 
 #include "hexagonfs.h"
 
+static int compare_ents(const void *a, const void *b)
+{
+	const struct hexagonfs_dirent *const *ent_a = a;
+	const struct hexagonfs_dirent *const *ent_b = b;
+
+	return strcmp((*ent_a)->name, (*ent_b)->name);
+}
+
+static int compare_segment(const void *key, const void *elem)
+{
+	const struct hexagonfs_dirent *const *ent = elem;
+
+	return strcmp(key, (*ent)->name);
+}
+
 /*
- * This function searches for the relevant path segment in the path directory.
- * It is not optimized because it is dealing with small directories.
+ * Sort the children of a virtual directory. Names must be unique, because
+ * only one of them could be found.
  */
-static const struct hexagonfs_dirent *walk_dir(const struct hexagonfs_dirent *const *dir,
-					 const char *segment)
+int hexagonfs_virt_dir_sort(struct hexagonfs_virt_dir *dir)
 {
-	const struct hexagonfs_dirent *const *curr = dir;
+	size_t i;
 
-	while (*curr != NULL) {
-		if (!strcmp(segment, (*curr)->name))
-			break;
+	qsort(dir->ents, dir->n_ents, sizeof(*dir->ents), compare_ents);
 
-		curr++;
+	for (i = 1; i < dir->n_ents; i++) {
+		if (!strcmp(dir->ents[i - 1]->name, dir->ents[i]->name))
+			return -EEXIST;
 	}
 
-	return *curr;
+	return 0;
 }
 
-static int virt_dir_from_dirent(const void *dirent_data, bool dir, void **fd_data)
+static const struct hexagonfs_dirent *walk_dir(const struct hexagonfs_virt_dir *dir,
+					       const char *segment)
 {
-	const struct hexagonfs_dirent *const **wrapper;
+	struct hexagonfs_dirent **ent;
 
-	wrapper = malloc(sizeof(*wrapper));
-	if (wrapper == NULL)
-		return -ENOMEM;
+	// Empty directories can have no list of children
+	if (!dir->n_ents)
+		return NULL;
+
+	ent = bsearch(segment, dir->ents, dir->n_ents, sizeof(*dir->ents),
+		      compare_segment);
+
+	return ent != NULL ? *ent : NULL;
+}
+
+static int virt_dir_from_dirent(const void *dirent_data, bool dir, void *fd_data)
+{
+	const struct hexagonfs_virt_dir **wrapper = fd_data;
 
 	*wrapper = dirent_data;
-	*fd_data = wrapper;
 
 	return 0;
 }
 
+/*
+ * Open a name that is not a child in the directory below. The directory below
+ * is only open during the lookup, and the file is opened as if it were in
+ * the virtual directory, so that ".." leads back to it.
+ */
+static int virt_dir_openat_below(struct hexagonfs_fd *dir,
+				 const struct hexagonfs_dirent *below,
+				 const char *segment,
+				 bool expect_dir,
+				 struct hexagonfs_fd **out)
+{
+	struct hexagonfs_fd *below_fd;
+	int ret;
+
+	below_fd = hexagonfs_fd_alloc(dir->table, dir, below->ops);
+	if (below_fd == NULL)
+		return -ENOMEM;
+
+	ret = below->ops->from_dirent(below->u.ptr, true, below_fd->data);
+	if (ret)
+		goto err_free_fd;
+
+	ret = below->ops->openat(below_fd, segment, expect_dir, out);
+	if (!ret)
+		(*out)->up = dir;
+
+	below->ops->close(below_fd->data);
+err_free_fd:
+	hexagonfs_fd_free(below_fd);
+	return ret;
+}
+
 static int virt_dir_openat(struct hexagonfs_fd *dir,
 			   const char *segment,
 			   bool expect_dir,
 			   struct hexagonfs_fd **out)
 {
-	const struct hexagonfs_dirent *const **dirlist = dir->data;
+	const struct hexagonfs_virt_dir **dirlist = dir->data;
 	const struct hexagonfs_dirent *ent;
 	struct hexagonfs_fd *fd;
 	int ret;
 
 	ent = walk_dir(*dirlist, segment);
+	if (ent == NULL && (*dirlist)->below != NULL)
+		return virt_dir_openat_below(dir, (*dirlist)->below, segment,
+					     expect_dir, out);
+
 	if (ent == NULL)
 		return -ENOENT;
 
-	fd = malloc(sizeof(struct hexagonfs_fd));
+	fd = hexagonfs_fd_alloc(dir->table, dir, ent->ops);
 	if (fd == NULL)
 		return -ENOMEM;
 
-	fd->is_assigned = false;
-	fd->up = dir;
-	fd->ops = ent->ops;
-
-	ret = ent->ops->from_dirent(ent->u.ptr, expect_dir, &fd->data);
+	ret = ent->ops->from_dirent(ent->u.ptr, expect_dir, fd->data);
 	if (ret)
 		goto err;
 
@@ -91,13 +147,12 @@ static int virt_dir_openat(struct hexagonfs_fd *dir,
 	return 0;
 
 err:
-	free(fd);
+	hexagonfs_fd_free(fd);
 	return ret;
 }
 
 static void virt_dir_close(void *fd_data)
 {
-	free(fd_data);
 }
 
 static int virt_dir_stat(struct hexagonfs_fd *fd, struct stat *stats)
@@ -124,9 +179,44 @@ static int virt_dir_stat(struct hexagonfs_fd *fd, struct stat *stats)
 	return 0;
 }
 
+/*
+ * Virtual directories have no state, so they are stat'd without being opened.
+ */
+static int virt_dir_stat_dirent(const void *dirent_data, bool dir,
+				struct stat *stats)
+{
+	return virt_dir_stat(NULL, stats);
+}
+
+static int virt_dir_statat(struct hexagonfs_fd *dir,
+			   const char *segment,
+			   bool expect_dir,
+			   struct stat *stats)
+{
+	const struct hexagonfs_virt_dir **dirlist = dir->data;
+	const struct hexagonfs_dirent *ent;
+
+	ent = walk_dir(*dirlist, segment);
+
+	// Files in the directory below are stat'd by opening them
+	if (ent == NULL && (*dirlist)->below != NULL)
+		return -ENOSYS;
+
+	if (ent == NULL)
+		return -ENOENT;
+
+	if (ent->ops->stat_dirent == NULL)
+		return -ENOSYS;
+
+	return ent->ops->stat_dirent(ent->u.ptr, expect_dir, stats);
+}
+
 struct hexagonfs_file_ops hexagonfs_virt_dir_ops = {
+	.data_size = sizeof(const struct hexagonfs_virt_dir *),
 	.close = virt_dir_close,
 	.from_dirent = virt_dir_from_dirent,
 	.openat = virt_dir_openat,
 	.stat = virt_dir_stat,
+	.statat = virt_dir_statat,
+	.stat_dirent = virt_dir_stat_dirent,
 };
@@ -0,0 +1,415 @@
+/*
+ * HexagonFS change notifications for physical directories
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "hexagonfs.h"
+
+#define WATCH_BUCKETS 64
+#define WATCH_MAX 1024
+
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+		    | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF \
+		    | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// Events that change which file a path refers to
+#define WATCH_RENAMES (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define WATCH_GONE (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)
+
+/*
+ * Caches remember the generation of the physical directory that a result was
+ * found in, and the generation is incremented by every event in the
+ * directory. Events are read when a generation is checked, so a change is
+ * never missed, and checking costs one read() on the inotify file descriptor
+ * instead of a stat() of every cached path.
+ *
+ * Inotify watches directories, not paths. The ancestors of every watched
+ * directory are watched too, and when a name is created, removed or renamed,
+ * the watches below it are dropped and their generations incremented. They
+ * are added again by path the next time they are used. Watches are kept for
+ * the lifetime of the process, like the rest of the virtual filesystem.
+ */
+struct hexagonfs_watch {
+	struct hexagonfs_watch *next;
+	struct hexagonfs_watch *hash_next;
+
+	// Watch descriptor, or -1 if the directory is no longer watched
+	int wd;
+	uint64_t gen;
+
+	// Absolute path, without trailing slashes unless it is the root
+	size_t path_len;
+	char path[];
+};
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool watch_initialized;
+static int inotify_fd = -1;
+static char *watch_cwd;
+
+static struct hexagonfs_watch *watches;
+static struct hexagonfs_watch *watch_buckets[WATCH_BUCKETS];
+static size_t n_watches;
+
+static bool init_inotify(void)
+{
+	if (watch_initialized)
+		return inotify_fd != -1;
+
+	watch_initialized = true;
+
+	watch_cwd = getcwd(NULL, 0);
+	if (watch_cwd == NULL)
+		return false;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	return inotify_fd != -1;
+}
+
+static uint32_t hash_path(const char *path, size_t len)
+{
+	uint32_t hash = 2166136261;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) path[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+/*
+ * Make a path absolute, without empty or "." segments. Paths with ".." are not
+ * watched, because the directory they refer to depends on symbolic links.
+ */
+static bool normalize_path(const char *path, char *out, size_t *out_len)
+{
+	const char *seg;
+	size_t seg_len, len = 0;
+
+	if (*path != '/') {
+		len = strlen(watch_cwd);
+		if (len >= PATH_MAX)
+			return false;
+
+		memcpy(out, watch_cwd, len);
+		if (len == 1)
+			len = 0;
+	}
+
+	for (seg = path; *seg != '\0'; seg += seg_len) {
+		while (*seg == '/')
+			seg++;
+
+		seg_len = strcspn(seg, "/");
+
+		if (seg_len == 2 && !strncmp(seg, "..", 2))
+			return false;
+
+		if (!seg_len || (seg_len == 1 && *seg == '.'))
+			continue;
+
+		if (len + seg_len + 2 > PATH_MAX)
+			return false;
+
+		out[len++] = '/';
+		memcpy(&out[len], seg, seg_len);
+		len += seg_len;
+	}
+
+	if (!len)
+		out[len++] = '/';
+
+	out[len] = '\0';
+	*out_len = len;
+
+	return true;
+}
+
+static bool is_below(const struct hexagonfs_watch *watch,
+		     const char *path, size_t len)
+{
+	if (len == 1)
+		return true;
+
+	return watch->path_len >= len
+	    && !memcmp(watch->path, path, len)
+	    && (watch->path_len == len || watch->path[len] == '/');
+}
+
+static void drop_watch(struct hexagonfs_watch *watch)
+{
+	struct hexagonfs_watch *other;
+
+	watch->gen++;
+
+	if (watch->wd == -1)
+		return;
+
+	// Directories reached through symbolic links can share a descriptor
+	for (other = watches; other != NULL; other = other->next) {
+		if (other != watch && other->wd == watch->wd)
+			break;
+	}
+
+	if (other == NULL)
+		inotify_rm_watch(inotify_fd, watch->wd);
+
+	watch->wd = -1;
+}
+
+static void drop_below(const char *path, size_t len)
+{
+	struct hexagonfs_watch *watch;
+
+	for (watch = watches; watch != NULL; watch = watch->next) {
+		if (is_below(watch, path, len))
+			drop_watch(watch);
+	}
+}
+
+static void drop_below_child(const struct hexagonfs_watch *dir,
+			     const char *name)
+{
+	char path[PATH_MAX];
+	int len;
+
+	len = snprintf(path, sizeof(path), "%s/%s",
+		       dir->path_len == 1 ? "" : dir->path, name);
+	if (len < 0 || (size_t) len >= sizeof(path))
+		return;
+
+	drop_below(path, len);
+}
+
+static void handle_event(const struct inotify_event *event)
+{
+	struct hexagonfs_watch *watch;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		drop_below("/", 1);
+		return;
+	}
+
+	for (watch = watches; watch != NULL; watch = watch->next) {
+		if (watch->wd != event->wd)
+			continue;
+
+		if (event->mask & WATCH_GONE) {
+			drop_below(watch->path, watch->path_len);
+			continue;
+		}
+
+		watch->gen++;
+
+		if (event->len && (event->mask & WATCH_RENAMES))
+			drop_below_child(watch, event->name);
+	}
+}
+
+static void read_events(void)
+{
+	union {
+		struct inotify_event event;
+		char buf[4096];
+	} u;
+	const struct inotify_event *event;
+	ssize_t len, off;
+
+	for (;;) {
+		len = read(inotify_fd, u.buf, sizeof(u.buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len <= 0)
+			break;
+
+		for (off = 0; off < len; off += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) &u.buf[off];
+			handle_event(event);
+		}
+	}
+}
+
+static struct hexagonfs_watch *find_watch(const char *path, size_t len)
+{
+	struct hexagonfs_watch *watch;
+
+	for (watch = watch_buckets[hash_path(path, len) % WATCH_BUCKETS];
+	     watch != NULL;
+	     watch = watch->hash_next) {
+		if (watch->path_len == len && !memcmp(watch->path, path, len))
+			return watch;
+	}
+
+	return NULL;
+}
+
+static int add_watch(const char *path, size_t len,
+		     struct hexagonfs_watch **out)
+{
+	struct hexagonfs_watch *watch;
+	size_t bucket;
+
+	watch = find_watch(path, len);
+	if (watch == NULL) {
+		if (n_watches >= WATCH_MAX)
+			return -ENOSPC;
+
+		watch = malloc(sizeof(*watch) + len + 1);
+		if (watch == NULL)
+			return -ENOMEM;
+
+		watch->wd = -1;
+		watch->gen = 0;
+		watch->path_len = len;
+		memcpy(watch->path, path, len);
+		watch->path[len] = '\0';
+
+		bucket = hash_path(path, len) % WATCH_BUCKETS;
+		watch->hash_next = watch_buckets[bucket];
+		watch_buckets[bucket] = watch;
+		watch->next = watches;
+		watches = watch;
+		n_watches++;
+	}
+
+	if (watch->wd == -1) {
+		watch->wd = inotify_add_watch(inotify_fd, watch->path, WATCH_EVENTS);
+		if (watch->wd == -1)
+			return -errno;
+	}
+
+	*out = watch;
+
+	return 0;
+}
+
+/*
+ * Watch a directory and its ancestors, from the root down, so that renaming
+ * any of them is noticed. A watch that is still in place has all of its
+ * ancestors watched, because dropping a watch drops everything below it.
+ */
+static int watch_path(const char *path, size_t len,
+		      struct hexagonfs_watch_ref *ref)
+{
+	struct hexagonfs_watch *watch;
+	size_t end = 1;
+	int ret;
+
+	read_events();
+
+	watch = find_watch(path, len);
+	if (watch != NULL && watch->wd != -1)
+		goto out;
+
+	ret = add_watch(path, 1, &watch);
+	if (ret)
+		return ret;
+
+	while (end < len) {
+		end++;
+		while (end < len && path[end] != '/')
+			end++;
+
+		ret = add_watch(path, end, &watch);
+		if (ret)
+			return ret;
+	}
+
+out:
+	ref->watch = watch;
+	ref->gen = watch->gen;
+
+	return 0;
+}
+
+static int watch_dir(const char *path, bool parent,
+		     struct hexagonfs_watch_ref *ref)
+{
+	char normalized[PATH_MAX];
+	size_t len;
+	int ret;
+
+	ref->watch = NULL;
+
+	pthread_mutex_lock(&watch_lock);
+
+	if (!init_inotify()) {
+		ret = -ENOSYS;
+		goto out;
+	}
+
+	if (!normalize_path(path, normalized, &len)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (parent) {
+		while (len > 1 && normalized[len - 1] != '/')
+			len--;
+
+		if (len > 1)
+			len--;
+	}
+
+	ret = watch_path(normalized, len, ref);
+
+out:
+	pthread_mutex_unlock(&watch_lock);
+
+	return ret;
+}
+
+int hexagonfs_watch_dir(const char *path, struct hexagonfs_watch_ref *ref)
+{
+	return watch_dir(path, false, ref);
+}
+
+int hexagonfs_watch_parent(const char *path, struct hexagonfs_watch_ref *ref)
+{
+	return watch_dir(path, true, ref);
+}
+
+bool hexagonfs_watch_changed(const struct hexagonfs_watch_ref *ref)
+{
+	bool changed;
+
+	pthread_mutex_lock(&watch_lock);
+
+	read_events();
+	changed = ref->watch->gen != ref->gen;
+
+	pthread_mutex_unlock(&watch_lock);
+
+	return changed;
+}
@@ -100,6 +100,56 @@ static size_t consume_buf(struct fastrpc_decoder_context *ctx,
 	return segment;
 }
 
+/*
+ * This decodes as many complete input buffers as possible directly from the
+ * source, without going through the byte-granular state machine. It can only
+ * start at a buffer boundary, and stops at the first buffer that is not fully
+ * contained in the source, leaving the rest to the state machine.
+ *
+ * Empty buffers are also left to the state machine so both paths decode the
+ * same stream in exactly the same way.
+ */
+static size_t decode_whole_inbufs(struct fastrpc_decoder_context *ctx,
+				  size_t len, const char *buf)
+{
+	unsigned int align = ctx->align;
+	size_t off = 0;
+	uint32_t size;
+	size_t pad;
+	void *dest;
+
+	if (ctx->size || ctx->size_off || ctx->buf_off)
+		return 0;
+
+	while (ctx->idx < ctx->n_inbufs && len - off >= 4) {
+		memcpy(&size, &buf[off], 4);
+		size = le32toh(size);
+		if (!size)
+			break;
+
+		pad = (8 - ((align + 4) & 0x7)) & 0x7;
+		if (len - off - 4 < pad + size)
+			break;
+
+		dest = malloc(size);
+		if (dest == NULL)
+			return -1;
+
+		memcpy(dest, &buf[off + 4 + pad], size);
+
+		ctx->inbufs[ctx->idx].s = size;
+		ctx->inbufs[ctx->idx].p = dest;
+		ctx->idx++;
+
+		off += 4 + pad + size;
+		align = (align + 4 + pad + size) & 0x7;
+	}
+
+	ctx->align = align;
+
+	return off;
+}
+
 static size_t align_and_copy_outbuf(const struct fastrpc_io_buffer *outbuf,
 				    void *dest,
 				    off_t align)
@@ -171,9 +221,13 @@ int inbuf_decode_is_complete(struct fastrpc_decoder_context *ctx)
 int inbuf_decode(struct fastrpc_decoder_context *ctx, size_t len, const void *src)
 {
 	const char *buf = src;
-	size_t off = 0;
+	size_t off;
 	int ret = 0;
 
+	off = decode_whole_inbufs(ctx, len, buf);
+	if (off == (size_t) -1)
+		return -1;
+
 	while (off < len && ctx->idx < ctx->n_inbufs) {
 		if (!ctx->size || ctx->size_off) {
 			off += consume_size(ctx, len - off, &buf[off]);
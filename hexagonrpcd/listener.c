@@ -22,10 +22,15 @@
 #include <inttypes.h>
 #include <libhexagonrpc/fastrpc.h>
 #include <libhexagonrpc/interfaces/remotectl.def>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "aee_error.h"
+#include "handles.h"
 #include "interfaces/adsp_listener.def"
 #include "iobuffer.h"
 #include "listener.h"
@@ -206,8 +211,7 @@ err_free_outbufs:
 	return ret;
 }
 
-static int invoke_requested_procedure(size_t n_ifaces,
-				      struct fastrpc_interface **ifaces,
+static int invoke_requested_procedure(const struct fastrpc_interface *iface,
 				      uint32_t handle,
 				      uint32_t sc,
 			              uint32_t *result,
@@ -227,19 +231,19 @@ static int invoke_requested_procedure(size_t n_ifaces,
 		return 1;
 	}
 
-	if (handle >= n_ifaces) {
+	if (iface == NULL) {
 		fprintf(stderr, "Unsupported handle: %u\n", handle);
 		*result = AEE_EUNSUPPORTED;
 		return 1;
 	}
 
-	if (method >= ifaces[handle]->n_procs) {
+	if (method >= iface->n_procs) {
 		fprintf(stderr, "Unsupported method: %u (%08x)\n", method, sc);
 		*result = AEE_EUNSUPPORTED;
 		return 1;
 	}
 
-	impl = &ifaces[handle]->procs[method];
+	impl = &iface->procs[method];
 
 	if (impl->def == NULL || impl->impl == NULL) {
 		fprintf(stderr, "Unsupported method: %u (%08x)\n", method, sc);
@@ -275,17 +279,187 @@ static int invoke_requested_procedure(size_t n_ifaces,
 		return 1;
 	}
 
-	*result = impl->impl(ifaces[handle]->data, decoded, *returned);
+	*result = impl->impl(iface->data, decoded, *returned);
 
 	return 0;
 }
 
-int run_fastrpc_listener(int fd,
-			 size_t n_ifaces,
-			 struct fastrpc_interface **ifaces)
+struct fastrpc_listener {
+	int fd;
+	struct fastrpc_handles *handles;
+	struct fastrpc_listener_config config;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/*
+	 * Threads that are blocked in the kernel waiting for a request cannot
+	 * be woken up, so the listener is freed by the last thread to leave.
+	 */
+	unsigned int refs;
+
+	unsigned int n_threads;
+	unsigned int n_idle;
+	unsigned int n_busy;
+	unsigned int n_parked;
+	unsigned int max_parked;
+	unsigned int running[FASTRPC_N_PRIOS];
+	unsigned int waiting[FASTRPC_N_PRIOS];
+
+	bool stopping;
+	int ret;
+};
+
+static enum fastrpc_priority request_priority(const struct fastrpc_interface *iface,
+					      uint32_t sc)
+{
+	uint32_t method = REMOTE_SCALARS_METHOD(sc);
+	enum fastrpc_priority prio;
+
+	// Invalid requests fail quickly, so there is no reason to delay them
+	if (iface == NULL || method >= iface->n_procs)
+		return FASTRPC_PRIO_HIGH;
+
+	prio = iface->procs[method].prio;
+	if (prio == FASTRPC_PRIO_DEFAULT)
+		prio = iface->prio;
+	if (prio == FASTRPC_PRIO_DEFAULT)
+		prio = FASTRPC_PRIO_NORMAL;
+
+	return prio;
+}
+
+static bool can_run(const struct fastrpc_listener *l,
+		    enum fastrpc_priority prio)
 {
+	enum fastrpc_priority i;
+
+	if (l->config.limits[prio] && l->running[prio] >= l->config.limits[prio])
+		return false;
+
+	for (i = FASTRPC_PRIO_HIGH; i < prio; i++) {
+		if (l->waiting[i])
+			return false;
+	}
+
+	return true;
+}
+
+static void maybe_spawn_thread(struct fastrpc_listener *l);
+
+static void sched_enter(struct fastrpc_listener *l, enum fastrpc_priority prio)
+{
+	pthread_mutex_lock(&l->lock);
+
+	l->waiting[prio]++;
+
+	/*
+	 * A thread that waits for its class does not count against the thread
+	 * limit, so that another thread can receive requests in higher classes
+	 * even when the waiting thread was the last one.
+	 */
+	if (!can_run(l, prio)) {
+		l->n_parked++;
+		maybe_spawn_thread(l);
+
+		while (!can_run(l, prio))
+			pthread_cond_wait(&l->cond, &l->lock);
+
+		l->n_parked--;
+	}
+
+	l->waiting[prio]--;
+	l->running[prio]++;
+
+	pthread_mutex_unlock(&l->lock);
+}
+
+static void sched_leave(struct fastrpc_listener *l, enum fastrpc_priority prio)
+{
+	pthread_mutex_lock(&l->lock);
+
+	l->running[prio]--;
+	pthread_cond_broadcast(&l->cond);
+
+	pthread_mutex_unlock(&l->lock);
+}
+
+/*
+ * Drop a reference to the listener. This must be called with the lock held,
+ * and releases it.
+ */
+static void listener_put(struct fastrpc_listener *l)
+{
+	bool last;
+
+	last = --l->refs == 0;
+	pthread_mutex_unlock(&l->lock);
+
+	if (last) {
+		pthread_cond_destroy(&l->cond);
+		pthread_mutex_destroy(&l->lock);
+		free(l);
+	}
+}
+
+/*
+ * Ask all threads to stop after their current request, keeping the first
+ * error. This must be called with the lock held.
+ */
+static void listener_stop(struct fastrpc_listener *l, int ret)
+{
+	if (!l->stopping) {
+		l->stopping = true;
+		l->ret = ret;
+	}
+
+	pthread_cond_broadcast(&l->cond);
+}
+
+static void *run_listener_thread(void *data);
+
+/*
+ * Start another thread if every thread is busy with a request, so that
+ * requests in higher classes can be received while lower ones are waiting.
+ * Parked threads beyond their own limit count against max_threads, so that
+ * a burst of requests that wait for their class does not start a thread for
+ * each of them, and further requests stay queued until a thread is free.
+ * This must be called with the lock held.
+ */
+static void maybe_spawn_thread(struct fastrpc_listener *l)
+{
+	pthread_t thread;
+	unsigned int n_parked;
+	int ret;
+
+	n_parked = l->n_parked < l->max_parked ? l->n_parked : l->max_parked;
+
+	if (l->n_idle || l->stopping
+	 || l->n_threads - n_parked >= l->config.max_threads)
+		return;
+
+	ret = pthread_create(&thread, NULL, run_listener_thread, l);
+	if (ret) {
+		fprintf(stderr, "Could not start listener thread: %s\n",
+				strerror(ret));
+		return;
+	}
+
+	pthread_detach(thread);
+
+	l->n_threads++;
+	l->n_idle++;
+	l->refs++;
+}
+
+static void *run_listener_thread(void *data)
+{
+	struct fastrpc_listener *l = data;
 	struct fastrpc_io_buffer *decoded = NULL,
 				 *returned = NULL;
+	const struct fastrpc_interface *iface;
+	struct fastrpc_handle *ref;
+	enum fastrpc_priority prio;
 	uint32_t result = 0xffffffff;
 	uint32_t handle;
 	uint32_t rctx = 0;
@@ -293,33 +467,117 @@ int run_fastrpc_listener(int fd,
 	uint32_t n_outbufs = 0;
 	int ret;
 
-	ret = adsp_listener_init2(fd);
-	if (ret) {
-		fprintf(stderr, "Could not initialize the listener: %u\n", ret);
-		return ret;
-	}
-
-	while (!ret) {
-		ret = return_for_next_invoke(fd,
+	for (;;) {
+		ret = return_for_next_invoke(l->fd,
 					     result, &rctx, &handle, &sc,
 					     returned, &decoded);
-		if (ret)
-			break;
 
 		if (returned != NULL)
 			iobuf_free(n_outbufs, returned);
+		returned = NULL;
 
-		ret = invoke_requested_procedure(n_ifaces, ifaces,
-						 handle, sc, &result,
-						 decoded, &returned);
-		if (ret)
+		pthread_mutex_lock(&l->lock);
+		l->n_idle--;
+
+		if (ret || l->stopping) {
+			listener_stop(l, ret);
 			break;
+		}
+
+		l->n_busy++;
+		maybe_spawn_thread(l);
+		pthread_mutex_unlock(&l->lock);
+
+		// The instance stays open until the request is done with it
+		ref = fastrpc_handle_get(l->handles, handle);
+		iface = ref != NULL ? ref->iface : NULL;
+
+		prio = request_priority(iface, sc);
+
+		sched_enter(l, prio);
+		ret = invoke_requested_procedure(iface, handle, sc, &result,
+						 decoded, &returned);
+		sched_leave(l, prio);
+
+		if (ref != NULL)
+			fastrpc_handle_put(l->handles, ref);
 
 		if (decoded != NULL)
 			iobuf_free(REMOTE_SCALARS_INBUFS(sc), decoded);
+		decoded = NULL;
 
 		n_outbufs = REMOTE_SCALARS_OUTBUFS(sc);
+
+		pthread_mutex_lock(&l->lock);
+		l->n_busy--;
+
+		if (ret || l->stopping) {
+			listener_stop(l, ret);
+			break;
+		}
+
+		l->n_idle++;
+		pthread_mutex_unlock(&l->lock);
 	}
 
+	if (returned != NULL)
+		iobuf_free(n_outbufs, returned);
+
+	listener_put(l);
+
+	return NULL;
+}
+
+int run_fastrpc_listener(int fd,
+			 struct fastrpc_handles *handles,
+			 const struct fastrpc_listener_config *config)
+{
+	struct fastrpc_listener *l;
+	int ret;
+
+	ret = adsp_listener_init2(fd);
+	if (ret) {
+		fprintf(stderr, "Could not initialize the listener: %u\n", ret);
+		return ret;
+	}
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		return -1;
+
+	l->fd = fd;
+	l->handles = handles;
+
+	if (config != NULL)
+		memcpy(&l->config, config, sizeof(l->config));
+
+	if (l->config.max_threads == 0)
+		l->config.max_threads = 1;
+
+	l->max_parked = 2 * l->config.max_threads;
+
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->cond, NULL);
+
+	pthread_mutex_lock(&l->lock);
+
+	l->refs = 1;
+
+	maybe_spawn_thread(l);
+	if (l->n_threads == 0)
+		listener_stop(l, -1);
+
+	/*
+	 * Threads that are still waiting for a request only use the file
+	 * descriptor, so the handle table can be freed once no request is
+	 * being handled.
+	 */
+	while (!l->stopping || l->n_busy)
+		pthread_cond_wait(&l->cond, &l->lock);
+
+	ret = l->ret;
+
+	listener_put(l);
+
 	return ret;
 }
@@ -28,11 +28,26 @@
 
 #include "iobuffer.h"
 
+/*
+ * Scheduling classes for incoming requests. Requests in a higher class (lower
+ * value) are never delayed by requests in a lower class. A method with the
+ * default class takes the class of its interface, and an interface with the
+ * default class is normal.
+ */
+enum fastrpc_priority {
+	FASTRPC_PRIO_DEFAULT,
+	FASTRPC_PRIO_HIGH,
+	FASTRPC_PRIO_NORMAL,
+	FASTRPC_PRIO_BULK,
+	FASTRPC_N_PRIOS,
+};
+
 struct fastrpc_function_impl {
 	const struct fastrpc_function_def_interp2 *def;
 	uint32_t (*impl)(void *data,
 			 const struct fastrpc_io_buffer *inbufs,
 			 struct fastrpc_io_buffer *outbufs);
+	enum fastrpc_priority prio;
 };
 
 struct fastrpc_interface {
@@ -40,6 +55,19 @@ struct fastrpc_interface {
 	void *data;
 	uint8_t n_procs;
 	const struct fastrpc_function_impl *procs;
+	enum fastrpc_priority prio;
+};
+
+/*
+ * The listener starts with one thread and starts more, up to max_threads,
+ * whenever no thread is left waiting for the next request. The number of
+ * requests of each class that run at the same time is limited by limits, or
+ * unlimited if the limit is 0. Up to twice max_threads threads with a request
+ * that waits for its limit do not count against max_threads.
+ */
+struct fastrpc_listener_config {
+	unsigned int max_threads;
+	unsigned int limits[FASTRPC_N_PRIOS];
 };
 
 extern const struct fastrpc_interface localctl_interface;
@@ -47,8 +75,10 @@ extern const struct fastrpc_interface localctl_interface;
 extern const struct fastrpc_interface apps_mem_interface;
 extern const struct fastrpc_interface apps_std_interface;
 
+struct fastrpc_handles;
+
 int run_fastrpc_listener(int fd,
-			 size_t n_ifaces,
-			 struct fastrpc_interface **ifaces);
+			 struct fastrpc_handles *handles,
+			 const struct fastrpc_listener_config *config);
 
 #endif
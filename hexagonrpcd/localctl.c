@@ -26,13 +26,16 @@
 #include <string.h>
 
 #include "aee_error.h"
+#include "handles.h"
 #include "iobuffer.h"
 #include "listener.h"
 #include "localctl.h"
 
 struct remotectl_ctx {
-	size_t n_ifaces;
-	struct fastrpc_interface **ifaces;
+	struct fastrpc_handles *handles;
+
+	size_t n_factories;
+	const struct fastrpc_interface_factory *factories;
 };
 
 struct remotectl_open_invoke {
@@ -45,10 +48,16 @@ struct remotectl_open_return {
 	uint32_t error;
 };
 
+struct remotectl_close_invoke {
+	uint32_t handle;
+	uint32_t outlen;
+};
+
 /*
- * This is a function that "opens" (searches an array for) an interface for the
- * remote endpoint to use. If it cannot find the requested interface, it
- * returns -5 with no error string.
+ * This is a function that opens an interface for the remote endpoint to use.
+ * Every open creates a new instance of the interface with its own state, and
+ * gives it a handle that stays valid until the remote endpoint closes it. If
+ * it cannot find the requested interface, it returns -5 with no error string.
  *
  * Having a constant compile-time list of interfaces lets the reverse tunnel
  * easily sanitize inputs.
@@ -62,52 +71,92 @@ static uint32_t localctl_open(void *data,
 	struct remotectl_ctx *ctx = data;
 	const struct remotectl_open_invoke *first_in = inbufs[0].p;
 	struct remotectl_open_return *first_out = outbufs[0].p;
+	const struct fastrpc_interface_factory *factory;
+	struct fastrpc_interface *iface;
+	uint32_t handle;
 	size_t i;
+	int ret;
 
 	if (((const char *) inbufs[1].p)[inbufs[1].s - 1] != 0)
 		return AEE_EBADPARM;
 
 	memset(outbufs[1].p, 0, first_in->outlen);
 
-	for (i = 0; i < ctx->n_ifaces; i++) {
-		if (!strcmp(ctx->ifaces[i]->name,
-			    inbufs[1].p)) {
-			first_out->handle = i;
-			first_out->error = 0;
-			return 0;
-		}
+	first_out->handle = 0;
+
+	for (i = 0; i < ctx->n_factories; i++) {
+		if (!strcmp(ctx->factories[i].name, inbufs[1].p))
+			break;
 	}
 
-	fprintf(stderr, "Could not find local interface %s\n",
-			(const char *) inbufs[1].p);
+	if (i == ctx->n_factories) {
+		fprintf(stderr, "Could not find local interface %s\n",
+				(const char *) inbufs[1].p);
 
-	first_out->handle = 0;
-	first_out->error = -5;
+		first_out->error = -5;
+
+		return -5;
+	}
+
+	factory = &ctx->factories[i];
 
-	return -5;
+	iface = factory->open(factory->data);
+	if (iface == NULL) {
+		fprintf(stderr, "Could not open local interface %s\n",
+				factory->name);
+		first_out->error = AEE_ENOMEMORY;
+		return AEE_ENOMEMORY;
+	}
+
+	ret = fastrpc_handles_add(ctx->handles, iface, factory->close, &handle);
+	if (ret) {
+		fprintf(stderr, "Could not open local interface %s: %s\n",
+				factory->name, strerror(-ret));
+		if (factory->close != NULL)
+			factory->close(iface);
+		first_out->error = AEE_ENOMEMORY;
+		return AEE_ENOMEMORY;
+	}
+
+	first_out->handle = handle;
+	first_out->error = 0;
+
+	return 0;
 }
 
 /*
- * This is a dummy function that is called when the remote endpoint is done
- * using an interface. It does not need to do anything because interfaces are
- * static.
+ * This function is called when the remote endpoint is done using an
+ * interface. The instance is closed once the requests that are still using
+ * it have finished.
  */
 static uint32_t localctl_close(void *data,
 			       const struct fastrpc_io_buffer *inbufs,
 			       struct fastrpc_io_buffer *outbufs)
 {
-	uint32_t *dlerr_size = inbufs[0].p;
+	struct remotectl_ctx *ctx = data;
+	const struct remotectl_close_invoke *first_in = inbufs[0].p;
 	uint32_t *dlerr_len = outbufs[0].p;
 
-	memset(outbufs[1].p, 0, *dlerr_size);
+	memset(outbufs[1].p, 0, first_in->outlen);
 
 	*dlerr_len = 0;
 
+	// The control interface itself is needed to open anything else
+	if (first_in->handle == REMOTECTL_HANDLE)
+		return AEE_EBADPARM;
+
+	if (fastrpc_handles_remove(ctx->handles, first_in->handle)) {
+		fprintf(stderr, "Could not close unknown handle %u\n",
+				first_in->handle);
+		return AEE_EBADPARM;
+	}
+
 	return 0;
 }
 
-struct fastrpc_interface *fastrpc_localctl_init(size_t n_ifaces,
-						struct fastrpc_interface **ifaces)
+struct fastrpc_interface *fastrpc_localctl_init(struct fastrpc_handles *handles,
+						size_t n_factories,
+						const struct fastrpc_interface_factory *factories)
 {
 	struct fastrpc_interface *iface;
 	struct remotectl_ctx *ctx;
@@ -122,8 +171,9 @@ struct fastrpc_interface *fastrpc_localctl_init(size_t n_ifaces,
 
 	memcpy(iface, &localctl_interface, sizeof(struct fastrpc_interface));
 
-	ctx->n_ifaces = n_ifaces;
-	ctx->ifaces = ifaces;
+	ctx->handles = handles;
+	ctx->n_factories = n_factories;
+	ctx->factories = factories;
 
 	iface->data = ctx;
 
@@ -153,4 +203,5 @@ const struct fastrpc_interface localctl_interface = {
 	.name = "remotectl",
 	.n_procs = 2,
 	.procs = localctl_procs,
+	.prio = FASTRPC_PRIO_HIGH,
 };
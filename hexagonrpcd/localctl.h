@@ -22,15 +22,29 @@
 #ifndef LOCALCTL_H
 #define LOCALCTL_H
 
+#include "handles.h"
 #include "listener.h"
 
 /*
- * Obtain a localctl interface instance. The interfaces array must be fully
- * initialized once the interface instance is used (when run_fastrpc_listener()
- * is called).
+ * An interface that the remote processor can open by name. Every open calls
+ * the open function with data to create a new instance, and the instance is
+ * closed with the close function, which may be NULL.
  */
-struct fastrpc_interface *fastrpc_localctl_init(size_t n_ifaces,
-						struct fastrpc_interface **ifaces);
+struct fastrpc_interface_factory {
+	const char *name;
+	struct fastrpc_interface *(*open)(void *data);
+	void (*close)(struct fastrpc_interface *iface);
+	void *data;
+};
+
+/*
+ * Obtain a localctl interface instance. Opened interfaces are added to the
+ * handle table, which the listener uses to dispatch requests. The factories
+ * are not copied and must outlive the instance.
+ */
+struct fastrpc_interface *fastrpc_localctl_init(struct fastrpc_handles *handles,
+						size_t n_factories,
+						const struct fastrpc_interface_factory *factories);
 
 void fastrpc_localctl_deinit(struct fastrpc_interface *iface);
 
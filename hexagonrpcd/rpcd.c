@@ -21,13 +21,17 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <libhexagonrpc/fastrpc.h>
 #include <libhexagonrpc/interfaces/remotectl.def>
 #include <misc/fastrpc.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -37,12 +41,34 @@
 #include "aee_error.h"
 #include "apps_mem.h"
 #include "apps_std.h"
+#include "handles.h"
 #include "hexagonfs.h"
 #include "interfaces/adsp_default_listener.def"
 #include "listener.h"
 #include "localctl.h"
 #include "rpcd_builder.h"
 
+struct rpcd_device {
+	const char *node;
+	const char *dsp;
+	const char *create_shell;
+	bool attach_sns;
+
+	int fd;
+	struct hexagonfs_dirent *root_dir;
+	pthread_t thread;
+};
+
+static pthread_mutex_t tunnel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tunnel_cond = PTHREAD_COND_INITIALIZER;
+static bool tunnel_stopped = false;
+
+static struct fastrpc_listener_config listener_config = {
+	.max_threads = 1,
+};
+
+static unsigned int max_files = HEXAGONFS_DEFAULT_MAX_FD;
+
 static int remotectl_open(int fd, char *name, struct fastrpc_context **ctx, void (*err_cb)(const char *err))
 {
 	uint32_t handle;
@@ -132,15 +158,62 @@ err:
 
 static void print_usage(const char *argv0)
 {
-	printf("Usage: %s [options] -f DEVICE\n\n", argv0);
+	printf("Usage: %s [options] -f DEVICE [-f DEVICE...]\n\n", argv0);
 	printf("Server for FastRPC remote procedure calls from Qualcomm DSPs\n\n"
 	       "Options:\n"
+	       "\t-b LIMIT\tMaximum bulk transfers handled at once (default: THREADS - 1)\n"
+	       "\t-C KIB\t\tMemory for cached file contents (default: 32768, 0 disables)\n"
 	       "\t-c SHELL\t\tCreate a new pd running the specified ELF\n"
 	       "\t-d DSP\t\tDSP name (default: "")\n"
-	       "\t-f DEVICE\tFastRPC device node to attach to\n"
+	       "\t-f DEVICE\tFastRPC device node to attach to (repeatable)\n"
+	       "\t-I IMAGE\tServe files from a packed image instead of the root directory\n"
+	       "\t-j THREADS\tMaximum requests handled at once per device (default: 1)\n"
+	       "\t-L LAYOUT\tLayout of served files (default: hexagonfs.layout in the\n"
+	       "\t\t\troot directory, or the built-in layout)\n"
+	       "\t-o FILES\tMaximum files open on each device (default: 1024)\n"
+	       "\t-P LIST\t\tRecord files opened by the DSP in LIST, and read them\n"
+	       "\t\t\tahead when starting\n"
 	       "\t-p PROGRAM\tRun client program with shared file descriptor\n"
-	       "\t-R DIR\t\tRoot directory of served files (default: /usr/share/qcom/)\n"
-	       "\t-s\t\tAttach to sensorspd\n");
+	       "\t-R DIR\t\tRoot directory of served files (default: /usr/share/qcom/),\n"
+	       "\t\t\trepeatable, with earlier ones overriding later ones\n"
+	       "\t-s\t\tAttach to sensorspd\n"
+	       "\t-u DEPTH\tLoad large files with io_uring, DEPTH reads at once\n\n"
+	       "The -c, -d and -s options apply to the preceding -f option, or to\n"
+	       "all devices if they come before the first -f option.\n");
+}
+
+static int parse_count(const char *arg, unsigned int max, unsigned int *count)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+	if (errno || *arg == '\0' || *end != '\0' || val == 0 || val > max) {
+		fprintf(stderr, "Invalid number: %s\n", arg);
+		return -1;
+	}
+
+	*count = val;
+
+	return 0;
+}
+
+static int parse_cache_budget(const char *arg)
+{
+	unsigned long long val;
+	char *end;
+
+	errno = 0;
+	val = strtoull(arg, &end, 10);
+	if (errno || *arg == '\0' || *end != '\0' || val > SIZE_MAX / 1024) {
+		fprintf(stderr, "Invalid cache size: %s\n", arg);
+		return -1;
+	}
+
+	hexagonfs_cache_set_budget(val * 1024);
+
+	return 0;
 }
 
 static int create_shell_pd(int fd, const char *create_shell)
@@ -250,48 +323,259 @@ static int start_clients(size_t n_progs, const char **progs, pid_t *pids)
 	return 0;
 }
 
-static void *start_reverse_tunnel(int fd, const char *device_dir, const char *dsp)
+/*
+ * Record that a reverse tunnel has stopped. The daemon exits when any of them
+ * stops, so that the service manager can restart it and reattach to all
+ * remote processors.
+ */
+static void stop_reverse_tunnel(void)
 {
-	struct fastrpc_interface **ifaces;
-	struct hexagonfs_dirent *root_dir;
-	size_t n_ifaces = 3;
-	int ret;
+	pthread_mutex_lock(&tunnel_lock);
+	tunnel_stopped = true;
+	pthread_cond_signal(&tunnel_cond);
+	pthread_mutex_unlock(&tunnel_lock);
+}
 
-	ifaces = malloc(sizeof(struct fastrpc_interface) * n_ifaces);
-	if (ifaces == NULL)
-		return NULL;
+static struct fastrpc_interface *open_apps_std(void *data)
+{
+	struct rpcd_device *dev = data;
+
+	return fastrpc_apps_std_init(dev->root_dir, max_files);
+}
 
-	root_dir = construct_root_dir(device_dir, dsp);
+static struct fastrpc_interface *open_apps_mem(void *data)
+{
+	struct rpcd_device *dev = data;
+
+	return fastrpc_apps_mem_init(dev->fd);
+}
+
+static void *start_reverse_tunnel(void *data)
+{
+	struct rpcd_device *dev = data;
+	struct fastrpc_interface_factory factories[] = {
+		{
+			.name = "apps_std",
+			.open = open_apps_std,
+			.close = fastrpc_apps_std_deinit,
+			.data = dev,
+		},
+		{
+			.name = "apps_mem",
+			.open = open_apps_mem,
+			.close = fastrpc_apps_mem_deinit,
+			.data = dev,
+		},
+	};
+	struct fastrpc_interface *localctl;
+	struct fastrpc_handles *handles;
+	uint32_t handle;
+	int ret;
+
+	handles = fastrpc_handles_create();
+	if (handles == NULL)
+		goto out;
 
 	/*
-	 * The apps_remotectl interface patiently waits for this function to
-	 * fully populate the ifaces array as long as it receives a pointer to
-	 * it.
+	 * Every other interface is opened by the remote processor through
+	 * this one, and gets a handle and a new instance for each open. The
+	 * table is empty, so this gets the fixed REMOTECTL_HANDLE.
 	 */
-	ifaces[REMOTECTL_HANDLE] = fastrpc_localctl_init(n_ifaces, ifaces);
+	localctl = fastrpc_localctl_init(handles,
+					 sizeof(factories) / sizeof(*factories),
+					 factories);
+	if (localctl == NULL)
+		goto err;
 
-	// Dynamic interfaces with no hardcoded handle
-	ifaces[1] = fastrpc_apps_std_init(root_dir);
-	ifaces[2] = fastrpc_apps_mem_init(fd);
+	ret = fastrpc_handles_add(handles, localctl,
+				  fastrpc_localctl_deinit, &handle);
+	if (ret) {
+		fastrpc_localctl_deinit(localctl);
+		goto err;
+	}
 
-	ret = register_fastrpc_listener(fd);
+	ret = register_fastrpc_listener(dev->fd);
 	if (ret)
 		goto err;
 
-	run_fastrpc_listener(fd, n_ifaces, ifaces);
-
-	fastrpc_localctl_deinit(ifaces[REMOTECTL_HANDLE]);
+	run_fastrpc_listener(dev->fd, handles, &listener_config);
 
-	free(ifaces);
+err:
+	fastrpc_handles_destroy(handles);
+out:
+	stop_reverse_tunnel();
 
 	return NULL;
+}
 
-err:
-	free(ifaces);
+/*
+ * Remote processors that run code from the same DSP library directory get the
+ * same virtual filesystem, so the tree is only built once for them.
+ */
+static struct hexagonfs_dirent *get_root_dir(struct rpcd_device *devs,
+					     size_t idx,
+					     const char *layout,
+					     const char *const *device_dirs,
+					     size_t n_device_dirs,
+					     const struct hexagonfs_image *image)
+{
+	size_t i;
+
+	for (i = 0; i < idx; i++) {
+		if (!strcmp(devs[i].dsp, devs[idx].dsp))
+			return devs[i].root_dir;
+	}
+
+	return construct_root_dir(layout, device_dirs, n_device_dirs,
+				  devs[idx].dsp, image);
+}
+
+static char *read_text_file(const char *path)
+{
+	struct stat stats;
+	char *text = NULL;
+	ssize_t ret;
+	size_t off = 0;
+	int fd;
 
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &stats))
+		goto err;
+
+	text = malloc(stats.st_size + 1);
+	if (text == NULL)
+		goto err;
+
+	while (off < (size_t) stats.st_size) {
+		ret = read(fd, &text[off], stats.st_size - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			goto err;
+
+		off += ret;
+	}
+
+	text[off] = '\0';
+
+	close(fd);
+
+	return text;
+
+err:
+	free(text);
+	close(fd);
 	return NULL;
 }
 
+/*
+ * Read the layout of the virtual filesystem. Without -L, the first root
+ * directory with a hexagonfs.layout file provides it, so that it can be
+ * shipped with the files of the device, and the built-in layout is used if
+ * none has one.
+ */
+static int read_layout(const char *layout_path,
+		       const char *const *device_dirs,
+		       size_t n_device_dirs,
+		       char **layout)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	*layout = NULL;
+
+	if (layout_path != NULL) {
+		*layout = read_text_file(layout_path);
+		if (*layout == NULL) {
+			fprintf(stderr, "Could not read layout %s: %s\n",
+					layout_path, strerror(errno));
+			return -1;
+		}
+
+		return 0;
+	}
+
+	for (i = 0; i < n_device_dirs; i++) {
+		snprintf(path, sizeof(path), "%s/hexagonfs.layout", device_dirs[i]);
+
+		*layout = read_text_file(path);
+		if (*layout != NULL)
+			return 0;
+
+		if (errno != ENOENT && errno != ENOTDIR) {
+			fprintf(stderr, "Could not read layout %s: %s\n",
+					path, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void start_prefetch(size_t n_devs, const struct rpcd_device *devs)
+{
+	struct hexagonfs_dirent **roots;
+	size_t i;
+	int ret;
+
+	roots = malloc(sizeof(*roots) * n_devs);
+	if (roots == NULL) {
+		perror("Could not start prefetching");
+		return;
+	}
+
+	for (i = 0; i < n_devs; i++)
+		roots[i] = devs[i].root_dir;
+
+	ret = hexagonfs_prefetch_start(n_devs, roots);
+	if (ret)
+		fprintf(stderr, "Could not start prefetching: %s\n", strerror(-ret));
+
+	free(roots);
+}
+
+static int attach_device(struct rpcd_device *dev, const char *argv0)
+{
+	int ret;
+
+	printf("Starting %s (%s) on %s\n", argv0, dev->attach_sns? "INIT_ATTACH_SNS": "INIT_ATTACH", dev->node);
+
+	dev->fd = open(dev->node, O_RDWR);
+	if (dev->fd < 0) {
+		fprintf(stderr, "Could not open FastRPC node (%s): %s\n", dev->node, strerror(errno));
+		return -1;
+	}
+
+	if (dev->attach_sns)
+		ret = ioctl(dev->fd, FASTRPC_IOCTL_INIT_ATTACH_SNS, NULL);
+	else if (dev->create_shell != NULL)
+		ret = create_shell_pd(dev->fd, dev->create_shell);
+	else
+		ret = ioctl(dev->fd, FASTRPC_IOCTL_INIT_ATTACH, NULL);
+	if (ret) {
+		fprintf(stderr, "Could not attach to FastRPC node (%s): %s\n", dev->node, strerror(errno));
+		close(dev->fd);
+		dev->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void close_devices(size_t n_devs, struct rpcd_device *devs)
+{
+	size_t i;
+
+	for (i = 0; i < n_devs; i++) {
+		if (devs[i].fd >= 0)
+			close(devs[i].fd);
+	}
+}
+
 static char *read_sysfs_file(const char *path, struct stat *file_stat)
 {
 	char *contents = NULL;
@@ -408,16 +692,29 @@ free_compatible:
 
 int main(int argc, char* argv[])
 {
-	char *fastrpc_node = NULL;
-	const char *device_dir = "/usr/share/qcom/";
-	const char *dsp = "";
-	const char *create_shell = NULL;
+	struct rpcd_device defaults = {
+		.dsp = "",
+		.fd = -1,
+	};
+	struct rpcd_device *devs;
+	struct rpcd_device *curr = &defaults;
+	const char *default_device_dir = "/usr/share/qcom/";
 	const char *guessed_device_dir;
+	const char **device_dirs;
+	const char *image_path = NULL;
+	const char *prefetch_list = NULL;
+	const char *layout_path = NULL;
+	char *layout;
+	struct hexagonfs_image *image = NULL;
+	unsigned int uring_depth = 0;
 	const char **progs;
 	pid_t *pids;
+	size_t n_device_dirs = 0;
 	size_t n_progs = 0;
-	int fd, ret, opt;
-	bool attach_sns = false;
+	size_t n_devs = 0;
+	size_t n_threads = 0;
+	size_t i;
+	int ret, opt;
 
 	progs = malloc(sizeof(const char *) * argc);
 	if (progs == NULL) {
@@ -431,83 +728,218 @@ int main(int argc, char* argv[])
 		goto err_free_progs;
 	}
 
+	devs = malloc(sizeof(struct rpcd_device) * argc);
+	if (devs == NULL) {
+		perror("Could not list FastRPC nodes");
+		goto err_free_pids;
+	}
+
+	device_dirs = malloc(sizeof(const char *) * argc);
+	if (device_dirs == NULL) {
+		perror("Could not list root directories");
+		goto err_free_devs;
+	}
+
 	guessed_device_dir = guess_device_directory_from_compatible();
 	if (guessed_device_dir != NULL)
-		device_dir = guessed_device_dir;
+		default_device_dir = guessed_device_dir;
 
-	while ((opt = getopt(argc, argv, "c:d:f:p:R:s")) != -1) {
+	/*
+	 * The -c, -d and -s options apply to the last FastRPC node given
+	 * before them, or to all nodes if they come before the first one.
+	 */
+	while ((opt = getopt(argc, argv, "b:C:c:d:f:I:j:L:o:P:p:R:su:")) != -1) {
 		switch (opt) {
+			case 'b':
+				ret = parse_count(optarg, 1024, &listener_config.limits[FASTRPC_PRIO_BULK]);
+				if (ret)
+					goto err_free_device_dirs;
+				break;
+			case 'C':
+				ret = parse_cache_budget(optarg);
+				if (ret)
+					goto err_free_device_dirs;
+				break;
 			case 'c':
-				create_shell = optarg;
+				curr->create_shell = optarg;
 				break;
 			case 'd':
-				dsp = optarg;
+				curr->dsp = optarg;
 				break;
 			case 'f':
-				fastrpc_node = optarg;
+				devs[n_devs] = defaults;
+				devs[n_devs].node = optarg;
+				curr = &devs[n_devs];
+				n_devs++;
+				break;
+			case 'I':
+				image_path = optarg;
+				break;
+			case 'L':
+				layout_path = optarg;
+				break;
+			case 'j':
+				ret = parse_count(optarg, 1024, &listener_config.max_threads);
+				if (ret)
+					goto err_free_device_dirs;
+				break;
+			case 'o':
+				ret = parse_count(optarg, 1048576, &max_files);
+				if (ret)
+					goto err_free_device_dirs;
+				break;
+			case 'P':
+				prefetch_list = optarg;
 				break;
 			case 'p':
 				progs[n_progs] = optarg;
 				n_progs++;
 				break;
 			case 'R':
-				device_dir = optarg;
+				device_dirs[n_device_dirs] = optarg;
+				n_device_dirs++;
 				break;
 			case 's':
-				attach_sns = true;
+				curr->attach_sns = true;
+				break;
+			case 'u':
+				ret = parse_count(optarg, 4096, &uring_depth);
+				if (ret)
+					goto err_free_device_dirs;
 				break;
 			default:
 				print_usage(argv[0]);
-				goto err_free_pids;
+				goto err_free_device_dirs;
 		}
 	}
 
-	if (!fastrpc_node) {
+	if (!n_devs) {
 		print_usage(argv[0]);
-		goto err_free_pids;
+		goto err_free_device_dirs;
 	}
 
-	printf("Starting %s (%s) on %s\n", argv[0], attach_sns? "INIT_ATTACH_SNS": "INIT_ATTACH", fastrpc_node);
+	/*
+	 * Keep a thread for memory mapping and other short requests while the
+	 * remote processor loads libraries.
+	 */
+	if (!listener_config.limits[FASTRPC_PRIO_BULK] && listener_config.max_threads > 1)
+		listener_config.limits[FASTRPC_PRIO_BULK] = listener_config.max_threads - 1;
+
+	if (image_path != NULL) {
+		ret = hexagonfs_image_open(image_path, &image);
+		if (ret) {
+			fprintf(stderr, "Could not open image %s: %s\n",
+					image_path, strerror(-ret));
+			goto err_free_device_dirs;
+		}
 
-	fd = open(fastrpc_node, O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "Could not open FastRPC node (%s): %s\n", fastrpc_node, strerror(errno));
-		goto err_free_pids;
+		device_dirs[0] = "";
+		n_device_dirs = 1;
+	} else if (!n_device_dirs) {
+		device_dirs[0] = default_device_dir;
+		n_device_dirs = 1;
 	}
 
-	if (attach_sns)
-		ret = ioctl(fd, FASTRPC_IOCTL_INIT_ATTACH_SNS, NULL);
-	else if (create_shell != NULL)
-		ret = create_shell_pd(fd, create_shell);
-	else
-		ret = ioctl(fd, FASTRPC_IOCTL_INIT_ATTACH, NULL);
-	if (ret) {
-		fprintf(stderr, "Could not attach to FastRPC node: %s\n", strerror(errno));
-		goto err_close_dev;
+	// Images have no root directory to look for a layout in
+	ret = read_layout(layout_path, device_dirs,
+			  image_path != NULL ? 0 : n_device_dirs, &layout);
+	if (ret)
+		goto err_close_image;
+
+	if (prefetch_list != NULL) {
+		ret = hexagonfs_prefetch_open(prefetch_list);
+		if (ret) {
+			fprintf(stderr, "Could not open prefetch list %s: %s\n",
+					prefetch_list, strerror(-ret));
+			goto err_free_layout;
+		}
+	}
+
+	// Files are still read directly if the kernel has no io_uring
+	if (uring_depth) {
+		ret = hexagonfs_uring_init(uring_depth);
+		if (ret)
+			fprintf(stderr, "Could not set up io_uring: %s\n",
+					strerror(-ret));
+	}
+
+	for (i = 0; i < n_devs; i++) {
+		ret = attach_device(&devs[i], argv[0]);
+		if (ret)
+			goto err_close_devs;
+	}
+
+	for (i = 0; i < n_devs; i++) {
+		devs[i].root_dir = get_root_dir(devs, i,
+					       layout != NULL ? layout : rpcd_default_layout,
+					       device_dirs, n_device_dirs, image);
+		if (devs[i].root_dir == NULL) {
+			fprintf(stderr, "Could not construct virtual filesystem\n");
+			goto err_close_devs;
+		}
 	}
 
-	ret = setup_environment(fd);
+	// Client programs talk to the first remote processor
+	ret = setup_environment(devs[0].fd);
 	if (ret) {
 		perror("Could not setup environment variables");
-		goto err_close_dev;
+		goto err_close_devs;
 	}
 
 	ret = start_clients(n_progs, progs, pids);
 	if (ret)
-		goto err_close_dev;
+		goto err_close_devs;
 
-	start_reverse_tunnel(fd, device_dir, dsp);
+	/*
+	 * Files are read ahead while the remote processors boot. The prefetch
+	 * thread walks the virtual filesystems until it is done, so nothing it
+	 * uses may be freed after this point.
+	 */
+	if (prefetch_list != NULL)
+		start_prefetch(n_devs, devs);
+
+	for (n_threads = 0; n_threads < n_devs; n_threads++) {
+		ret = pthread_create(&devs[n_threads].thread, NULL,
+				     start_reverse_tunnel, &devs[n_threads]);
+		if (ret) {
+			fprintf(stderr, "Could not start reverse tunnel: %s\n", strerror(ret));
+			stop_reverse_tunnel();
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&tunnel_lock);
+	while (!tunnel_stopped)
+		pthread_cond_wait(&tunnel_cond, &tunnel_lock);
+	pthread_mutex_unlock(&tunnel_lock);
 
 	terminate_clients(n_progs, pids);
 
-	close(fd);
+	/*
+	 * The remaining reverse tunnels and the prefetch thread may be blocked
+	 * waiting for the remote processor or for a file, so they are not
+	 * joined. They still use the devices, the FastRPC nodes and the
+	 * virtual filesystems, which reach into the layout, the root
+	 * directories and the image, so these are left for exit() to release.
+	 * Closing a node here would also let its file descriptor number be
+	 * reused under a tunnel that is still in an ioctl.
+	 */
 	free(pids);
 	free(progs);
 
 	return 0;
 
-err_close_dev:
-	close(fd);
+err_close_devs:
+	close_devices(n_devs, devs);
+err_free_layout:
+	free(layout);
+err_close_image:
+	if (image != NULL)
+		hexagonfs_image_close(image);
+err_free_device_dirs:
+	free(device_dirs);
+err_free_devs:
+	free(devs);
 err_free_pids:
 	free(pids);
 err_free_progs:
@@ -19,68 +19,115 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <stdarg.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "hexagonfs.h"
 
-// These paths are relative, with a prepended '/' if missing from previous segments
-#define ACDBDATA		"/acdb/"
-#define DSP_LIBS		"/dsp/"
-#define SENSORS_CONFIG		"/sensors/config/"
-#define SENSORS_REGISTRY	"/sensors/registry/"
-#define SNS_REG_CONFIG		"/sensors/sns_reg.conf"
-#define SYSFS_SOCINFO		"/socinfo/"
+// Directories this deep in several layers are served from the first one only
+#define MAX_MERGE_DEPTH 16
 
-static struct hexagonfs_dirent *hfs_mkdir(const char *name, size_t n_ents, ...)
+/*
+ * Make a virtual directory with the given children. The list still belongs to
+ * the caller if the directory cannot be made.
+ */
+static struct hexagonfs_dirent *hfs_mkdir_list(const char *name, size_t n_ents,
+					       struct hexagonfs_dirent **list)
 {
 	struct hexagonfs_dirent *dir;
-	struct hexagonfs_dirent **list;
-	struct hexagonfs_dirent *ent;
-	va_list va;
-	size_t i;
+	struct hexagonfs_virt_dir *children;
+	int ret;
 
-	list = malloc(sizeof(struct hexagonfs_dirent *) * (n_ents + 1));
-	if (list == NULL)
+	children = malloc(sizeof(struct hexagonfs_virt_dir));
+	if (children == NULL)
 		return NULL;
 
 	dir = malloc(sizeof(struct hexagonfs_dirent));
 	if (dir == NULL)
-		goto err_free_list;
-
-	va_start(va, n_ents);
-	for (i = 0; i < n_ents; i++) {
-		ent = va_arg(va, struct hexagonfs_dirent *);
-		if (ent == NULL)
-			goto err_free_dir;
+		goto err_free_children;
 
-		list[i] = ent;
-	}
-	va_end(va);
+	children->n_ents = n_ents;
+	children->ents = list;
+	children->below = NULL;
 
-	list[n_ents] = NULL;
+	ret = hexagonfs_virt_dir_sort(children);
+	if (ret)
+		goto err_free_dir;
 
 	dir->name = name;
 	dir->ops = &hexagonfs_virt_dir_ops;
-	dir->u.dir = list;
+	dir->u.dir = children;
 
 	return dir;
 
 err_free_dir:
 	free(dir);
-err_free_list:
-	free(list);
+err_free_children:
+	free(children);
 	return NULL;
 }
 
-static struct hexagonfs_dirent *hfs_map(const char *name, const char *path)
+/*
+ * Serve a file from the image, with the path relative to the root of the
+ * image. The path is only needed for the lookup, so it is freed here.
+ */
+static struct hexagonfs_dirent *hfs_image(const char *name,
+					  const struct hexagonfs_image *image,
+					  char *path,
+					  bool or_empty)
+{
+	struct hexagonfs_image_file *image_file;
+	struct hexagonfs_dirent *file;
+	int ret;
+
+	if (path == NULL)
+		return NULL;
+
+	ret = hexagonfs_image_lookup(image, path, &image_file);
+	free(path);
+	if (ret)
+		return NULL;
+
+	if (or_empty && !image_file->exists) {
+		free(image_file);
+		return hfs_mkdir_list(name, 0, NULL);
+	}
+
+	file = malloc(sizeof(struct hexagonfs_dirent));
+	if (file == NULL) {
+		free(image_file);
+		return NULL;
+	}
+
+	file->name = name;
+	file->ops = &hexagonfs_image_ops;
+	file->u.ptr = image_file;
+
+	return file;
+}
+
+static struct hexagonfs_dirent *hfs_map(const char *name,
+					const struct hexagonfs_image *image,
+					char *path)
 {
 	struct hexagonfs_dirent *file;
 
+	if (image != NULL)
+		return hfs_image(name, image, path, false);
+
+	if (path == NULL)
+		return NULL;
+
 	file = malloc(sizeof(struct hexagonfs_dirent));
-	if (file == NULL)
+	if (file == NULL) {
+		free(path);
 		return NULL;
+	}
 
 	file->name = name;
 	file->ops = &hexagonfs_mapped_ops;
@@ -89,13 +136,23 @@ static struct hexagonfs_dirent *hfs_map(const char *name, const char *path)
 	return file;
 }
 
-static struct hexagonfs_dirent *hfs_map_or_empty(const char *name, const char *path)
+static struct hexagonfs_dirent *hfs_map_or_empty(const char *name,
+						 const struct hexagonfs_image *image,
+						 char *path)
 {
 	struct hexagonfs_dirent *file;
 
+	if (image != NULL)
+		return hfs_image(name, image, path, true);
+
+	if (path == NULL)
+		return NULL;
+
 	file = malloc(sizeof(struct hexagonfs_dirent));
-	if (file == NULL)
+	if (file == NULL) {
+		free(path);
 		return NULL;
+	}
 
 	file->name = name;
 	file->ops = &hexagonfs_mapped_or_empty_ops;
@@ -104,106 +161,911 @@ static struct hexagonfs_dirent *hfs_map_or_empty(const char *name, const char *p
 	return file;
 }
 
+static void hfs_free_merged(struct hexagonfs_dirent *ent);
+
+/*
+ * Free what a directory entry that was built separately refers to. The entry
+ * itself and its name belong to the caller.
+ */
+static void hfs_free_contents(struct hexagonfs_dirent *ent)
+{
+	size_t i;
+
+	if (ent->ops == &hexagonfs_virt_dir_ops) {
+		// Only merged directories have children
+		for (i = 0; i < ent->u.dir->n_ents; i++)
+			hfs_free_merged(ent->u.dir->ents[i]);
+
+		free(ent->u.dir->ents);
+		free(ent->u.dir);
+	} else if (ent->ops == &hexagonfs_image_ops) {
+		free(ent->u.ptr);
+	} else {
+		free((char *) ent->u.phys);
+	}
+}
+
+/*
+ * Free a child of a merged directory, which owns its name.
+ */
+static void hfs_free_merged(struct hexagonfs_dirent *ent)
+{
+	hfs_free_contents(ent);
+	free((char *) ent->name);
+	free(ent);
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir);
+	size_t name_len = strlen(name);
+	char *path;
+
+	while (dir_len && dir[dir_len - 1] == '/')
+		dir_len--;
+
+	path = malloc(dir_len + name_len + 2);
+	if (path == NULL)
+		return NULL;
+
+	memcpy(path, dir, dir_len);
+	path[dir_len] = '/';
+	memcpy(&path[dir_len + 1], name, name_len + 1);
+
+	return path;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * List the names in the given directories, sorted and without duplicates.
+ */
+static char **list_names(char *const *dirs, size_t n_dirs, size_t *n_names)
+{
+	struct dirent *ent;
+	char **names = NULL, **new_names;
+	size_t cap = 0, n = 0, i, j;
+	DIR *dir;
+
+	for (i = 0; i < n_dirs; i++) {
+		dir = opendir(dirs[i]);
+		if (dir == NULL)
+			continue;
+
+		while ((ent = readdir(dir)) != NULL) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+				continue;
+
+			if (n == cap) {
+				cap = cap ? cap * 2 : 16;
+				new_names = realloc(names, sizeof(*names) * cap);
+				if (new_names == NULL)
+					goto err;
+
+				names = new_names;
+			}
+
+			names[n] = strdup(ent->d_name);
+			if (names[n] == NULL)
+				goto err;
+
+			n++;
+		}
+
+		closedir(dir);
+	}
+
+	if (n)
+		qsort(names, n, sizeof(*names), compare_names);
+
+	for (i = 0, j = 0; i < n; i++) {
+		if (j && !strcmp(names[j - 1], names[i]))
+			free(names[i]);
+		else
+			names[j++] = names[i];
+	}
+
+	*n_names = j;
+
+	return names;
+
+err:
+	closedir(dir);
+
+	for (i = 0; i < n; i++)
+		free(names[i]);
+
+	free(names);
+
+	return NULL;
+}
+
+static struct hexagonfs_dirent *hfs_merge(const char *name,
+					  char *const *paths,
+					  size_t n_paths,
+					  bool or_empty,
+					  unsigned int depth);
+
+/*
+ * Merge directories into a virtual directory, where each child is looked up
+ * in the directories in order.
+ */
+static struct hexagonfs_dirent *hfs_merge_dirs(const char *name,
+					       char **dirs,
+					       size_t n_dirs,
+					       unsigned int depth)
+{
+	struct hexagonfs_dirent *dir, **list;
+	char **names, **child_paths;
+	size_t n_names, i = 0, j;
+
+	names = list_names(dirs, n_dirs, &n_names);
+	if (names == NULL)
+		return NULL;
+
+	list = malloc(sizeof(*list) * (n_names ? n_names : 1));
+	child_paths = malloc(sizeof(*child_paths) * n_dirs);
+	if (list == NULL || child_paths == NULL)
+		goto err;
+
+	for (i = 0; i < n_names; i++) {
+		for (j = 0; j < n_dirs; j++)
+			child_paths[j] = join_path(dirs[j], names[i]);
+
+		list[i] = hfs_merge(names[i], child_paths, n_dirs, false, depth + 1);
+
+		for (j = 0; j < n_dirs; j++)
+			free(child_paths[j]);
+
+		if (list[i] == NULL)
+			goto err;
+	}
+
+	dir = hfs_mkdir_list(name, n_names, list);
+	if (dir == NULL)
+		goto err;
+
+	free(child_paths);
+	free(names);
+
+	return dir;
+
+err:
+	// The children that were built own their names
+	for (j = 0; j < i; j++)
+		hfs_free_merged(list[j]);
+
+	for (j = i; j < n_names; j++)
+		free(names[j]);
+
+	free(child_paths);
+	free(list);
+	free(names);
+	return NULL;
+}
+
+/*
+ * Serve a path from an ordered list of layers, where earlier layers take
+ * precedence. A path that is a file or a directory in only one layer is
+ * mapped from the first layer that has it, so that changes to it are seen.
+ * Directories that exist in several layers are merged into virtual
+ * directories once, when the tree is built, so that lookups cost the same
+ * however many layers there are. The layer that serves each name is fixed
+ * then, so names that are added to or removed from a merged directory later
+ * are not seen.
+ *
+ * The paths are not freed.
+ */
+static struct hexagonfs_dirent *hfs_merge(const char *name,
+					  char *const *paths,
+					  size_t n_paths,
+					  bool or_empty,
+					  unsigned int depth)
+{
+	struct hexagonfs_dirent *ret = NULL;
+	struct stat phys;
+	char **dirs;
+	size_t first = n_paths, n_dirs = 0, i;
+
+	for (i = 0; i < n_paths; i++) {
+		if (paths[i] == NULL)
+			return NULL;
+	}
+
+	dirs = malloc(sizeof(*dirs) * n_paths);
+	if (dirs == NULL)
+		return NULL;
+
+	for (i = 0; i < n_paths; i++) {
+		if (stat(paths[i], &phys))
+			continue;
+
+		if (first == n_paths)
+			first = i;
+
+		// Files hide everything in the layers below them
+		if (!S_ISDIR(phys.st_mode))
+			break;
+
+		dirs[n_dirs++] = paths[i];
+	}
+
+	if (first == n_paths)
+		first = 0;
+
+	if (n_dirs > 1 && depth < MAX_MERGE_DEPTH)
+		ret = hfs_merge_dirs(name, dirs, n_dirs, depth);
+	else if (or_empty)
+		ret = hfs_map_or_empty(name, NULL, strdup(paths[first]));
+	else
+		ret = hfs_map(name, NULL, strdup(paths[first]));
+
+	free(dirs);
+
+	return ret;
+}
+
+/*
+ * Expand a path relative to a layer, replacing $DSP with the name of the DSP.
+ * The length is returned, and the path is only written if out is not NULL.
+ */
+static size_t expand_path(char *out, const char *prefix, const char *rel,
+			  const char *dsp)
+{
+	const char *src;
+	size_t len, n;
+
+	len = strlen(prefix);
+	if (out != NULL) {
+		memcpy(out, prefix, len);
+		out[len] = '/';
+	}
+
+	len++;
+
+	while (*rel != '\0') {
+		if (!strncmp(rel, "$DSP", 4)) {
+			src = dsp;
+			n = strlen(dsp);
+			rel += 4;
+		} else {
+			src = rel;
+			n = 1;
+			rel++;
+		}
+
+		if (out != NULL)
+			memcpy(&out[len], src, n);
+
+		len += n;
+	}
+
+	if (out != NULL)
+		out[len] = '\0';
+
+	return len;
+}
+
+/*
+ * Serve a path that is given relative to each of the layers, like
+ * hfs_merge(). Images have a single layer.
+ */
+static struct hexagonfs_dirent *hfs_layers(const char *name,
+					   const struct hexagonfs_image *image,
+					   const char *const *prefixes,
+					   size_t n_prefixes,
+					   const char *rel,
+					   const char *dsp,
+					   bool or_empty)
+{
+	struct hexagonfs_dirent *ret = NULL;
+	char **paths;
+	size_t i;
+
+	paths = calloc(n_prefixes, sizeof(*paths));
+	if (paths == NULL)
+		return NULL;
+
+	for (i = 0; i < n_prefixes; i++) {
+		paths[i] = malloc(expand_path(NULL, prefixes[i], rel, dsp) + 1);
+		if (paths[i] == NULL)
+			goto out;
+
+		expand_path(paths[i], prefixes[i], rel, dsp);
+	}
+
+	if (image != NULL) {
+		ret = hfs_image(name, image, paths[0], or_empty);
+		paths[0] = NULL;
+	} else {
+		ret = hfs_merge(name, paths, n_prefixes, or_empty, 0);
+	}
+
+out:
+	for (i = 0; i < n_prefixes; i++)
+		free(paths[i]);
+
+	free(paths);
+
+	return ret;
+}
+
 /*
- * Construct the root directory
+ * The layout of the virtual filesystem has one line for each served path,
+ * with the virtual path, how it is served and an argument:
+ *
+ *   map PATH           the file or directory at PATH in the layers
+ *   map_or_empty PATH  the same, or an empty directory if it does not exist
+ *   sysfs PATH         like map_or_empty, for sysfs attributes, which are
+ *                      read into memory when they are opened
+ *   synthetic NAME     a file generated by the daemon, see layout_generators
+ *   link VIRTUAL-PATH  another virtual path, like a hard link
  *
- * TODO: Make this free()-able with reference counts
+ * Physical paths are relative to the root directories, and $DSP is replaced
+ * by the name of the DSP. Parent directories are created as needed, and text
+ * after a '#' is ignored. Generated files can also be put in a directory that
+ * is mapped, and hide the physical file with the same name.
  */
-struct hexagonfs_dirent *construct_root_dir(const char *prefix, const char *dsp)
+const char rpcd_default_layout[] =
+	"# Some platforms need these in /, some in /mnt/vendor or /system\n"
+	"/mnt/vendor/persist			link		/persist\n"
+	"/persist/sensors/registry/registry	map		sensors/registry\n"
+	"/sys/devices/soc0			sysfs		socinfo\n"
+	"/sys/devices/soc0/platform_subtype_name	synthetic	plat_subtype_name\n"
+	"/system/vendor				link		/vendor\n"
+	"/usr/lib/qcom/adsp			map_or_empty	dsp/$DSP\n"
+	"/vendor/etc/acdbdata			map		acdb\n"
+	"/vendor/etc/sensors/config		map_or_empty	sensors/config\n"
+	"/vendor/etc/sensors/sns_reg_config	map		sensors/sns_reg.conf\n";
+
+enum layout_type {
+	LAYOUT_DIR,
+	LAYOUT_MAP,
+	LAYOUT_MAP_OR_EMPTY,
+	LAYOUT_SYSFS,
+	LAYOUT_SYNTHETIC,
+	LAYOUT_LINK,
+};
+
+/*
+ * Files that the daemon can generate. The generator is given a directory entry
+ * for its source, which is served like with the map type.
+ */
+static const struct layout_generator {
+	const char *name;
+	int (*generate)(const void *arg, char **data, size_t *size);
+	const char *source;
+} layout_generators[] = {
+	{
+		.name = "plat_subtype_name",
+		.generate = hexagonfs_plat_subtype_name_generate,
+		.source = "socinfo/platform_subtype_id",
+	},
+};
+
+/*
+ * Node of a layout while it is parsed. Children are kept sorted by name, so
+ * that they are laid out in the order that lookups expect.
+ */
+struct layout_node {
+	struct layout_node *parent;
+	struct layout_node *children;
+	struct layout_node *next;
+	size_t n_children;
+
+	const char *name;
+	enum layout_type type;
+	const char *arg;
+	size_t line;
+
+	// Position of the directory entry in the arena
+	size_t index;
+};
+
+struct layout {
+	// Copy of the text, split into strings in place
+	char *text;
+
+	struct layout_node root;
+	size_t n_nodes;
+	size_t n_dirs;
+};
+
+static const struct layout_generator *find_generator(const char *name)
 {
-	char *acdbdata, *dsp_libs, *sns_cfg, *sns_reg, *sns_reg_config, *socinfo;
-	size_t n_prefix;
-	struct hexagonfs_dirent *persist_dir, *vendor_dir;
+	size_t i;
 
-	n_prefix = strlen(prefix);
+	for (i = 0; i < sizeof(layout_generators) / sizeof(*layout_generators); i++) {
+		if (!strcmp(layout_generators[i].name, name))
+			return &layout_generators[i];
+	}
 
-	acdbdata = malloc(n_prefix + strlen(ACDBDATA) + 1);
-	sns_cfg = malloc(n_prefix + strlen(SENSORS_CONFIG) + 1);
-	sns_reg = malloc(n_prefix + strlen(SENSORS_REGISTRY) + 1);
-	sns_reg_config = malloc(n_prefix + strlen(SNS_REG_CONFIG) + 1);
-	socinfo = malloc(n_prefix + strlen(SYSFS_SOCINFO) + 1);
+	return NULL;
+}
 
-	dsp_libs = malloc(n_prefix + strlen(DSP_LIBS) + strlen(dsp) + 1);
+static void free_nodes(struct layout_node *node)
+{
+	struct layout_node *child, *next;
 
-	if (acdbdata != NULL) {
-		strcpy(acdbdata, prefix);
-		strcat(acdbdata, ACDBDATA);
+	for (child = node->children; child != NULL; child = next) {
+		next = child->next;
+		free_nodes(child);
+		free(child);
 	}
+}
+
+static struct layout_node *find_node(struct layout_node *dir,
+				     const char *name, size_t len,
+				     struct layout_node ***slot)
+{
+	struct layout_node **curr;
+	int cmp;
+
+	for (curr = &dir->children; *curr != NULL; curr = &(*curr)->next) {
+		cmp = strncmp((*curr)->name, name, len);
+		if (!cmp && (*curr)->name[len] != '\0')
+			cmp = 1;
 
-	if (sns_cfg != NULL) {
-		strcpy(sns_cfg, prefix);
-		strcat(sns_cfg, SENSORS_CONFIG);
+		if (!cmp) {
+			*slot = curr;
+			return *curr;
+		}
+
+		if (cmp > 0)
+			break;
 	}
 
-	if (sns_reg != NULL) {
-		strcpy(sns_reg, prefix);
-		strcat(sns_reg, SENSORS_REGISTRY);
+	*slot = curr;
+
+	return NULL;
+}
+
+static bool is_mapped(enum layout_type type)
+{
+	return type == LAYOUT_MAP || type == LAYOUT_MAP_OR_EMPTY
+	    || type == LAYOUT_SYSFS;
+}
+
+/*
+ * Check whether a node can be served as the given type. Mapped directories
+ * can only have generated files in them, which are added to what they serve.
+ */
+static bool can_serve(const struct layout_node *node, enum layout_type type)
+{
+	const struct layout_node *child;
+
+	if (node->arg != NULL)
+		return false;
+
+	for (child = node->children; child != NULL; child = child->next) {
+		if (!is_mapped(type) || child->type != LAYOUT_SYNTHETIC)
+			return false;
 	}
 
-	if (sns_reg_config != NULL) {
-		strcpy(sns_reg_config, prefix);
-		strcat(sns_reg_config, SNS_REG_CONFIG);
+	return true;
+}
+
+static int add_node(struct layout *layout, char *path, enum layout_type type,
+		    const char *arg, size_t line)
+{
+	struct layout_node *dir = &layout->root;
+	struct layout_node *node, **slot;
+	char *segment, *next, *save;
+
+	segment = strtok_r(path, "/", &save);
+	if (segment == NULL) {
+		fprintf(stderr, "Layout line %zu: the root cannot be replaced\n", line);
+		return -EINVAL;
 	}
 
-	if (socinfo != NULL) {
-		strcpy(socinfo, prefix);
-		strcat(socinfo, SYSFS_SOCINFO);
+	while (segment != NULL) {
+		next = strtok_r(NULL, "/", &save);
+
+		if (!strcmp(segment, ".") || !strcmp(segment, "..")) {
+			fprintf(stderr, "Layout line %zu: invalid path\n", line);
+			return -EINVAL;
+		}
+
+		if (dir->type != LAYOUT_DIR
+		 && (!is_mapped(dir->type) || next != NULL
+		  || type != LAYOUT_SYNTHETIC)) {
+			fprintf(stderr, "Layout line %zu: %s is inside a file or link\n",
+					line, segment);
+			return -EINVAL;
+		}
+
+		node = find_node(dir, segment, strlen(segment), &slot);
+		if (node == NULL) {
+			node = calloc(1, sizeof(*node));
+			if (node == NULL)
+				return -ENOMEM;
+
+			node->parent = dir;
+			node->name = segment;
+			node->type = LAYOUT_DIR;
+			node->line = line;
+
+			node->next = *slot;
+			*slot = node;
+			dir->n_children++;
+
+			layout->n_nodes++;
+			layout->n_dirs++;
+		}
+
+		dir = node;
+		segment = next;
+
+		if (segment == NULL && !can_serve(node, type)) {
+			fprintf(stderr, "Layout line %zu: %s is already served\n",
+					line, node->name);
+			return -EEXIST;
+		}
 	}
 
-	if (dsp_libs != NULL) {
-		strcpy(dsp_libs, prefix);
-		strcat(dsp_libs, DSP_LIBS);
-		strcat(dsp_libs, dsp);
+	dir->type = type;
+	dir->arg = arg;
+	layout->n_dirs--;
+
+	return 0;
+}
+
+static int parse_layout(struct layout *layout)
+{
+	char *line, *next, *path, *type, *arg, *save;
+	enum layout_type parsed;
+	size_t line_no = 0;
+	int ret;
+
+	for (line = layout->text; line != NULL; line = next) {
+		line_no++;
+
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+
+		line[strcspn(line, "#")] = '\0';
+
+		path = strtok_r(line, " \t", &save);
+		if (path == NULL)
+			continue;
+
+		type = strtok_r(NULL, " \t", &save);
+		arg = strtok_r(NULL, " \t", &save);
+		if (type == NULL || arg == NULL
+		 || strtok_r(NULL, " \t", &save) != NULL || *path != '/') {
+			fprintf(stderr, "Layout line %zu: expected VIRTUAL-PATH TYPE ARGUMENT\n",
+					line_no);
+			return -EINVAL;
+		}
+
+		if (!strcmp(type, "map")) {
+			parsed = LAYOUT_MAP;
+		} else if (!strcmp(type, "map_or_empty")) {
+			parsed = LAYOUT_MAP_OR_EMPTY;
+		} else if (!strcmp(type, "sysfs")) {
+			parsed = LAYOUT_SYSFS;
+		} else if (!strcmp(type, "synthetic")) {
+			parsed = LAYOUT_SYNTHETIC;
+		} else if (!strcmp(type, "link")) {
+			parsed = LAYOUT_LINK;
+		} else {
+			fprintf(stderr, "Layout line %zu: unknown type %s\n",
+					line_no, type);
+			return -EINVAL;
+		}
+
+		if (parsed == LAYOUT_SYNTHETIC && find_generator(arg) == NULL) {
+			fprintf(stderr, "Layout line %zu: unknown generated file %s\n",
+					line_no, arg);
+			return -EINVAL;
+		}
+
+		ret = add_node(layout, path, parsed, arg, line_no);
+		if (ret)
+			return ret;
 	}
 
-	/*
-	 * Some platforms need this in / and some need it in /mnt/vendor. Form
-	 * a hard link between both locations.
-	 */
-	persist_dir = hfs_mkdir("persist", 1,
-				hfs_mkdir("sensors", 1,
-					hfs_mkdir("registry", 1,
-						hfs_map("registry", sns_reg)
-					)
-				)
-		      );
+	return 0;
+}
+
+static struct hexagonfs_file_ops *layout_map_ops(enum layout_type type)
+{
+	if (type == LAYOUT_MAP)
+		return &hexagonfs_mapped_ops;
+	else if (type == LAYOUT_SYSFS)
+		return &hexagonfs_mapped_sysfs_ops;
+	else
+		return &hexagonfs_mapped_or_empty_ops;
+}
+
+/*
+ * Find the target of a link. Links cannot point to other links, or to a
+ * directory that contains them.
+ */
+static struct layout_node *resolve_link(struct layout *layout,
+					const struct layout_node *link)
+{
+	struct layout_node *node = &layout->root, **slot;
+	const struct layout_node *parent;
+	const char *path = link->arg;
+	size_t len;
+
+	while (*path != '\0' && node != NULL) {
+		len = strcspn(path, "/");
+
+		if (len)
+			node = find_node(node, path, len, &slot);
+
+		path += len;
+		while (*path == '/')
+			path++;
+	}
+
+	if (node == NULL || node->type == LAYOUT_LINK) {
+		fprintf(stderr, "Layout line %zu: %s is not a file or directory\n",
+				link->line, link->arg);
+		return NULL;
+	}
+
+	for (parent = link; parent != NULL; parent = parent->parent) {
+		if (parent == node) {
+			fprintf(stderr, "Layout line %zu: %s contains the link\n",
+					link->line, link->arg);
+			return NULL;
+		}
+	}
+
+	return node;
+}
+
+/*
+ * Serve a path like with the map type, into an entry that is already
+ * allocated. Directory entries that merge layers or come from an image are
+ * allocated separately and copied in, and physical paths are written to the
+ * strings when there is a single layer.
+ */
+static int build_leaf(struct hexagonfs_dirent *leaf, enum layout_type type,
+		      const char *arg, const char *const *prefixes,
+		      size_t n_prefixes, const char *dsp,
+		      const struct hexagonfs_image *image, char **strings)
+{
+	struct hexagonfs_dirent *ent;
+
+	if (image == NULL && n_prefixes == 1) {
+		leaf->ops = layout_map_ops(type);
+		leaf->u.phys = *strings;
+		*strings += expand_path(*strings, prefixes[0], arg, dsp) + 1;
+		return 0;
+	}
+
+	ent = hfs_layers(leaf->name, image, prefixes, n_prefixes, arg, dsp,
+			 type != LAYOUT_MAP);
+	if (ent == NULL)
+		return -ENOMEM;
 
 	/*
-	 * Some platforms need vendor in / and some need it in /system. Form
-	 * a hard link between both locations.
+	 * Only paths that are mapped from a single layer are read as sysfs
+	 * attributes. Images already have exact sizes.
 	 */
-	vendor_dir = hfs_mkdir("vendor", 1,
-				hfs_mkdir("etc", 2,
-					hfs_mkdir("sensors", 2,
-						hfs_map_or_empty("config", sns_cfg),
-						hfs_map("sns_reg_config", sns_reg_config)
-					),
-					hfs_map("acdbdata", acdbdata)
-				)
-			);
-
-	return hfs_mkdir("/", 6,
-			hfs_mkdir("mnt", 1,
-				hfs_mkdir("vendor", 1,
-					persist_dir
-				)
-			),
-			persist_dir,
-			hfs_mkdir("sys", 1,
-				hfs_mkdir("devices", 1,
-					hfs_map_or_empty("soc0", socinfo)
-				)
-			),
-			hfs_mkdir("system", 1,
-				vendor_dir
-			),
-			hfs_mkdir("usr", 1,
-				hfs_mkdir("lib", 1,
-					hfs_mkdir("qcom", 1,
-						hfs_map_or_empty("adsp", dsp_libs)
-					)
-				)
-			),
-			vendor_dir
-		);
+	if (ent->ops == &hexagonfs_mapped_or_empty_ops)
+		ent->ops = layout_map_ops(type);
+
+	leaf->ops = ent->ops;
+	leaf->u = ent->u;
+	free(ent);
+
+	return 0;
+}
+
+/*
+ * Lay the tree out in one allocation, with the directory entries first in
+ * breadth-first order, so that the children of a directory are next to each
+ * other, then the entries of mapped directories that have generated files in
+ * them, the sources of the generated files, the virtual directories, the
+ * generated files, the lists of children and the names.
+ */
+static struct hexagonfs_dirent *compile_layout(struct layout *layout,
+					       const char *const *prefixes,
+					       size_t n_prefixes,
+					       const char *dsp,
+					       const struct hexagonfs_image *image)
+{
+	struct layout_node **order, *node, *child, *target;
+	struct hexagonfs_dirent *dirents, *belows, *sources, **ents, *leaf;
+	struct hexagonfs_virt_dir *dirs;
+	struct hexagonfs_synthetic_file *files;
+	const struct layout_generator *generator;
+	bool direct = image == NULL && n_prefixes == 1;
+	size_t strings_size = 0, head, tail, n_dirs = 0, n_ents = 0, n_built = 0;
+	size_t n_belows = 0, n_files = 0;
+	char *arena, *strings;
+
+	order = malloc(sizeof(*order) * layout->n_nodes);
+	if (order == NULL)
+		return NULL;
+
+	order[0] = &layout->root;
+	tail = 1;
+
+	for (head = 0; head < tail; head++) {
+		node = order[head];
+		node->index = head;
+
+		strings_size += strlen(node->name) + 1;
+
+		if (node->type == LAYOUT_SYNTHETIC) {
+			generator = find_generator(node->arg);
+			if (direct)
+				strings_size += expand_path(NULL, prefixes[0],
+							    generator->source, dsp) + 1;
+			n_files++;
+		} else if (direct && is_mapped(node->type)) {
+			strings_size += expand_path(NULL, prefixes[0], node->arg, dsp) + 1;
+		}
+
+		if (is_mapped(node->type) && node->children != NULL)
+			n_belows++;
+
+		for (child = node->children; child != NULL; child = child->next)
+			order[tail++] = child;
+	}
+
+	arena = malloc(sizeof(*dirents) * (layout->n_nodes + n_belows + n_files)
+		       + sizeof(*dirs) * (layout->n_dirs + n_belows)
+		       + sizeof(*files) * n_files
+		       + sizeof(*ents) * (layout->n_nodes - 1)
+		       + strings_size);
+	if (arena == NULL)
+		goto err_free_order;
+
+	dirents = (struct hexagonfs_dirent *) arena;
+	belows = &dirents[layout->n_nodes];
+	sources = &belows[n_belows];
+	dirs = (struct hexagonfs_virt_dir *) &sources[n_files];
+	files = (struct hexagonfs_synthetic_file *) &dirs[layout->n_dirs + n_belows];
+	ents = (struct hexagonfs_dirent **) &files[n_files];
+	strings = (char *) &ents[layout->n_nodes - 1];
+
+	n_belows = 0;
+	n_files = 0;
+
+	for (head = 0; head < layout->n_nodes; head++) {
+		node = order[head];
+
+		strcpy(strings, node->name);
+		dirents[head].name = strings;
+		strings += strlen(strings) + 1;
+
+		// Mapped directories with generated files are served from below
+		leaf = node->children != NULL ? &belows[n_belows] : &dirents[head];
+
+		switch (node->type) {
+			case LAYOUT_DIR:
+				break;
+			case LAYOUT_MAP:
+			case LAYOUT_MAP_OR_EMPTY:
+			case LAYOUT_SYSFS:
+				leaf->name = dirents[head].name;
+
+				if (build_leaf(leaf, node->type, node->arg,
+					       prefixes, n_prefixes, dsp, image,
+					       &strings))
+					goto err_free_leaves;
+				break;
+			case LAYOUT_SYNTHETIC:
+				generator = find_generator(node->arg);
+
+				sources[n_files].name = dirents[head].name;
+				if (build_leaf(&sources[n_files], LAYOUT_MAP,
+					       generator->source, prefixes,
+					       n_prefixes, dsp, image, &strings))
+					goto err_free_leaves;
+
+				files[n_files].generate = generator->generate;
+				files[n_files].arg = &sources[n_files];
+				files[n_files].generated = false;
+				files[n_files].data = NULL;
+				files[n_files].size = 0;
+
+				dirents[head].ops = &hexagonfs_synthetic_ops;
+				dirents[head].u.ptr = &files[n_files++];
+				break;
+			case LAYOUT_LINK:
+				break;
+		}
+
+		if (node->type == LAYOUT_DIR || node->children != NULL) {
+			dirs[n_dirs].n_ents = node->n_children;
+			dirs[n_dirs].ents = &ents[n_ents];
+			dirs[n_dirs].below = NULL;
+			if (node->type != LAYOUT_DIR)
+				dirs[n_dirs].below = &belows[n_belows++];
+
+			for (child = node->children; child != NULL; child = child->next)
+				ents[n_ents++] = &dirents[child->index];
+
+			dirents[head].ops = &hexagonfs_virt_dir_ops;
+			dirents[head].u.dir = &dirs[n_dirs++];
+		}
+
+		n_built++;
+	}
+
+	// Links share what their target serves, under their own name
+	for (head = 0; head < layout->n_nodes; head++) {
+		node = order[head];
+		if (node->type != LAYOUT_LINK)
+			continue;
+
+		target = resolve_link(layout, node);
+		if (target == NULL)
+			goto err_free_leaves;
+
+		dirents[head].ops = dirents[target->index].ops;
+		dirents[head].u = dirents[target->index].u;
+	}
+
+	free(order);
+
+	return dirents;
+
+err_free_leaves:
+	// Leaves that were built separately only have their contents copied in
+	for (head = 0; head < n_built && !direct; head++) {
+		if (is_mapped(order[head]->type) && order[head]->children == NULL)
+			hfs_free_contents(&dirents[head]);
+	}
+
+	for (head = 0; head < n_belows && !direct; head++)
+		hfs_free_contents(&belows[head]);
+
+	for (head = 0; head < n_files && !direct; head++)
+		hfs_free_contents(&sources[head]);
+
+	free(arena);
+err_free_order:
+	free(order);
+	return NULL;
+}
+
+/*
+ * Construct the root directory from a layout and an ordered list of layers,
+ * where files in earlier layers override those in later ones. If an image is
+ * given, files are served from it instead, and there must be one layer, which
+ * should be empty.
+ *
+ * The tree is allocated at once and starts with the root directory, except
+ * for directories that are merged from several layers and files in images.
+ */
+struct hexagonfs_dirent *construct_root_dir(const char *layout_text,
+					    const char *const *prefixes,
+					    size_t n_prefixes,
+					    const char *dsp,
+					    const struct hexagonfs_image *image)
+{
+	struct hexagonfs_dirent *root = NULL;
+	struct layout layout = {
+		.root = {
+			.name = "/",
+			.type = LAYOUT_DIR,
+		},
+		.n_nodes = 1,
+		.n_dirs = 1,
+	};
+
+	layout.text = strdup(layout_text);
+	if (layout.text == NULL)
+		return NULL;
+
+	if (!parse_layout(&layout))
+		root = compile_layout(&layout, prefixes, n_prefixes, dsp, image);
+
+	free_nodes(&layout.root);
+	free(layout.text);
+
+	return root;
 }
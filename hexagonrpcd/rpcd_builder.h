@@ -24,6 +24,12 @@
 
 #include "hexagonfs.h"
 
-struct hexagonfs_dirent *construct_root_dir(const char *prefix, const char *dsp);
+extern const char rpcd_default_layout[];
+
+struct hexagonfs_dirent *construct_root_dir(const char *layout,
+					    const char *const *prefixes,
+					    size_t n_prefixes,
+					    const char *dsp,
+					    const struct hexagonfs_image *image);
 
 #endif
@@ -0,0 +1,264 @@
+/*
+ * FastRPC reverse tunnel - benchmark for argument encoder/decoder
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <libhexagonrpc/fastrpc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../hexagonrpcd/iobuffer.h"
+
+#define BENCH_BYTES (64UL * 1024 * 1024)
+
+/*
+ * The benchmark is linked with -Wl,--wrap=malloc so that allocations made by
+ * the codec can be counted.
+ */
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size);
+
+static size_t n_allocs;
+
+void *__wrap_malloc(size_t size)
+{
+	n_allocs++;
+
+	return __real_malloc(size);
+}
+
+struct bench_shape {
+	const char *name;
+	size_t n_bufs;
+	const uint32_t *sizes;
+	uint32_t size;
+};
+
+// Same sizes as misaligned_iobufs in test_iobuffer.c
+static const uint32_t misaligned_sizes[] = { 1, 10, 3, 4, 5, 6, 7, 2, };
+
+// A typical apps_std_fopen_with_env() call: primary buffer and three strings
+static const uint32_t fopen_sizes[] = { 20, 18, 28, 2, };
+
+static const struct bench_shape shapes[] = {
+	{
+		.name = "fopen",
+		.n_bufs = 4,
+		.sizes = fopen_sizes,
+	},
+	{
+		.name = "misaligned",
+		.n_bufs = 8,
+		.sizes = misaligned_sizes,
+	},
+	{ .name = "tiny (255 x 1B)",	.n_bufs = 255,	.size = 1, },
+	{ .name = "odd (64 x 13B)",	.n_bufs = 64,	.size = 13, },
+	{ .name = "large (1 x 1MiB)",	.n_bufs = 1,	.size = 1048576, },
+};
+
+/*
+ * Chunk patterns for the decoder, cycled through for each call. An empty
+ * pattern means the whole message is passed at once.
+ */
+struct bench_chunks {
+	const char *name;
+	size_t n;
+	const size_t *lens;
+};
+
+static const size_t chunks_bytes[] = { 1, };
+static const size_t chunks_odd[] = { 7, };
+static const size_t chunks_varying[] = { 3, 1, 64, 5, 256, 2, 31, 4096, };
+
+static const struct bench_chunks chunk_patterns[] = {
+	{ .name = "whole",	.n = 0, },
+	{ .name = "1B",		.n = 1,	.lens = chunks_bytes, },
+	{ .name = "7B",		.n = 1,	.lens = chunks_odd, },
+	{ .name = "varying",	.n = 8,	.lens = chunks_varying, },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *shape, const char *op, const char *variant,
+		   size_t iters, size_t len, double secs, size_t allocs)
+{
+	printf("%-18s %-7s %-8s %9.3f GB/s %10.1f ns/msg %7.2f allocs/msg\n",
+	       shape, op, variant,
+	       iters * len / secs / 1e9,
+	       secs / iters * 1e9,
+	       (double) allocs / iters);
+}
+
+static int decode_once(size_t n_bufs, size_t len, const char *enc,
+		       const struct bench_chunks *chunks)
+{
+	struct fastrpc_decoder_context *ctx;
+	size_t off, seg;
+	size_t i = 0;
+	int ret;
+
+	ctx = inbuf_decode_start(REMOTE_SCALARS_MAKE(1, n_bufs, 0));
+	if (ctx == NULL)
+		return 1;
+
+	for (off = 0; off < len; off += seg) {
+		seg = len - off;
+		if (chunks->n && chunks->lens[i % chunks->n] < seg)
+			seg = chunks->lens[i % chunks->n];
+
+		ret = inbuf_decode(ctx, seg, &enc[off]);
+		if (ret)
+			return 1;
+
+		i++;
+	}
+
+	if (!inbuf_decode_is_complete(ctx))
+		return 1;
+
+	iobuf_free(n_bufs, inbuf_decode_finish(ctx));
+
+	return 0;
+}
+
+static int bench_decode(const struct bench_shape *shape,
+			const struct bench_chunks *chunks,
+			size_t len, const char *enc)
+{
+	size_t iters, allocs, i;
+	double start, secs;
+	int ret = 0;
+
+	iters = BENCH_BYTES / len + 1;
+
+	allocs = n_allocs;
+	start = now();
+	for (i = 0; i < iters && !ret; i++)
+		ret = decode_once(shape->n_bufs, len, enc, chunks);
+	secs = now() - start;
+	allocs = n_allocs - allocs;
+
+	report(shape->name, "decode", chunks->name, iters, len, secs, allocs);
+
+	return ret;
+}
+
+static void bench_encode(const struct bench_shape *shape,
+			 const struct fastrpc_io_buffer *bufs,
+			 size_t len, char *enc)
+{
+	size_t iters, allocs, i;
+	double start, secs;
+
+	iters = BENCH_BYTES / len + 1;
+
+	allocs = n_allocs;
+	start = now();
+	for (i = 0; i < iters; i++)
+		outbufs_encode(shape->n_bufs, bufs, enc);
+	secs = now() - start;
+	allocs = n_allocs - allocs;
+
+	report(shape->name, "encode", "", iters, len, secs, allocs);
+}
+
+static int bench_calculate_size(const struct bench_shape *shape,
+				const struct fastrpc_io_buffer *bufs,
+				size_t len)
+{
+	volatile size_t size = 0;
+	size_t iters, allocs, i;
+	double start, secs;
+
+	iters = BENCH_BYTES / len + 1;
+
+	allocs = n_allocs;
+	start = now();
+	for (i = 0; i < iters; i++)
+		size = outbufs_calculate_size(shape->n_bufs, bufs);
+	secs = now() - start;
+	allocs = n_allocs - allocs;
+
+	report(shape->name, "size", "", iters, len, secs, allocs);
+
+	return size != len;
+}
+
+static int bench_shape(const struct bench_shape *shape)
+{
+	struct fastrpc_io_buffer *bufs;
+	size_t len, i;
+	char *enc;
+	int ret = 0;
+
+	bufs = calloc(shape->n_bufs, sizeof(*bufs));
+	if (bufs == NULL)
+		return 1;
+
+	for (i = 0; i < shape->n_bufs; i++) {
+		bufs[i].s = shape->sizes ? shape->sizes[i] : shape->size;
+		bufs[i].p = calloc(1, bufs[i].s);
+		if (bufs[i].p == NULL)
+			return 1;
+	}
+
+	len = outbufs_calculate_size(shape->n_bufs, bufs);
+	enc = malloc(len);
+	if (enc == NULL)
+		return 1;
+
+	outbufs_encode(shape->n_bufs, bufs, enc);
+
+	for (i = 0; i < sizeof(chunk_patterns) / sizeof(*chunk_patterns) && !ret; i++)
+		ret = bench_decode(shape, &chunk_patterns[i], len, enc);
+
+	if (!ret) {
+		bench_encode(shape, bufs, len, enc);
+		ret = bench_calculate_size(shape, bufs, len);
+	}
+
+	free(enc);
+	iobuf_free(shape->n_bufs, bufs);
+
+	return ret;
+}
+
+int main(int argc, const char **argv)
+{
+	size_t i;
+	int ret;
+
+	for (i = 0; i < sizeof(shapes) / sizeof(*shapes); i++) {
+		ret = bench_shape(&shapes[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
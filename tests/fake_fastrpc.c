@@ -0,0 +1,876 @@
+/*
+ * FastRPC reverse tunnel - emulated FastRPC device and remote processor
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This library is loaded into hexagonrpcd with LD_PRELOAD. It intercepts all
+ * FastRPC ioctls, regardless of the file descriptor they are issued on, so the
+ * daemon can be pointed at any file (e.g. -f /dev/null).
+ *
+ * The remote processor side is a scripted fake DSP that sends reverse tunnel
+ * requests through adsp_listener_next2 and checks the results. It is
+ * configured with environment variables:
+ *
+ *   FAKE_FASTRPC_SCRIPT	script to run (see below)
+ *   FAKE_FASTRPC_REPEAT	number of times each stream runs the script
+ *   FAKE_FASTRPC_STREAMS	number of independent copies of the script
+ *   FAKE_FASTRPC_RATE		maximum requests per second (0 = unlimited)
+ *
+ * Each line of the script is one operation, optionally prefixed with "!" if
+ * the operation is expected to fail:
+ *
+ *   open IFACE			remotectl open of a local interface
+ *   close IFACE		remotectl close of a local interface
+ *   fopen ENV PATH		apps_std_fopen_with_env(ENV, PATH, "r")
+ *   fread SIZE			apps_std_fread() in SIZE chunks until EOF
+ *   fseek POS			apps_std_fseek(POS, SEEK_SET)
+ *   fclose			apps_std_fclose()
+ *   stat PATH			apps_std_stat(PATH)
+ *   opendir PATH		apps_std_opendir(PATH)
+ *   readdir			apps_std_readdir() until the end
+ *   closedir			apps_std_closedir()
+ *   mmap LEN			apps_mem_request_map64(LEN)
+ *
+ * Once every stream has finished, a summary with the request latencies is
+ * printed and the process exits, with a non-zero status if any operation
+ * did not have the expected result.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/interfaces/remotectl.def>
+#include <misc/fastrpc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hexagonrpcd/interfaces/adsp_default_listener.def"
+#include "../hexagonrpcd/interfaces/adsp_listener.def"
+#include "../hexagonrpcd/interfaces/apps_mem.def"
+#include "../hexagonrpcd/interfaces/apps_std.def"
+#include "../hexagonrpcd/iobuffer.h"
+
+// Handle given out for adsp_default_listener, distinct from the fixed ones
+#define FAKE_DEFAULT_LISTENER_HANDLE 7
+
+#define FAKE_MAX_IFACES 8
+#define FAKE_MAX_ARGS 8
+
+// See fastrpc.git/src/apps_mem_imp.c
+#define ADSP_MMAP_ADD_PAGES 0x1000
+
+enum fake_op {
+	FAKE_OPEN,
+	FAKE_CLOSE,
+	FAKE_FOPEN,
+	FAKE_FREAD,
+	FAKE_FSEEK,
+	FAKE_FCLOSE,
+	FAKE_STAT,
+	FAKE_OPENDIR,
+	FAKE_READDIR,
+	FAKE_CLOSEDIR,
+	FAKE_MMAP,
+};
+
+struct fake_step {
+	enum fake_op op;
+	bool expect_fail;
+	char *arg;
+	char *arg2;
+	uint32_t num;
+};
+
+struct fake_iface_handle {
+	const char *name;
+	uint32_t handle;
+};
+
+struct fake_stream {
+	int devfd;
+	size_t pos;
+	unsigned long pass;
+	bool busy;
+	bool done;
+
+	struct fake_iface_handle ifaces[FAKE_MAX_IFACES];
+	size_t n_ifaces;
+
+	uint32_t file;
+	uint64_t dir;
+
+	// The request that is currently being processed by the daemon
+	uint32_t rctx;
+	const struct fastrpc_function_def_interp2 *def;
+	double sent;
+};
+
+static const struct {
+	const char *name;
+	enum fake_op op;
+	int n_args;
+	bool numeric;
+} fake_ops[] = {
+	{ "open",	FAKE_OPEN,	1, false, },
+	{ "close",	FAKE_CLOSE,	1, false, },
+	{ "fopen",	FAKE_FOPEN,	2, false, },
+	{ "fread",	FAKE_FREAD,	1, true, },
+	{ "fseek",	FAKE_FSEEK,	1, true, },
+	{ "fclose",	FAKE_FCLOSE,	0, false, },
+	{ "stat",	FAKE_STAT,	1, false, },
+	{ "opendir",	FAKE_OPENDIR,	1, false, },
+	{ "readdir",	FAKE_READDIR,	0, false, },
+	{ "closedir",	FAKE_CLOSEDIR,	0, false, },
+	{ "mmap",	FAKE_MMAP,	1, true, },
+};
+
+static pthread_once_t fake_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fake_cond = PTHREAD_COND_INITIALIZER;
+
+static int (*real_ioctl)(int fd, unsigned long request, ...);
+
+static struct fake_step *steps;
+static size_t n_steps;
+static unsigned long repeat = 1;
+static double rate;
+
+static struct fake_stream *streams;
+static size_t n_streams = 1;
+static size_t n_done;
+
+static uint32_t next_rctx = 1;
+static uint64_t next_vaddr = 0x80000000;
+static double next_send;
+
+static double *latencies;
+static size_t n_latencies;
+static size_t max_latencies;
+static unsigned long n_failures;
+static double first_sent;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t;
+	ts.tv_nsec = (t - ts.tv_sec) * 1e9;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int parse_step(char *line, struct fake_step *step)
+{
+	char *save, *tok;
+	size_t i;
+
+	tok = strtok_r(line, " \t\n", &save);
+	if (tok == NULL || tok[0] == '#')
+		return 1;
+
+	step->expect_fail = !strcmp(tok, "!");
+	if (step->expect_fail)
+		tok = strtok_r(NULL, " \t\n", &save);
+
+	for (i = 0; i < sizeof(fake_ops) / sizeof(*fake_ops); i++) {
+		if (tok != NULL && !strcmp(tok, fake_ops[i].name))
+			break;
+	}
+
+	if (i == sizeof(fake_ops) / sizeof(*fake_ops)) {
+		fprintf(stderr, "fake_fastrpc: unknown operation %s\n", tok);
+		return -1;
+	}
+
+	step->op = fake_ops[i].op;
+	step->arg = NULL;
+	step->arg2 = NULL;
+	step->num = 0;
+
+	if (fake_ops[i].n_args >= 1) {
+		tok = strtok_r(NULL, " \t\n", &save);
+		if (tok == NULL)
+			goto err_args;
+
+		if (fake_ops[i].numeric)
+			step->num = strtoul(tok, NULL, 0);
+		else
+			step->arg = strdup(tok);
+	}
+
+	if (fake_ops[i].n_args >= 2) {
+		tok = strtok_r(NULL, " \t\n", &save);
+		if (tok == NULL)
+			goto err_args;
+
+		step->arg2 = strdup(tok);
+	}
+
+	return 0;
+
+err_args:
+	fprintf(stderr, "fake_fastrpc: missing argument for %s\n", fake_ops[i].name);
+	return -1;
+}
+
+static int load_script(const char *path)
+{
+	struct fake_step *tmp;
+	size_t max_steps = 0;
+	char line[512];
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "fake_fastrpc: could not open %s: %s\n",
+				path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (n_steps == max_steps) {
+			max_steps = max_steps ? max_steps * 2 : 16;
+			tmp = realloc(steps, sizeof(*steps) * max_steps);
+			if (tmp == NULL) {
+				fclose(f);
+				return -1;
+			}
+
+			steps = tmp;
+		}
+
+		ret = parse_step(line, &steps[n_steps]);
+		if (ret < 0) {
+			fclose(f);
+			return -1;
+		}
+
+		if (!ret)
+			n_steps++;
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+static void fake_init(void)
+{
+	const char *env;
+	size_t i;
+
+	*(void **) &real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+
+	env = getenv("FAKE_FASTRPC_REPEAT");
+	if (env != NULL)
+		repeat = strtoul(env, NULL, 0);
+
+	env = getenv("FAKE_FASTRPC_STREAMS");
+	if (env != NULL)
+		n_streams = strtoul(env, NULL, 0);
+
+	env = getenv("FAKE_FASTRPC_RATE");
+	if (env != NULL)
+		rate = strtod(env, NULL);
+
+	env = getenv("FAKE_FASTRPC_SCRIPT");
+	if (env != NULL && load_script(env))
+		exit(1);
+
+	if (!n_streams)
+		n_streams = 1;
+
+	streams = calloc(n_streams, sizeof(*streams));
+	if (streams == NULL)
+		exit(1);
+
+	for (i = 0; i < n_streams; i++) {
+		streams[i].devfd = -1;
+		streams[i].done = (n_steps == 0 || repeat == 0);
+		if (streams[i].done)
+			n_done++;
+	}
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report_and_exit(void)
+{
+	double elapsed = n_latencies ? now() - first_sent : 0;
+	double sum = 0;
+	size_t i;
+
+	qsort(latencies, n_latencies, sizeof(*latencies), compare_latency);
+
+	for (i = 0; i < n_latencies; i++)
+		sum += latencies[i];
+
+	fprintf(stderr, "fake_fastrpc: %zu requests in %.3f s (%.0f req/s), %lu failures\n",
+			n_latencies, elapsed,
+			elapsed > 0 ? n_latencies / elapsed : 0.0,
+			n_failures);
+
+	if (n_latencies) {
+		fprintf(stderr, "fake_fastrpc: latency mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+				sum / n_latencies * 1e6,
+				latencies[n_latencies / 2] * 1e6,
+				latencies[n_latencies * 99 / 100] * 1e6,
+				latencies[n_latencies - 1] * 1e6);
+	}
+
+	fflush(stderr);
+	fflush(stdout);
+
+	exit(n_failures != 0);
+}
+
+static const char *step_iface(const struct fake_step *step)
+{
+	if (step->op == FAKE_CLOSE)
+		return step->arg;
+	else if (step->op == FAKE_MMAP)
+		return "apps_mem";
+	else
+		return "apps_std";
+}
+
+static int find_iface_handle(const struct fake_stream *s, const char *name,
+			     uint32_t *handle)
+{
+	size_t i;
+
+	for (i = 0; i < s->n_ifaces; i++) {
+		if (!strcmp(s->ifaces[i].name, name)) {
+			*handle = s->ifaces[i].handle;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static void forget_iface(struct fake_stream *s, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < s->n_ifaces; i++) {
+		if (!strcmp(s->ifaces[i].name, name)) {
+			s->ifaces[i] = s->ifaces[--s->n_ifaces];
+			return;
+		}
+	}
+}
+
+/*
+ * Encode a call to a method the same way the remote processor does: the
+ * primary input buffer has the input numbers followed by the sizes of all
+ * input and output buffers.
+ */
+static int encode_call(const struct fastrpc_function_def_interp2 *def,
+		       const uint32_t *nums,
+		       const struct fastrpc_io_buffer *bufs,
+		       const uint32_t *out_sizes,
+		       uint32_t *sc,
+		       size_t max_len, void *dest, uint32_t *len)
+{
+	struct fastrpc_io_buffer in[FAKE_MAX_ARGS];
+	uint32_t prim[FAKE_MAX_ARGS * 3];
+	uint8_t in_count, out_count;
+	size_t size;
+	uint8_t i;
+
+	in_count = def->in_bufs + ((def->in_nums
+				 || def->in_bufs
+				 || def->out_bufs) && 1);
+	out_count = def->out_bufs + (def->out_nums && 1);
+
+	for (i = 0; i < def->in_nums; i++)
+		prim[i] = nums[i];
+
+	for (i = 0; i < def->in_bufs; i++) {
+		prim[def->in_nums + i] = bufs[i].s;
+		in[i + 1] = bufs[i];
+	}
+
+	for (i = 0; i < def->out_bufs; i++)
+		prim[def->in_nums + def->in_bufs + i] = out_sizes[i];
+
+	in[0].s = 4 * (def->in_nums + def->in_bufs + def->out_bufs);
+	in[0].p = prim;
+
+	size = outbufs_calculate_size(in_count, in);
+	if (size > max_len)
+		return -1;
+
+	outbufs_encode(in_count, in, dest);
+
+	*sc = REMOTE_SCALARS_MAKE(def->msg_id, in_count, out_count);
+	*len = size;
+
+	return 0;
+}
+
+static struct fastrpc_io_buffer string_buf(const char *str)
+{
+	struct fastrpc_io_buffer buf = {
+		.s = strlen(str) + 1,
+		.p = (void *) str,
+	};
+
+	return buf;
+}
+
+static int build_request(struct fake_stream *s, const struct fake_step *step,
+			 uint32_t *handle, uint32_t *sc,
+			 size_t max_len, void *dest, uint32_t *len)
+{
+	const struct fastrpc_function_def_interp2 *def;
+	struct fastrpc_io_buffer bufs[4];
+	uint32_t nums[8] = { 0 };
+	uint32_t out_sizes[1] = { 0 };
+
+	if (step->op == FAKE_OPEN) {
+		*handle = REMOTECTL_HANDLE;
+	} else if (find_iface_handle(s, step_iface(step), handle)) {
+		fprintf(stderr, "fake_fastrpc: %s used before it was opened\n",
+				step_iface(step));
+		return -1;
+	}
+
+	if (step->op == FAKE_CLOSE) {
+		nums[0] = *handle;
+		*handle = REMOTECTL_HANDLE;
+	}
+
+	switch (step->op) {
+	case FAKE_OPEN:
+		def = &remotectl_open_def;
+		bufs[0] = string_buf(step->arg);
+		out_sizes[0] = 256;
+		break;
+	case FAKE_CLOSE:
+		def = &remotectl_close_def;
+		out_sizes[0] = 256;
+		break;
+	case FAKE_FOPEN:
+		def = &apps_std_fopen_with_env_def;
+		bufs[0] = string_buf(step->arg);
+		bufs[1] = string_buf(":");
+		bufs[2] = string_buf(step->arg2);
+		bufs[3] = string_buf("r");
+		break;
+	case FAKE_FREAD:
+		def = &apps_std_fread_def;
+		nums[0] = s->file;
+		out_sizes[0] = step->num;
+		break;
+	case FAKE_FSEEK:
+		def = &apps_std_fseek_def;
+		nums[0] = s->file;
+		nums[1] = step->num;
+		nums[2] = 0;
+		break;
+	case FAKE_FCLOSE:
+		def = &apps_std_fclose_def;
+		nums[0] = s->file;
+		break;
+	case FAKE_STAT:
+		def = &apps_std_stat_def;
+		bufs[0] = string_buf(step->arg);
+		break;
+	case FAKE_OPENDIR:
+		def = &apps_std_opendir_def;
+		bufs[0] = string_buf(step->arg);
+		break;
+	case FAKE_READDIR:
+		def = &apps_std_readdir_def;
+		nums[0] = s->dir & 0xFFFFFFFF;
+		nums[1] = s->dir >> 32;
+		break;
+	case FAKE_CLOSEDIR:
+		def = &apps_std_closedir_def;
+		nums[0] = s->dir & 0xFFFFFFFF;
+		nums[1] = s->dir >> 32;
+		break;
+	case FAKE_MMAP:
+		def = &apps_mem_request_map64_def;
+		nums[2] = ADSP_MMAP_ADD_PAGES;
+		nums[6] = step->num;
+		break;
+	default:
+		return -1;
+	}
+
+	s->def = def;
+
+	return encode_call(def, nums, bufs, out_sizes, sc, max_len, dest, len);
+}
+
+static void step_failed(const struct fake_stream *s, const struct fake_step *step,
+			uint32_t result)
+{
+	fprintf(stderr, "fake_fastrpc: stream %zu: step %zu (%s %s %s) %s: %u\n",
+			s - streams, s->pos + 1,
+			fake_ops[step->op].name,
+			step->arg ? step->arg : "",
+			step->arg2 ? step->arg2 : "",
+			step->expect_fail ? "unexpectedly succeeded" : "failed",
+			result);
+	n_failures++;
+}
+
+/*
+ * Process the result of the stream's outstanding request, and advance the
+ * stream to its next step unless the current step needs to be repeated.
+ */
+static void complete_request(struct fake_stream *s, uint32_t result,
+			     size_t len, const void *encoded)
+{
+	const struct fake_step *step = &steps[s->pos];
+	struct fastrpc_decoder_context *ctx;
+	struct fastrpc_io_buffer *out = NULL;
+	const uint32_t *prim = NULL;
+	uint8_t out_count;
+	bool again = false;
+	double *tmp;
+	int ret;
+
+	if (n_latencies == max_latencies) {
+		max_latencies = max_latencies ? max_latencies * 2 : 1024;
+		tmp = realloc(latencies, sizeof(*latencies) * max_latencies);
+		if (tmp == NULL)
+			exit(1);
+
+		latencies = tmp;
+	}
+
+	latencies[n_latencies++] = now() - s->sent;
+
+	out_count = s->def->out_bufs + (s->def->out_nums && 1);
+
+	if (!result && out_count) {
+		ctx = inbuf_decode_start(REMOTE_SCALARS_MAKE(0, out_count, 0));
+		if (ctx == NULL)
+			exit(1);
+
+		ret = inbuf_decode(ctx, len, encoded);
+		if (ret || !inbuf_decode_is_complete(ctx)) {
+			fprintf(stderr, "fake_fastrpc: malformed output buffers\n");
+			n_failures++;
+			result = -1;
+		}
+
+		out = inbuf_decode_finish(ctx);
+		if (!result)
+			prim = out[0].p;
+	}
+
+	if ((result != 0) != step->expect_fail)
+		step_failed(s, step, result);
+
+	if (prim != NULL) {
+		switch (step->op) {
+		case FAKE_OPEN:
+			if (prim[1] == 0 && s->n_ifaces < FAKE_MAX_IFACES) {
+				s->ifaces[s->n_ifaces].name = step->arg;
+				s->ifaces[s->n_ifaces].handle = prim[0];
+				s->n_ifaces++;
+			}
+			break;
+		case FAKE_CLOSE:
+			forget_iface(s, step->arg);
+			break;
+		case FAKE_FOPEN:
+			s->file = prim[0];
+			break;
+		case FAKE_FREAD:
+			again = !prim[1];
+			break;
+		case FAKE_OPENDIR:
+			s->dir = prim[0] | (uint64_t) prim[1] << 32;
+			break;
+		case FAKE_READDIR:
+			again = !prim[65];
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (out != NULL)
+		iobuf_free(out_count, out);
+
+	s->busy = false;
+
+	if (again)
+		return;
+
+	s->pos++;
+	if (s->pos == n_steps) {
+		s->pos = 0;
+		s->pass++;
+		s->n_ifaces = 0;
+	}
+
+	if (s->pass == repeat) {
+		s->done = true;
+		n_done++;
+	}
+}
+
+static struct fake_stream *find_request(uint32_t rctx)
+{
+	size_t i;
+
+	for (i = 0; i < n_streams; i++) {
+		if (streams[i].busy && streams[i].rctx == rctx)
+			return &streams[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Streams are bound to the FastRPC device they are first sent to, because
+ * handles of opened interfaces are only valid on that device.
+ */
+static struct fake_stream *pick_stream(int fd)
+{
+	size_t i;
+
+	for (i = 0; i < n_streams; i++) {
+		if (!streams[i].busy && !streams[i].done
+		 && streams[i].devfd == fd)
+			return &streams[i];
+	}
+
+	for (i = 0; i < n_streams; i++) {
+		if (!streams[i].busy && !streams[i].done
+		 && streams[i].devfd == -1) {
+			streams[i].devfd = fd;
+			return &streams[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool any_busy(void)
+{
+	size_t i;
+
+	for (i = 0; i < n_streams; i++) {
+		if (streams[i].busy)
+			return true;
+	}
+
+	return false;
+}
+
+static int listener_next2(int fd, const struct fastrpc_invoke_args *args)
+{
+	const uint32_t *in = (const uint32_t *) args[0].ptr;
+	uint32_t *out = (uint32_t *) args[2].ptr;
+	struct fake_stream *s;
+	uint32_t handle, sc, len;
+	double send_at = 0;
+	int ret;
+
+	pthread_mutex_lock(&fake_lock);
+
+	if (in[0] != 0) {
+		s = find_request(in[0]);
+		if (s == NULL) {
+			fprintf(stderr, "fake_fastrpc: result for unknown request %u\n", in[0]);
+			n_failures++;
+		} else {
+			complete_request(s, in[1], args[1].length,
+					 (const void *) args[1].ptr);
+		}
+
+		pthread_cond_broadcast(&fake_cond);
+	}
+
+	while ((s = pick_stream(fd)) == NULL) {
+		if (n_done == n_streams && !any_busy())
+			report_and_exit();
+
+		pthread_cond_wait(&fake_cond, &fake_lock);
+	}
+
+	ret = build_request(s, &steps[s->pos], &handle, &sc,
+			    args[3].length, (void *) args[3].ptr, &len);
+	if (ret) {
+		n_failures++;
+		report_and_exit();
+	}
+
+	s->busy = true;
+	s->rctx = next_rctx++;
+
+	if (rate > 0) {
+		if (next_send < now())
+			next_send = now();
+
+		send_at = next_send;
+		next_send += 1 / rate;
+	}
+
+	pthread_mutex_unlock(&fake_lock);
+
+	if (send_at)
+		sleep_until(send_at);
+
+	pthread_mutex_lock(&fake_lock);
+	s->sent = now();
+	if (!first_sent)
+		first_sent = s->sent;
+	pthread_mutex_unlock(&fake_lock);
+
+	out[0] = s->rctx;
+	out[1] = handle;
+	out[2] = sc;
+	out[3] = len;
+
+	return 0;
+}
+
+static int remotectl(const struct fastrpc_invoke *invoke,
+		     const struct fastrpc_invoke_args *args)
+{
+	uint32_t *out;
+
+	// The primary output buffer follows the input buffers
+	out = (uint32_t *) args[REMOTE_SCALARS_INBUFS(invoke->sc)].ptr;
+
+	switch (REMOTE_SCALARS_METHOD(invoke->sc)) {
+	case 0:
+		// Every remote interface opens successfully
+		out[0] = FAKE_DEFAULT_LISTENER_HANDLE;
+		out[1] = 0;
+		return 0;
+	case 1:
+		out[0] = 0;
+		return 0;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+static int invoke(int fd, const struct fastrpc_invoke *invoke)
+{
+	const struct fastrpc_invoke_args *args;
+	uint32_t method = REMOTE_SCALARS_METHOD(invoke->sc);
+
+	args = (const struct fastrpc_invoke_args *) invoke->args;
+
+	if (invoke->handle == REMOTECTL_HANDLE)
+		return remotectl(invoke, args);
+
+	if (invoke->handle == FAKE_DEFAULT_LISTENER_HANDLE
+	 && method == adsp_default_listener_register_def.msg_id)
+		return 0;
+
+	if (invoke->handle == ADSP_LISTENER_HANDLE) {
+		if (method == adsp_listener_init2_def.msg_id)
+			return 0;
+		else if (method == adsp_listener_next2_def.msg_id)
+			return listener_next2(fd, args);
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+__attribute__((visibility("default")))
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct fastrpc_alloc_dma_buf *dmabuf;
+	struct fastrpc_req_mmap *mmap;
+	va_list va;
+	void *arg;
+
+	va_start(va, request);
+	arg = va_arg(va, void *);
+	va_end(va);
+
+	pthread_once(&fake_once, fake_init);
+
+	if (_IOC_TYPE(request) != 'R')
+		return real_ioctl(fd, request, arg);
+
+	switch (request) {
+	case FASTRPC_IOCTL_INIT_ATTACH:
+	case FASTRPC_IOCTL_INIT_ATTACH_SNS:
+	case FASTRPC_IOCTL_INIT_CREATE:
+	case FASTRPC_IOCTL_FREE_DMA_BUFF:
+	case FASTRPC_IOCTL_MUNMAP:
+		return 0;
+	case FASTRPC_IOCTL_INVOKE:
+		return invoke(fd, arg);
+	case FASTRPC_IOCTL_ALLOC_DMA_BUFF:
+		dmabuf = arg;
+		dmabuf->fd = memfd_create("fake_fastrpc_dmabuf", MFD_CLOEXEC);
+		if (dmabuf->fd == -1)
+			return -1;
+
+		return ftruncate(dmabuf->fd, dmabuf->size);
+	case FASTRPC_IOCTL_MMAP:
+		mmap = arg;
+
+		pthread_mutex_lock(&fake_lock);
+		mmap->vaddrout = next_vaddr;
+		next_vaddr += (mmap->size + 0xFFF) & ~0xFFFULL;
+		pthread_mutex_unlock(&fake_lock);
+
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
@@ -19,13 +19,22 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <libhexagonrpc/fastrpc.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "../hexagonrpcd/hexagonfs.h"
+#include "../hexagonrpcd/hexagonfs_image.h"
+#include "../hexagonrpcd/rpcd_builder.h"
 
 static int test_mapped_seq_read(const char *path)
 {
@@ -49,7 +58,11 @@ static int test_mapped_seq_read(const char *path)
 	if (fd == -1)
 		return 1;
 
-	ret = hexagonfs_mapped_ops.from_dirent(path, false, &file.data);
+	file.data = malloc(hexagonfs_mapped_ops.data_size);
+	if (file.data == NULL)
+		return 1;
+
+	ret = hexagonfs_mapped_ops.from_dirent(path, false, file.data);
 	if (ret)
 		return 1;
 
@@ -74,6 +87,7 @@ static int test_mapped_seq_read(const char *path)
 		return 1;
 
 	hexagonfs_mapped_ops.close(file.data);
+	free(file.data);
 
 	close(fd);
 
@@ -83,14 +97,1990 @@ static int test_mapped_seq_read(const char *path)
 	return 0;
 }
 
-int main(int argc, const char **argv)
+static int write_with_mtime(int fd, const char *contents, time_t mtime)
 {
-	int ret;
+	struct timespec times[2] = {
+		{ .tv_sec = mtime, },
+		{ .tv_sec = mtime, },
+	};
+	size_t len = strlen(contents);
 
-	if (argc < 2)
+	if (pwrite(fd, contents, len, 0) != (ssize_t) len)
 		return 1;
 
-	ret = test_mapped_seq_read(argv[1]);
+	if (ftruncate(fd, len))
+		return 1;
+
+	return futimens(fd, times);
+}
+
+static int read_contents(const char *path, size_t size, char *out)
+{
+	void *data;
+	struct hexagonfs_fd file = {
+		.is_assigned = true,
+		.up = NULL,
+		.ops = &hexagonfs_mapped_ops,
+	};
+	ssize_t ret;
+
+	data = malloc(hexagonfs_mapped_ops.data_size);
+	if (data == NULL)
+		return 1;
+
+	ret = hexagonfs_mapped_ops.from_dirent(path, false, data);
+	if (ret) {
+		free(data);
+		return 1;
+	}
+
+	file.data = data;
+
+	memset(out, 0, size);
+	ret = hexagonfs_mapped_ops.read(&file, size - 1, out);
+
+	hexagonfs_mapped_ops.close(data);
+	free(data);
+
+	return ret < 0;
+}
+
+static int test_mapped_cache(void)
+{
+	char path[] = "hexagonfs_cache_XXXXXX";
+	char buf[16];
+	int fd, ret = 1;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return 1;
+
+	if (write_with_mtime(fd, "first", 1000)
+	 || read_contents(path, sizeof(buf), buf)
+	 || strcmp(buf, "first"))
+		goto out;
+
+	// Same size and modification time, so the cached contents are used
+	if (write_with_mtime(fd, "FIRST", 1000)
+	 || read_contents(path, sizeof(buf), buf)
+	 || strcmp(buf, "first"))
+		goto out;
+
+	if (write_with_mtime(fd, "other", 2000)
+	 || read_contents(path, sizeof(buf), buf)
+	 || strcmp(buf, "other"))
+		goto out;
+
+	if (write_with_mtime(fd, "longer", 2000)
+	 || read_contents(path, sizeof(buf), buf)
+	 || strcmp(buf, "longer"))
+		goto out;
+
+	ret = 0;
+
+out:
+	close(fd);
+	unlink(path);
+
+	return ret;
+}
+
+/*
+ * Files without a known size, like those in procfs and sysfs, are not cached
+ * and are read directly.
+ */
+static int test_mapped_unsized_read(void)
+{
+	const char *path = "/proc/version";
+	char buf1[256], buf2[256];
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+
+	if (read(fd, buf1, sizeof(buf1)) <= 0)
+		return 1;
+
+	close(fd);
+
+	if (read_contents(path, sizeof(buf2), buf2))
+		return 1;
+
+	return strncmp(buf1, buf2, strlen(buf2)) || !strlen(buf2);
+}
+
+static int open_mapped(const char *path, struct hexagonfs_fd *file)
+{
+	file->is_assigned = true;
+	file->up = NULL;
+	file->ops = &hexagonfs_mapped_ops;
+
+	file->data = malloc(hexagonfs_mapped_ops.data_size);
+	if (file->data == NULL)
+		return 1;
+
+	if (hexagonfs_mapped_ops.from_dirent(path, false, file->data)) {
+		free(file->data);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void close_mapped(struct hexagonfs_fd *file)
+{
+	hexagonfs_mapped_ops.close(file->data);
+	free(file->data);
+}
+
+/*
+ * Large files are loaded in chunks, and more chunks than fit in the ring are
+ * read at once. Two readers of the same file take turns, so that the second
+ * one reads from the copy that the first one is loading.
+ */
+static int test_mapped_uring(void)
+{
+	char path[] = "hexagonfs_uring_XXXXXX";
+	struct hexagonfs_fd files[2];
+	size_t size = 1048576 + 777;
+	size_t off[2] = { 0, 0 };
+	char *expected, buf[40000];
+	ssize_t len;
+	size_t i;
+	int fd, ret = 1;
+
+	// Kernels without io_uring still read files directly
+	if (hexagonfs_uring_init(4))
+		return 0;
+
+	expected = malloc(size);
+	if (expected == NULL)
+		return 1;
+
+	for (i = 0; i < size; i++)
+		expected[i] = i * 7 + (i >> 12);
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		goto err_free;
+
+	if (write(fd, expected, size) != (ssize_t) size)
+		goto err_unlink;
+
+	if (open_mapped(path, &files[0]))
+		goto err_unlink;
+
+	if (open_mapped(path, &files[1]))
+		goto err_close_first;
+
+	for (i = 0; off[0] < size || off[1] < size; i = !i) {
+		len = hexagonfs_mapped_ops.read(&files[i],
+						i ? sizeof(buf) : sizeof(buf) / 3,
+						buf);
+		if (len < 0 || off[i] + len > size)
+			goto err_close;
+
+		if (memcmp(buf, &expected[off[i]], len))
+			goto err_close;
+
+		if (!len && off[i] < size)
+			goto err_close;
+
+		off[i] += len;
+	}
+
+	ret = 0;
+
+err_close:
+	close_mapped(&files[1]);
+err_close_first:
+	close_mapped(&files[0]);
+err_unlink:
+	close(fd);
+	unlink(path);
+err_free:
+	free(expected);
+
+	return ret;
+}
+
+/*
+ * Small reads of files that are not in memory are served from a buffer, and
+ * seeking relative to the current offset accounts for what was buffered.
+ */
+static int test_mapped_buffered_read(void)
+{
+	const char *path = "/proc/version";
+	struct hexagonfs_fd file;
+	char expected[256], buf[256];
+	ssize_t len, ret;
+	size_t off = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+
+	len = read(fd, expected, sizeof(expected));
+	close(fd);
+	if (len < 16)
+		return 1;
+
+	if (open_mapped(path, &file))
+		return 1;
+
+	while (off < 10) {
+		ret = hexagonfs_mapped_ops.read(&file, 1, &buf[off]);
+		if (ret != 1)
+			goto err;
+
+		off += ret;
+	}
+
+	if (hexagonfs_mapped_ops.seek(&file, -4, SEEK_CUR))
+		goto err;
+
+	off -= 4;
+
+	ret = hexagonfs_mapped_ops.read(&file, 3, &buf[off]);
+	if (ret != 3)
+		goto err;
+
+	off += ret;
+
+	ret = hexagonfs_mapped_ops.read(&file, sizeof(buf) - off, &buf[off]);
+	if (ret < 0)
+		goto err;
+
+	off += ret;
+
+	close_mapped(&file);
+
+	return off != (size_t) len || memcmp(buf, expected, len);
+
+err:
+	close_mapped(&file);
+	return 1;
+}
+
+/*
+ * Files that are not cached can be truncated in place while they are read,
+ * and then end early.
+ */
+static int test_mapped_truncate(void)
+{
+	char path[] = "hexagonfs_truncate_XXXXXX";
+	struct hexagonfs_fd file;
+	char buf[65536];
+	size_t total = 0;
+	ssize_t len;
+	int fd, ret = 1;
+
+	memset(buf, 'a', sizeof(buf));
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return 1;
+
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+		goto out;
+
+	if (open_mapped(path, &file))
+		goto out;
+
+	if (hexagonfs_mapped_ops.read(&file, 16, buf) != 16 || ftruncate(fd, 0))
+		goto out_close;
+
+	// Only what was already buffered can still be read
+	do {
+		len = hexagonfs_mapped_ops.read(&file, 16, buf);
+		total += len;
+	} while (len > 0);
+
+	ret = len || total >= sizeof(buf) - 16;
+
+out_close:
+	close_mapped(&file);
+out:
+	close(fd);
+	unlink(path);
+
+	return ret;
+}
+
+/*
+ * Files are added to the prefetch list once, by their virtual path, after the
+ * files that were already in it.
+ */
+static int test_prefetch_list(void)
+{
+	char path[] = "hexagonfs_prefetch_XXXXXX";
+	const char *expected = "/usr/lib/qcom/adsp/a.so\n"
+			       "/vendor/etc/acdbdata/b.acdb\n"
+			       "/usr/lib/qcom/adsp/a.so\n"
+			       "/usr/lib/qcom/adsp/c.so\n"
+			       "/d.so\n";
+	char buf[256];
+	ssize_t len;
+	int fd, ret = 1;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return 1;
+
+	if (write_with_mtime(fd, "/usr/lib/qcom/adsp/a.so\n"
+				 "/vendor/etc/acdbdata/b.acdb\n"
+				 "/usr/lib/qcom/adsp/a.so\n", 1000))
+		goto out;
+
+	if (hexagonfs_prefetch_open(path))
+		goto out;
+
+	hexagonfs_prefetch_record("/usr/lib/qcom/adsp/", "c.so");
+	hexagonfs_prefetch_record("/usr/lib/qcom/adsp/", "a.so");
+	hexagonfs_prefetch_record("/usr/lib/qcom/adsp/", "/d.so");
+	hexagonfs_prefetch_record("/vendor/etc/acdbdata/", "b.acdb");
+	hexagonfs_prefetch_record("/usr/lib/qcom/adsp/", "c.so");
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		goto out;
+
+	buf[len] = '\0';
+	ret = strcmp(buf, expected) != 0;
+
+out:
+	close(fd);
+	unlink(path);
+
+	return ret;
+}
+
+static int open_and_compare(struct hexagonfs_fd_table *fds, int rootfd,
+			    const char *path, const char *expected)
+{
+	char buf[32];
+	ssize_t len;
+	int fd;
+
+	fd = hexagonfs_openat(fds, rootfd, rootfd, path);
+	if (fd < 0)
+		return expected != NULL;
+
+	memset(buf, 0, sizeof(buf));
+	len = hexagonfs_read(fds, fd, sizeof(buf) - 1, buf);
+	hexagonfs_close(fds, fd);
+
+	return expected == NULL || len < 0 || strcmp(buf, expected);
+}
+
+/*
+ * Open files through a virtual directory twice, so that the second open uses
+ * the resolved path cache, and check that the same file is read.
+ */
+static int test_openat_cache(const char *path)
+{
+	struct hexagonfs_dirent mapped = {
+		.name = "dir",
+		.ops = &hexagonfs_mapped_ops,
+	};
+	struct hexagonfs_dirent *ents[] = { &mapped, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 1,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	char dir[256], file[300], expected[32];
+	const char *name;
+	const char *paths[] = {
+		"/dir/%s",
+		"dir//./%s",
+		"/dir/../dir/%s",
+		"./dir/%s",
+	};
+	const char *bad_paths[] = {
+		"/dir/%s/",
+		"/dir/missing_%s",
+		"/missing/%s",
+	};
+	size_t i, j;
+	int rootfd, fd, ret = 1;
+
+	name = strrchr(path, '/');
+	if (name == NULL) {
+		strcpy(dir, ".");
+		name = path;
+	} else {
+		snprintf(dir, sizeof(dir), "%.*s", (int) (name - path), path);
+		name++;
+	}
+
+	mapped.u.phys = dir;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+
+	memset(expected, 0, sizeof(expected));
+	if (read(fd, expected, sizeof(expected) - 1) <= 0)
+		return 1;
+
+	close(fd);
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		return 1;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < sizeof(paths) / sizeof(*paths); j++) {
+			snprintf(file, sizeof(file), paths[j], name);
+			if (open_and_compare(&fds, rootfd, file, expected))
+				goto out;
+		}
+
+		for (j = 0; j < sizeof(bad_paths) / sizeof(*bad_paths); j++) {
+			snprintf(file, sizeof(file), bad_paths[j], name);
+			if (open_and_compare(&fds, rootfd, file, NULL))
+				goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+
+	return ret;
+}
+
+/*
+ * Paths that resolve to the root are compared with the root itself, because
+ * opening them returns the file descriptor of the root.
+ */
+static int stat_and_compare(struct hexagonfs_fd_table *fds, int rootfd,
+			    const char *path, bool is_root)
+{
+	struct stat expected, stats;
+	int fd = rootfd, ret;
+
+	if (!is_root)
+		fd = hexagonfs_openat(fds, rootfd, rootfd, path);
+
+	if (fd >= 0) {
+		ret = hexagonfs_fstat(fds, fd, &expected);
+		if (!is_root)
+			hexagonfs_close(fds, fd);
+
+		if (ret)
+			return 1;
+	}
+
+	ret = hexagonfs_statat(fds, rootfd, rootfd, path, &stats);
+	if (fd < 0)
+		return ret != fd;
+
+	return ret
+	    || stats.st_mode != expected.st_mode
+	    || stats.st_size != expected.st_size
+	    || stats.st_mtim.tv_sec != expected.st_mtim.tv_sec
+	    || stats.st_mtim.tv_nsec != expected.st_mtim.tv_nsec;
+}
+
+/*
+ * Stat files in physical and virtual directories without opening them, and
+ * check that the results and errors are the same as with open and fstat.
+ */
+static int test_statat(const char *path)
+{
+	struct hexagonfs_dirent mapped = {
+		.name = "dir",
+		.ops = &hexagonfs_mapped_ops,
+	};
+	struct hexagonfs_dirent file = {
+		.name = "file",
+		.ops = &hexagonfs_mapped_ops,
+		.u.phys = path,
+	};
+	struct hexagonfs_dirent sysfs = {
+		.name = "sysfs",
+		.ops = &hexagonfs_mapped_sysfs_ops,
+		.u.phys = path,
+	};
+	struct hexagonfs_dirent empty = {
+		.name = "empty",
+		.ops = &hexagonfs_mapped_or_empty_ops,
+		.u.phys = "/nonexistent",
+	};
+	struct hexagonfs_virt_dir no_children = {
+		.n_ents = 0,
+	};
+	struct hexagonfs_dirent virt = {
+		.name = "virt",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &no_children,
+	};
+	struct hexagonfs_dirent *ents[] = { &mapped, &file, &sysfs, &empty, &virt, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 5,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	char dir[256], buf[300];
+	const char *name;
+	const char *paths[] = {
+		"/dir/%s",
+		"dir/./%s",
+		"/dir/%s/",
+		"/dir/missing_%s",
+		"/file",
+		"file/",
+		"sysfs",
+		"empty",
+		"empty/%s",
+		"virt",
+		"virt/",
+		"virt/missing",
+		"missing/%s",
+		"./dir/.",
+	};
+	const char *root_paths[] = {
+		"/",
+		".",
+		"dir/..",
+		"virt/../",
+	};
+	size_t i, j;
+	int rootfd, ret = 1;
+
+	name = strrchr(path, '/');
+	if (name == NULL) {
+		strcpy(dir, ".");
+		name = path;
+	} else {
+		snprintf(dir, sizeof(dir), "%.*s", (int) (name - path), path);
+		name++;
+	}
+
+	mapped.u.phys = dir;
+
+	if (hexagonfs_virt_dir_sort(&children))
+		return 1;
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		goto out;
+
+	// The second time, the files that were opened are in the path cache
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < sizeof(paths) / sizeof(*paths); j++) {
+			snprintf(buf, sizeof(buf), paths[j], name);
+			if (stat_and_compare(&fds, rootfd, buf, false))
+				goto out;
+		}
+
+		for (j = 0; j < sizeof(root_paths) / sizeof(*root_paths); j++) {
+			if (stat_and_compare(&fds, rootfd, root_paths[j], true))
+				goto out;
+		}
+	}
+
+	if (hexagonfs_fd_table_count(&fds) != 1)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+
+	return ret;
+}
+
+static int set_dir_mtime(const char *path, time_t mtime)
+{
+	struct timespec times[2] = {
+		{ .tv_sec = mtime, },
+		{ .tv_sec = mtime, },
+	};
+
+	return utimensat(AT_FDCWD, path, times, 0);
+}
+
+static int try_open(struct hexagonfs_fd_table *fds, int rootfd, const char *path)
+{
+	int fd;
+
+	fd = hexagonfs_openat(fds, rootfd, rootfd, path);
+	if (fd >= 0)
+		hexagonfs_close(fds, fd);
+
+	return fd;
+}
+
+/*
+ * Serve procfs files, which report a size of 0 like sysfs attributes report
+ * 4096, and check that they are read whole with their exact size, and that a
+ * missing directory is empty, even in the place of a file that was closed.
+ */
+static int test_mapped_sysfs(void)
+{
+	struct hexagonfs_dirent kernel = {
+		.name = "kernel",
+		.ops = &hexagonfs_mapped_sysfs_ops,
+		.u.phys = "/proc/sys/kernel",
+	};
+	struct hexagonfs_dirent ostype = {
+		.name = "ostype",
+		.ops = &hexagonfs_mapped_sysfs_ops,
+		.u.phys = "/proc/sys/kernel/ostype",
+	};
+	struct hexagonfs_dirent soc0 = {
+		.name = "soc0",
+		.ops = &hexagonfs_mapped_sysfs_ops,
+		.u.phys = "/nonexistent",
+	};
+	struct hexagonfs_dirent *ents[] = { &kernel, &ostype, &soc0, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 3,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	char expected[256], buf[256];
+	struct stat stats;
+	size_t len, i;
+	int rootfd, fd, ret = 1;
+
+	if (read_contents("/proc/sys/kernel/ostype", sizeof(expected), expected))
+		return 1;
+
+	len = strlen(expected);
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		goto out;
+
+	// The second time, the file is opened again from the path cache
+	for (i = 0; i < 2; i++) {
+		if (hexagonfs_statat(&fds, rootfd, rootfd, "kernel/ostype", &stats)
+		 || stats.st_size != (off_t) len)
+			goto out;
+
+		fd = hexagonfs_openat(&fds, rootfd, rootfd, "kernel/ostype");
+		if (fd < 0)
+			goto out;
+
+		if (hexagonfs_fstat(&fds, fd, &stats)
+		 || stats.st_size != (off_t) len
+		 || hexagonfs_read(&fds, fd, sizeof(buf), buf) != (ssize_t) len
+		 || memcmp(buf, expected, len)
+		 || hexagonfs_lseek(&fds, fd, -1, SEEK_END)
+		 || hexagonfs_read(&fds, fd, sizeof(buf), buf) != 1
+		 || buf[0] != expected[len - 1]) {
+			hexagonfs_close(&fds, fd);
+			goto out;
+		}
+
+		hexagonfs_close(&fds, fd);
+	}
+
+	fd = hexagonfs_openat(&fds, rootfd, rootfd, "ostype");
+	if (fd < 0)
+		goto out;
+
+	if (hexagonfs_read(&fds, fd, sizeof(buf), buf) != (ssize_t) len) {
+		hexagonfs_close(&fds, fd);
+		goto out;
+	}
+
+	hexagonfs_close(&fds, fd);
+
+	// The missing directory takes the place of the file that was closed
+	fd = hexagonfs_openat(&fds, rootfd, rootfd, "soc0");
+	if (fd < 0)
+		goto out;
+
+	if (hexagonfs_fstat(&fds, fd, &stats)
+	 || !S_ISDIR(stats.st_mode)
+	 || stats.st_size != 0) {
+		hexagonfs_close(&fds, fd);
+		goto out;
+	}
+
+	hexagonfs_close(&fds, fd);
+
+	if (hexagonfs_statat(&fds, rootfd, rootfd, "kernel", &stats)
+	 || !S_ISDIR(stats.st_mode)
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "soc0", &stats)
+	 || !S_ISDIR(stats.st_mode)
+	 || try_open(&fds, rootfd, "soc0/ostype") != -ENOENT
+	 || try_open(&fds, rootfd, "kernel/missing") != -ENOENT)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+
+	return ret;
+}
+
+/*
+ * Check that missing files are remembered while their directory is not
+ * modified, and found as soon as it is, even if its modification time is the
+ * same as before.
+ */
+static int test_openat_missing(void)
+{
+	char dir[] = "hexagonfs_missing_XXXXXX";
+	char file[64];
+	struct hexagonfs_dirent mapped = {
+		.name = "dir",
+		.ops = &hexagonfs_mapped_ops,
+		.u.phys = dir,
+	};
+	struct hexagonfs_dirent *ents[] = { &mapped, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 1,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	int rootfd, fd, ret = 1;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	snprintf(file, sizeof(file), "%s/file", dir);
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		goto out_rmdir;
+
+	if (set_dir_mtime(dir, 1000)
+	 || try_open(&fds, rootfd, "/dir/file") != -ENOENT)
+		goto out;
+
+	if (try_open(&fds, rootfd, "/dir/file") != -ENOENT)
+		goto out;
+
+	fd = open(file, O_WRONLY | O_CREAT, 0644);
+	if (fd == -1)
+		goto out;
+
+	close(fd);
+
+	if (set_dir_mtime(dir, 1000)
+	 || try_open(&fds, rootfd, "/dir/file") < 0)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+	unlink(file);
+out_rmdir:
+	rmdir(dir);
+
+	return ret;
+}
+
+/*
+ * Look up every child of a large virtual directory, whose children are not
+ * created in order.
+ */
+static int create_file(const char *dir, const char *name)
+{
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd == -1)
+		return 1;
+
+	close(fd);
+
+	return 0;
+}
+
+static void remove_file(const char *dir, const char *name)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	unlink(path);
+}
+
+static int list_and_compare(struct hexagonfs_fd_table *fds, int rootfd,
+			    const char *path, const char *const *expected)
+{
+	char name[255];
+	int fd, ret = 1;
+
+	fd = hexagonfs_openat(fds, rootfd, rootfd, path);
+	if (fd < 0)
+		return 1;
+
+	do {
+		if (hexagonfs_readdir(fds, fd, sizeof(name), name))
+			goto out;
+
+		if (*expected == NULL ? name[0] != '\0' : strcmp(name, *expected))
+			goto out;
+	} while (*expected++ != NULL);
+
+	ret = 0;
+
+out:
+	hexagonfs_close(fds, fd);
+
+	return ret;
+}
+
+static int write_file(const char *path, const char *contents)
+{
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return 1;
+
+	ret = write(fd, contents, strlen(contents)) != (ssize_t) strlen(contents);
+
+	close(fd);
+
+	return ret;
+}
+
+static int read_mapped(const char *path, off_t off, size_t size,
+		       const char *expected)
+{
+	struct hexagonfs_fd file;
+	char buf[64];
+	ssize_t len;
+	int ret;
+
+	if (open_mapped(path, &file))
+		return 1;
+
+	ret = off && hexagonfs_mapped_ops.seek(&file, off, SEEK_END);
+	if (!ret) {
+		len = hexagonfs_mapped_ops.read(&file, size, buf);
+		ret = len != (ssize_t) strlen(expected)
+		   || memcmp(buf, expected, len);
+	}
+
+	close_mapped(&file);
+
+	return ret;
+}
+
+/*
+ * Regular files are kept open after they are closed, and the next open of the
+ * same path starts from the beginning, unless the file was replaced.
+ */
+static int test_mapped_reuse(void)
+{
+	char dir[] = "hexagonfs_reuse_XXXXXX";
+	char file[64], tmp[64], link[64], sub[64], target[64];
+	int ret = 1;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	snprintf(file, sizeof(file), "%s/file", dir);
+	snprintf(tmp, sizeof(tmp), "%s/tmp", dir);
+	snprintf(link, sizeof(link), "%s/link", dir);
+	snprintf(sub, sizeof(sub), "%s/sub", dir);
+	snprintf(target, sizeof(target), "%s/sub/file", dir);
+
+	if (write_file(file, "abcdef"))
+		goto out;
+
+	if (read_mapped(file, 0, 4, "abcd")
+	 || read_mapped(file, 0, 64, "abcdef")
+	 || read_mapped(file, -2, 64, "ef"))
+		goto out;
+
+	if (write_file(tmp, "xyz")
+	 || rename(tmp, file)
+	 || read_mapped(file, 0, 64, "xyz"))
+		goto out;
+
+	if (unlink(file) || read_mapped(file, 0, 64, "") != 1)
+		goto out;
+
+	/*
+	 * The directory of a link does not change when its target is replaced
+	 * in another directory, so a link must be followed on every open.
+	 */
+	if (mkdir(sub, 0755)
+	 || write_file(target, "old")
+	 || symlink("sub/file", link)
+	 || read_mapped(link, 0, 64, "old"))
+		goto out;
+
+	snprintf(tmp, sizeof(tmp), "%s/sub/tmp", dir);
+
+	if (write_file(tmp, "NEW")
+	 || rename(tmp, target)
+	 || read_mapped(link, 0, 64, "NEW"))
+		goto out;
+
+	ret = 0;
+
+out:
+	unlink(link);
+	unlink(target);
+	rmdir(sub);
+	unlink(file);
+	rmdir(dir);
+
+	return ret;
+}
+
+/*
+ * The status of files in watched directories is kept in the path cache, and
+ * must follow changes to the file and replacements of the file and of its
+ * directory.
+ */
+static int test_statat_watch(void)
+{
+	char dir[] = "hexagonfs_watch_XXXXXX";
+	char sub[64], file[64], tmp[64], moved[64], link[64];
+	struct hexagonfs_dirent mapped = {
+		.name = "dir",
+		.ops = &hexagonfs_mapped_ops,
+		.u.phys = dir,
+	};
+	struct hexagonfs_dirent *ents[] = { &mapped, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 1,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	struct stat stats;
+	int rootfd, ret = 1;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	snprintf(sub, sizeof(sub), "%s/sub", dir);
+	snprintf(file, sizeof(file), "%s/sub/file", dir);
+	snprintf(tmp, sizeof(tmp), "%s/sub/tmp", dir);
+	snprintf(moved, sizeof(moved), "%s/moved", dir);
+	snprintf(link, sizeof(link), "%s/link", dir);
+
+	if (mkdir(sub, 0755) || write_file(file, "a"))
+		goto out_rmdir;
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		goto out;
+
+	// Open the file to add it to the path cache, then stat it twice
+	if (try_open(&fds, rootfd, "dir/sub/file") < 0
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "dir/sub/file", &stats)
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "dir/sub/file", &stats)
+	 || stats.st_size != 1)
+		goto out;
+
+	if (write_file(file, "ab")
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "dir/sub/file", &stats)
+	 || stats.st_size != 2)
+		goto out;
+
+	if (write_file(tmp, "abc")
+	 || rename(tmp, file)
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "dir/sub/file", &stats)
+	 || stats.st_size != 3)
+		goto out;
+
+	// Replace the directory, which only changes its parent
+	if (rename(sub, moved)
+	 || mkdir(sub, 0755)
+	 || write_file(file, "abcd")
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "dir/sub/file", &stats)
+	 || stats.st_size != 4)
+		goto out;
+
+	// Replacing the target of a link does not change the directory of the link
+	if (symlink("sub/file", link)
+	 || try_open(&fds, rootfd, "dir/link") < 0
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "dir/link", &stats)
+	 || stats.st_size != 4)
+		goto out;
+
+	if (write_file(tmp, "abcde")
+	 || rename(tmp, file)
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "dir/link", &stats)
+	 || stats.st_size != 5)
+		goto out;
+
+	if (unlink(file)
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "dir/sub/file", &stats) != -ENOENT)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+	unlink(link);
+	unlink(file);
+	rmdir(sub);
+	snprintf(file, sizeof(file), "%s/moved/file", dir);
+	unlink(file);
+	rmdir(moved);
+out_rmdir:
+	rmdir(dir);
+
+	return ret;
+}
+
+/*
+ * Physical directories are listed in sorted order from a snapshot, which is
+ * taken again when the directory changes.
+ */
+static int test_readdir_snapshot(void)
+{
+	char dir[] = "hexagonfs_readdir_XXXXXX";
+	struct hexagonfs_dirent mapped = {
+		.name = "dir",
+		.ops = &hexagonfs_mapped_ops,
+		.u.phys = dir,
+	};
+	struct hexagonfs_dirent *ents[] = { &mapped, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 1,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	const char *const before[] = { ".", "..", "a", "b", "c", NULL, };
+	const char *const after[] = { ".", "..", "a", "ab", "b", "c", NULL, };
+	const char *names[] = { "c", "a", "b", "ab", };
+	const struct hexagonfs_cache_entry *listing[2] = { NULL, NULL, };
+	struct hexagonfs_fd_table fds;
+	struct stat stats;
+	int rootfd, fd, ret = 1;
+	size_t i;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		goto out;
+
+	for (i = 0; i < 3; i++) {
+		if (create_file(dir, names[i]))
+			goto out;
+	}
+
+	// The second listing is served from the cached snapshot
+	if (set_dir_mtime(dir, 1000)
+	 || list_and_compare(&fds, rootfd, "dir", before)
+	 || list_and_compare(&fds, rootfd, "dir/", before))
+		goto out;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		goto out;
+
+	if (!fstat(fd, &stats)) {
+		hexagonfs_cache_get_dir(fd, &stats, NULL, &listing[0]);
+		hexagonfs_cache_get_dir(fd, &stats, NULL, &listing[1]);
+	}
+
+	close(fd);
+
+	if (listing[0] != NULL)
+		hexagonfs_cache_put(listing[0]);
+
+	if (listing[1] != NULL)
+		hexagonfs_cache_put(listing[1]);
+
+	if (listing[0] == NULL || listing[0] != listing[1])
+		goto out;
+
+	// The directory is watched, so the modification time does not matter
+	if (create_file(dir, names[3])
+	 || set_dir_mtime(dir, 1000)
+	 || list_and_compare(&fds, rootfd, "dir", after))
+		goto out;
+
+	if (list_and_compare(&fds, rootfd, "dir/a", before) == 0)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+
+	for (i = 0; i < 4; i++)
+		remove_file(dir, names[i]);
+
+	rmdir(dir);
+
+	return ret;
+}
+
+static int test_virt_dir_lookup(const char *path)
+{
+	struct hexagonfs_dirent files[200];
+	struct hexagonfs_dirent *ents[200];
+	char names[200][8];
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 200,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	size_t i;
+	int rootfd, ret = 1;
+
+	for (i = 0; i < 200; i++) {
+		snprintf(names[i], sizeof(names[i]), "f%zu", (i * 73) % 200);
+		files[i].name = names[i];
+		files[i].ops = &hexagonfs_mapped_ops;
+		files[i].u.phys = path;
+		ents[i] = &files[i];
+	}
+
+	if (hexagonfs_virt_dir_sort(&children))
+		return 1;
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		return 1;
+
+	for (i = 0; i < 200; i++) {
+		if (try_open(&fds, rootfd, names[i]) < 0)
+			goto out;
+	}
+
+	if (try_open(&fds, rootfd, "f200") != -ENOENT
+	 || try_open(&fds, rootfd, "f") != -ENOENT)
+		goto out;
+
+	// Names must be unique
+	files[1].name = files[0].name;
+	if (hexagonfs_virt_dir_sort(&children) != -EEXIST)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+
+	return ret;
+}
+
+/*
+ * Fill a small table past its initial size, check the limit, and check that
+ * closed file numbers are reused.
+ */
+static int test_fd_table(const char *path)
+{
+	struct hexagonfs_dirent file = {
+		.name = "file",
+		.ops = &hexagonfs_mapped_ops,
+		.u.phys = path,
+	};
+	struct hexagonfs_dirent *ents[] = { &file, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 1,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	int fileno[40];
+	int i, ret = 1;
+
+	if (hexagonfs_fd_table_init(&fds, 40))
+		return 1;
+
+	fileno[0] = hexagonfs_open_root(&fds, &root);
+	if (fileno[0] < 0)
+		goto out;
+
+	for (i = 1; i < 40; i++) {
+		fileno[i] = hexagonfs_openat(&fds, fileno[0], fileno[0], "file");
+		if (fileno[i] != i)
+			goto out;
+	}
+
+	if (hexagonfs_openat(&fds, fileno[0], fileno[0], "file") != -EMFILE
+	 || hexagonfs_fd_table_count(&fds) != 40)
+		goto out;
+
+	if (hexagonfs_close(&fds, 7) || hexagonfs_close(&fds, 31)
+	 || hexagonfs_close(&fds, 31) != -EBADF
+	 || hexagonfs_close(&fds, 40) != -EBADF
+	 || hexagonfs_fd_table_count(&fds) != 38)
+		goto out;
+
+	if (hexagonfs_openat(&fds, fileno[0], fileno[0], "file") != 31
+	 || hexagonfs_openat(&fds, fileno[0], fileno[0], "file") != 7
+	 || hexagonfs_fd_table_count(&fds) != 40)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+
+	return ret;
+}
+
+struct table_thread {
+	struct hexagonfs_fd_table *fds;
+	int rootfd;
+	const char *expected;
+	size_t size;
+	int ret;
+};
+
+static void *open_and_read(void *data)
+{
+	struct table_thread *t = data;
+	char buf[1024];
+	ssize_t len;
+	int i, fd;
+
+	t->ret = 1;
+
+	for (i = 0; i < 200; i++) {
+		fd = hexagonfs_openat(t->fds, t->rootfd, t->rootfd, "file");
+		if (fd < 0)
+			return NULL;
+
+		len = hexagonfs_read(t->fds, fd, sizeof(buf), buf);
+		hexagonfs_close(t->fds, fd);
+
+		if (len != (ssize_t) t->size || memcmp(buf, t->expected, len))
+			return NULL;
+	}
+
+	t->ret = 0;
+
+	return NULL;
+}
+
+/*
+ * Files of the same table can be opened, read and closed from several threads
+ * at the same time.
+ */
+static int test_fd_table_threads(const char *path)
+{
+	struct hexagonfs_dirent file = {
+		.name = "file",
+		.ops = &hexagonfs_mapped_ops,
+		.u.phys = path,
+	};
+	struct hexagonfs_dirent *ents[] = { &file, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 1,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	struct table_thread threads[4];
+	pthread_t ids[4];
+	char expected[1024];
+	ssize_t size;
+	int rootfd, fd, i, ret = 1;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+
+	size = read(fd, expected, sizeof(expected));
+	close(fd);
+	if (size <= 0)
+		return 1;
+
+	if (hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD))
+		return 1;
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		goto out;
+
+	for (i = 0; i < 4; i++) {
+		threads[i].fds = &fds;
+		threads[i].rootfd = rootfd;
+		threads[i].expected = expected;
+		threads[i].size = size;
+
+		if (pthread_create(&ids[i], NULL, open_and_read, &threads[i]))
+			break;
+	}
+
+	ret = i < 4;
+
+	while (i--) {
+		pthread_join(ids[i], NULL);
+		ret |= threads[i].ret;
+	}
+
+	ret |= hexagonfs_fd_table_count(&fds) != 1;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+
+	return ret;
+}
+
+/*
+ * File descriptors are allocated from one pool for each size of backend data,
+ * and freed ones are reused.
+ */
+static int test_fd_pool(void)
+{
+	struct hexagonfs_fd_table fds;
+	struct hexagonfs_fd *dir, *file, *reused;
+	int ret = 1;
+
+	if (hexagonfs_fd_table_init(&fds, 1))
+		return 1;
+
+	dir = hexagonfs_fd_alloc(&fds, NULL, &hexagonfs_virt_dir_ops);
+	if (dir == NULL)
+		goto out;
+
+	file = hexagonfs_fd_alloc(&fds, dir, &hexagonfs_mapped_ops);
+	if (file == NULL)
+		goto out;
+
+	if (file->up != dir || file->table != &fds
+	 || file->data == NULL || file->data == dir->data
+	 || file->pool == dir->pool)
+		goto out;
+
+	hexagonfs_fd_free(file);
+
+	reused = hexagonfs_fd_alloc(&fds, NULL, &hexagonfs_mapped_sysfs_ops);
+	if (reused != file || reused->up != NULL
+	 || reused->ops != &hexagonfs_mapped_sysfs_ops)
+		goto out;
+
+	hexagonfs_fd_free(reused);
+	hexagonfs_fd_free(dir);
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+
+	return ret;
+}
+
+struct test_image {
+	struct hexagonfs_image_header header;
+	struct hexagonfs_image_node nodes[4];
+	char names[8];
+	char data[16];
+};
+
+static int write_image(const char *path, bool sorted)
+{
+	struct test_image image = {
+		.header = {
+			.magic = HEXAGONFS_IMAGE_MAGIC,
+			.version = htole32(HEXAGONFS_IMAGE_VERSION),
+			.n_nodes = htole32(4),
+			.names_off = htole64(offsetof(struct test_image, names)),
+			.names_size = htole64(7),
+		},
+		.nodes = {
+			{ .name = htole32(0), .flags = htole32(HEXAGONFS_IMAGE_NODE_DIR),
+			  .first_child = htole32(1), .n_children = htole32(2), },
+			{ .name = htole32(1),
+			  .data_off = htole64(offsetof(struct test_image, data)),
+			  .size = htole64(5), .mtime_sec = htole64(1000), },
+			{ .name = htole32(3), .flags = htole32(HEXAGONFS_IMAGE_NODE_DIR),
+			  .first_child = htole32(3), .n_children = htole32(1), },
+			{ .name = htole32(5),
+			  .data_off = htole64(offsetof(struct test_image, data) + 8),
+			  .size = htole64(6), },
+		},
+		.names = "\0a\0d\0f",
+		.data = "hello\0\0\0world!",
+	};
+	int fd, ret;
+
+	if (!sorted) {
+		image.nodes[1].name = htole32(3);
+		image.nodes[2].name = htole32(1);
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return 1;
+
+	ret = write(fd, &image, sizeof(image)) != sizeof(image);
+
+	close(fd);
+
+	return ret;
+}
+
+static int read_and_compare(struct hexagonfs_fd_table *fds, int rootfd,
+			    const char *path, const char *expected)
+{
+	char buf[16];
+	ssize_t len;
+	int fd;
+
+	fd = hexagonfs_openat(fds, rootfd, rootfd, path);
+	if (fd < 0)
+		return 1;
+
+	len = hexagonfs_read(fds, fd, sizeof(buf), buf);
+
+	hexagonfs_close(fds, fd);
+
+	return len != (ssize_t) strlen(expected) || memcmp(buf, expected, len);
+}
+
+/*
+ * Serve a small hand-written image, and check that malformed images are
+ * rejected.
+ */
+static int test_image(void)
+{
+	const char *path = "hexagonfs_test.img";
+	const char *const listing[] = { ".", "..", "a", "d", NULL, };
+	struct hexagonfs_image_file *image_file = NULL;
+	struct hexagonfs_image *image;
+	struct hexagonfs_dirent file = {
+		.name = "img",
+		.ops = &hexagonfs_image_ops,
+	};
+	struct hexagonfs_dirent *ents[] = { &file, };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 1,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	struct stat stats;
+	int rootfd, ret = 1;
+
+	if (write_image(path, false))
+		goto out_remove;
+
+	if (hexagonfs_image_open(path, &image) != -EINVAL)
+		goto out_remove;
+
+	if (write_image(path, true)
+	 || hexagonfs_image_open(path, &image))
+		goto out_remove;
+
+	if (hexagonfs_image_lookup(image, "", &image_file)
+	 || !image_file->exists)
+		goto out_close_image;
+
+	file.u.ptr = image_file;
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		goto out;
+
+	if (read_and_compare(&fds, rootfd, "img/a", "hello")
+	 || read_and_compare(&fds, rootfd, "img/d/f", "world!")
+	 || read_and_compare(&fds, rootfd, "img/d/../a", "hello")
+	 || list_and_compare(&fds, rootfd, "img", listing))
+		goto out;
+
+	if (hexagonfs_statat(&fds, rootfd, rootfd, "img/a", &stats)
+	 || !S_ISREG(stats.st_mode)
+	 || stats.st_size != 5
+	 || stats.st_mtim.tv_sec != 1000)
+		goto out;
+
+	if (hexagonfs_statat(&fds, rootfd, rootfd, "img/d", &stats)
+	 || !S_ISDIR(stats.st_mode))
+		goto out;
+
+	if (try_open(&fds, rootfd, "img/b") != -ENOENT
+	 || try_open(&fds, rootfd, "img/a/b") != -ENOTDIR)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+out_close_image:
+	free(image_file);
+	hexagonfs_image_close(image);
+out_remove:
+	unlink(path);
+
+	return ret;
+}
+
+static int generate_calls;
+
+static int generate_greeting(const void *arg, char **data, size_t *size)
+{
+	generate_calls++;
+
+	if (arg == NULL)
+		return -EAGAIN;
+
+	*data = strdup(arg);
+	if (*data == NULL)
+		return -ENOMEM;
+
+	*size = strlen(arg);
+
+	return 0;
+}
+
+/*
+ * Serve generated files, and check that the contents are only generated once,
+ * that they have their real size, and that failures are not remembered.
+ */
+static int test_synthetic(const char *path)
+{
+	struct hexagonfs_synthetic_file greeting = {
+		.generate = generate_greeting,
+		.arg = "hello",
+	};
+	struct hexagonfs_synthetic_file failing = {
+		.generate = generate_greeting,
+	};
+	struct hexagonfs_dirent present_source = {
+		.name = "present",
+		.ops = &hexagonfs_mapped_ops,
+		.u.phys = path,
+	};
+	struct hexagonfs_dirent missing_source = {
+		.name = "missing",
+		.ops = &hexagonfs_mapped_ops,
+		.u.phys = "/nonexistent/platform_subtype_id",
+	};
+	struct hexagonfs_synthetic_file present = {
+		.generate = hexagonfs_plat_subtype_name_generate,
+		.arg = &present_source,
+	};
+	struct hexagonfs_synthetic_file missing = {
+		.generate = hexagonfs_plat_subtype_name_generate,
+		.arg = &missing_source,
+	};
+	struct hexagonfs_dirent files[] = {
+		{ .name = "failing", .ops = &hexagonfs_synthetic_ops, .u.ptr = &failing, },
+		{ .name = "greeting", .ops = &hexagonfs_synthetic_ops, .u.ptr = &greeting, },
+		{ .name = "missing", .ops = &hexagonfs_synthetic_ops, .u.ptr = &missing, },
+		{ .name = "present", .ops = &hexagonfs_synthetic_ops, .u.ptr = &present, },
+	};
+	struct hexagonfs_dirent *ents[] = { &files[0], &files[1], &files[2], &files[3], };
+	struct hexagonfs_virt_dir children = {
+		.n_ents = 4,
+		.ents = ents,
+	};
+	struct hexagonfs_dirent root = {
+		.name = "/",
+		.ops = &hexagonfs_virt_dir_ops,
+		.u.dir = &children,
+	};
+	struct hexagonfs_fd_table fds;
+	struct stat stats;
+	char buf[16];
+	int rootfd, fd, ret = 1;
+
+	hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD);
+
+	rootfd = hexagonfs_open_root(&fds, &root);
+	if (rootfd < 0)
+		goto out;
+
+	if (hexagonfs_statat(&fds, rootfd, rootfd, "greeting", &stats)
+	 || stats.st_size != 5
+	 || read_and_compare(&fds, rootfd, "greeting", "hello")
+	 || read_and_compare(&fds, rootfd, "greeting", "hello")
+	 || generate_calls != 1)
+		goto out;
+
+	fd = hexagonfs_openat(&fds, rootfd, rootfd, "greeting");
+	if (fd < 0)
+		goto out;
+
+	if (hexagonfs_lseek(&fds, fd, -2, SEEK_END)
+	 || hexagonfs_read(&fds, fd, sizeof(buf), buf) != 2
+	 || memcmp(buf, "lo", 2)
+	 || hexagonfs_read(&fds, fd, sizeof(buf), buf) != 0
+	 || hexagonfs_lseek(&fds, fd, -6, SEEK_END) != -EINVAL
+	 || hexagonfs_fstat(&fds, fd, &stats)
+	 || stats.st_size != 5) {
+		hexagonfs_close(&fds, fd);
+		goto out;
+	}
+
+	hexagonfs_close(&fds, fd);
+
+	if (try_open(&fds, rootfd, "failing") != -EAGAIN
+	 || try_open(&fds, rootfd, "failing") != -EAGAIN
+	 || generate_calls != 3)
+		goto out;
+
+	if (try_open(&fds, rootfd, "missing") != -ENOENT
+	 || hexagonfs_statat(&fds, rootfd, rootfd, "present", &stats)
+	 || stats.st_size != 0
+	 || read_and_compare(&fds, rootfd, "present", ""))
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+	free(greeting.data);
+
+	return ret;
+}
+
+/*
+ * Serve a tree from a layout, and check that invalid layouts are rejected.
+ */
+static int test_layout(void)
+{
+	static const char *const invalid[] = {
+		"/a map x\n/a/b map y\n",
+		"/a/b map x\n/a map y\n",
+		"/a map x\n/a map_or_empty y\n",
+		"/a map x\n/l link /l\n",
+		"/d/f map x\n/d/l link /d\n",
+		"/a map x\n/l link /missing\n",
+		"/a map x\n/a/b/c synthetic plat_subtype_name\n",
+		"/a/b synthetic plat_subtype_name\n/a link /l\n",
+		"/a synthetic plat_subtype_name\n/a/b synthetic plat_subtype_name\n",
+		"/a synthetic missing\n",
+		"/a copy x\n",
+		"/a map\n",
+		"a map x\n",
+		"/ map x\n",
+	};
+	const char *layout =
+		"# Comment\n"
+		"/dir/file	map		%s	# Another\n"
+		"\n"
+		"/dir/empty	map_or_empty	missing\n"
+		"/dir/soc0	sysfs		missing\n"
+		"/dir/cwd/platform_subtype_name	synthetic	plat_subtype_name\n"
+		"/dir/cwd	map		.\n"
+		"/link		link		/dir\n";
+	struct hexagonfs_dirent *root = NULL;
+	struct hexagonfs_fd_table fds;
+	char file[] = "hexagonfs_layout_XXXXXX";
+	char text[256], path[64];
+	const char *prefixes[] = { ".", };
+	struct stat stats;
+	size_t i;
+	int fd, rootfd, ret = 1;
+
+	fd = mkstemp(file);
+	if (fd == -1)
+		return 1;
+
+	if (write_with_mtime(fd, "layout", 1000))
+		goto out_unlink;
+
+	snprintf(text, sizeof(text), layout, file);
+
+	root = construct_root_dir(text, prefixes, 1, "", NULL);
+	if (root == NULL)
+		goto out_unlink;
+
+	if (hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD))
+		goto out_unlink;
+
+	rootfd = hexagonfs_open_root(&fds, root);
+	if (rootfd < 0)
+		goto out;
+
+	if (read_and_compare(&fds, rootfd, "/dir/file", "layout")
+	 || read_and_compare(&fds, rootfd, "/link/file", "layout")
+	 || try_open(&fds, rootfd, "/link/empty/") < 0
+	 || try_open(&fds, rootfd, "/link/soc0/") < 0
+	 || try_open(&fds, rootfd, "/dir/missing") != -ENOENT)
+		goto out;
+
+	// Generated files are added to mapped directories
+	snprintf(path, sizeof(path), "/dir/cwd/%s", file);
+	if (read_and_compare(&fds, rootfd, path, "layout")
+	 || hexagonfs_statat(&fds, rootfd, rootfd, path, &stats)
+	 || stats.st_size != 6
+	 || try_open(&fds, rootfd, "/dir/cwd/platform_subtype_name") != -ENOENT)
+		goto out;
+
+	// Children are laid out in order, right after their parent
+	if (root->u.dir->n_ents != 2
+	 || root->u.dir->ents[0] != &root[1] || strcmp(root[1].name, "dir")
+	 || root->u.dir->ents[1] != &root[2] || strcmp(root[2].name, "link"))
+		goto out;
+
+	for (i = 0; i < sizeof(invalid) / sizeof(*invalid); i++) {
+		if (construct_root_dir(invalid[i], prefixes, 1, "", NULL) != NULL)
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+out_unlink:
+	free(root);
+	close(fd);
+	unlink(file);
+
+	return ret;
+}
+
+/*
+ * Files in the first layer hide those in the second, and directories that
+ * exist in both are merged.
+ */
+static int test_layers(void)
+{
+	static const struct {
+		const char *path;
+		const char *contents;
+	} tree[] = {
+		{ "top", NULL },
+		{ "top/dsp", NULL },
+		{ "top/dsp/adsp", NULL },
+		{ "top/dsp/adsp/a.so", "top" },
+		{ "top/dsp/adsp/sub", NULL },
+		{ "top/dsp/adsp/sub/d.so", "d" },
+		{ "bottom", NULL },
+		{ "bottom/acdb", NULL },
+		{ "bottom/acdb/c.acdb", "c" },
+		{ "bottom/dsp", NULL },
+		{ "bottom/dsp/adsp", NULL },
+		{ "bottom/dsp/adsp/a.so", "bottom" },
+		{ "bottom/dsp/adsp/b.so", "b" },
+		{ "bottom/dsp/adsp/sub", "hidden" },
+	};
+	char dir[] = "hexagonfs_layers_XXXXXX";
+	char top[64], bottom[64], path[128];
+	const char *layers[] = { top, bottom, };
+	struct hexagonfs_dirent *root;
+	struct hexagonfs_fd_table fds;
+	size_t i, n_made;
+	int rootfd, ret = 1;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	for (n_made = 0; n_made < sizeof(tree) / sizeof(*tree); n_made++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, tree[n_made].path);
+
+		if (tree[n_made].contents == NULL ? mkdir(path, 0755)
+						  : write_file(path, tree[n_made].contents))
+			goto out_remove;
+	}
+
+	snprintf(top, sizeof(top), "%s/top", dir);
+	snprintf(bottom, sizeof(bottom), "%s/bottom", dir);
+
+	root = construct_root_dir(rpcd_default_layout, layers, 2, "adsp", NULL);
+	if (root == NULL)
+		goto out_remove;
+
+	if (hexagonfs_fd_table_init(&fds, HEXAGONFS_DEFAULT_MAX_FD))
+		goto out_remove;
+
+	rootfd = hexagonfs_open_root(&fds, root);
+	if (rootfd < 0)
+		goto out;
+
+	if (read_and_compare(&fds, rootfd, "/usr/lib/qcom/adsp/a.so", "top")
+	 || read_and_compare(&fds, rootfd, "/usr/lib/qcom/adsp/b.so", "b")
+	 || read_and_compare(&fds, rootfd, "/usr/lib/qcom/adsp/sub/d.so", "d")
+	 || read_and_compare(&fds, rootfd, "/vendor/etc/acdbdata/c.acdb", "c")
+	 || try_open(&fds, rootfd, "/usr/lib/qcom/adsp/missing.so") != -ENOENT)
+		goto out;
+
+	ret = 0;
+
+out:
+	hexagonfs_fd_table_deinit(&fds);
+out_remove:
+	for (i = n_made; i > 0; i--) {
+		snprintf(path, sizeof(path), "%s/%s", dir, tree[i - 1].path);
+
+		if (tree[i - 1].contents == NULL)
+			rmdir(path);
+		else
+			unlink(path);
+	}
+
+	rmdir(dir);
+
+	return ret;
+}
+
+int main(int argc, const char **argv)
+{
+	int ret;
+
+	if (argc < 2)
+		return 1;
+
+	ret = test_mapped_seq_read(argv[1]);
+	if (ret)
+		return ret;
+
+	ret = test_mapped_cache();
+	if (ret)
+		return ret;
+
+	ret = test_mapped_unsized_read();
+	if (ret)
+		return ret;
+
+	ret = test_openat_cache(argv[1]);
+	if (ret)
+		return ret;
+
+	ret = test_openat_missing();
+	if (ret)
+		return ret;
+
+	ret = test_statat(argv[1]);
+	if (ret)
+		return ret;
+
+	ret = test_statat_watch();
+	if (ret)
+		return ret;
+
+	ret = test_mapped_sysfs();
+	if (ret)
+		return ret;
+
+	ret = test_readdir_snapshot();
+	if (ret)
+		return ret;
+
+	ret = test_virt_dir_lookup(argv[1]);
+	if (ret)
+		return ret;
+
+	ret = test_fd_table(argv[1]);
+	if (ret)
+		return ret;
+
+	ret = test_fd_table_threads(argv[1]);
+	if (ret)
+		return ret;
+
+	ret = test_fd_pool();
+	if (ret)
+		return ret;
+
+	ret = test_image();
+	if (ret)
+		return ret;
+
+	ret = test_synthetic(argv[1]);
+	if (ret)
+		return ret;
+
+	ret = test_layout();
+	if (ret)
+		return ret;
+
+	ret = test_layers();
+	if (ret)
+		return ret;
+
+	ret = test_mapped_uring();
+	if (ret)
+		return ret;
+
+	ret = test_mapped_buffered_read();
+	if (ret)
+		return ret;
+
+	ret = test_mapped_reuse();
+	if (ret)
+		return ret;
+
+	ret = test_prefetch_list();
+	if (ret)
+		return ret;
+
+	// Without the cache, regular files are read directly
+	hexagonfs_cache_set_budget(0);
+
+	ret = test_mapped_seq_read(argv[1]);
+	if (ret)
+		return ret;
+
+	ret = test_mapped_truncate();
 	if (ret)
 		return ret;
 
@@ -20,6 +20,8 @@
  */
 
 #include <libhexagonrpc/fastrpc.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../hexagonrpcd/iobuffer.h"
@@ -181,6 +183,98 @@ static int test_in_misaligned(void)
 	return 0;
 }
 
+static const uint32_t decode_shape_sizes[] = {
+	1, 3, 8, 13, 4, 255, 2, 16, 1024, 7, 5, 6, 9, 4096, 1,
+};
+
+/*
+ * Decode the same encoded stream in one go (which goes through the bulk path)
+ * and in chunks of the given size (which ends up in the state machine), and
+ * verify that both produce the original buffers.
+ */
+static int decode_in_chunks(size_t n, const struct fastrpc_io_buffer *orig,
+			    size_t len, const char *enc, size_t chunk)
+{
+	struct fastrpc_decoder_context *ctx;
+	struct fastrpc_io_buffer *bufs;
+	size_t off, seg;
+	size_t i;
+	int ret;
+
+	ctx = inbuf_decode_start(REMOTE_SCALARS_MAKE(1, n, 0));
+	if (ctx == NULL)
+		return 1;
+
+	for (off = 0; off < len; off += seg) {
+		seg = len - off < chunk ? len - off : chunk;
+
+		ret = inbuf_decode(ctx, seg, &enc[off]);
+		if (ret)
+			return 1;
+	}
+
+	if (!inbuf_decode_is_complete(ctx))
+		return 1;
+
+	bufs = inbuf_decode_finish(ctx);
+
+	for (i = 0; i < n; i++) {
+		if (bufs[i].s != orig[i].s)
+			return 1;
+
+		ret = memcmp(bufs[i].p, orig[i].p, orig[i].s);
+		if (ret)
+			return 1;
+	}
+
+	iobuf_free(n, bufs);
+
+	return 0;
+}
+
+static int test_in_bulk_matches_stream(void)
+{
+	const size_t n = sizeof(decode_shape_sizes) / sizeof(*decode_shape_sizes);
+	static const size_t chunks[] = { 1, 3, 4, 7, 8, 61, 4099, SIZE_MAX };
+	struct fastrpc_io_buffer bufs[sizeof(decode_shape_sizes) / sizeof(*decode_shape_sizes)];
+	size_t len, i, j;
+	char *enc;
+	int ret = 0;
+
+	for (i = 0; i < n; i++) {
+		bufs[i].s = decode_shape_sizes[i];
+		bufs[i].p = malloc(bufs[i].s);
+		if (bufs[i].p == NULL)
+			return 1;
+
+		for (j = 0; j < bufs[i].s; j++)
+			((unsigned char *) bufs[i].p)[j] = i * 31 + j;
+	}
+
+	len = outbufs_calculate_size(n, bufs);
+	enc = malloc(len);
+	if (enc == NULL)
+		return 1;
+
+	outbufs_encode(n, bufs, enc);
+
+	for (i = 0; i < sizeof(chunks) / sizeof(*chunks) && !ret; i++)
+		ret = decode_in_chunks(n, bufs, len, enc, chunks[i]);
+
+	// Shorter messages end at every possible alignment
+	for (i = 1; i < n && !ret; i++) {
+		len = outbufs_calculate_size(i, bufs);
+		ret = decode_in_chunks(i, bufs, len, enc, SIZE_MAX);
+	}
+
+	free(enc);
+
+	for (i = 0; i < n; i++)
+		free(bufs[i].p);
+
+	return ret;
+}
+
 static int test_out_empty(void)
 {
 	size_t size;
@@ -235,6 +329,10 @@ int main(int argc, const char **argv)
 	if (ret)
 		return ret;
 
+	ret = test_in_bulk_matches_stream();
+	if (ret)
+		return ret;
+
 	ret = test_out_empty();
 	if (ret)
 		return ret;
@@ -0,0 +1,520 @@
+/*
+ * HexagonFS Image Generator
+ *
+ * Copyright (C) 2026 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Typical usage with the directory that would be passed to hexagonrpcd -R:
+ *
+ * mkhexagonfs /usr/share/qcom/sdm845/Thundercomm/db845c db845c.img
+ */
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../hexagonrpcd/hexagonfs_image.h"
+
+struct build_node {
+	struct hexagonfs_image_node disk;
+	char *path;
+	size_t parent;
+	dev_t dev;
+	ino_t ino;
+};
+
+struct image_builder {
+	struct build_node *nodes;
+	size_t n_nodes;
+	size_t max_nodes;
+
+	char *names;
+	size_t names_size;
+	size_t max_names;
+};
+
+static int add_name(struct image_builder *b, const char *name, uint32_t *off)
+{
+	size_t len = strlen(name) + 1;
+	char *names;
+
+	if (b->names_size + len > UINT32_MAX) {
+		fprintf(stderr, "Too many names\n");
+		return -1;
+	}
+
+	if (b->names_size + len > b->max_names) {
+		b->max_names = b->max_names * 2 + len;
+
+		names = realloc(b->names, b->max_names);
+		if (names == NULL) {
+			perror("Could not allocate names");
+			return -1;
+		}
+
+		b->names = names;
+	}
+
+	memcpy(&b->names[b->names_size], name, len);
+	*off = b->names_size;
+	b->names_size += len;
+
+	return 0;
+}
+
+static int add_node(struct image_builder *b, size_t parent,
+		    const char *name, char *path, const struct stat *stats)
+{
+	struct build_node *nodes, *node;
+	int ret;
+
+	if (b->n_nodes >= UINT32_MAX) {
+		fprintf(stderr, "Too many files\n");
+		return -1;
+	}
+
+	if (b->n_nodes >= b->max_nodes) {
+		b->max_nodes = b->max_nodes * 2 + 16;
+
+		nodes = realloc(b->nodes, sizeof(*nodes) * b->max_nodes);
+		if (nodes == NULL) {
+			perror("Could not allocate nodes");
+			return -1;
+		}
+
+		b->nodes = nodes;
+	}
+
+	node = &b->nodes[b->n_nodes];
+	memset(node, 0, sizeof(*node));
+
+	ret = add_name(b, name, &node->disk.name);
+	if (ret)
+		return ret;
+
+	node->disk.flags = S_ISDIR(stats->st_mode) ? HEXAGONFS_IMAGE_NODE_DIR : 0;
+	node->disk.size = S_ISDIR(stats->st_mode) ? 0 : stats->st_size;
+	node->disk.mtime_sec = stats->st_mtim.tv_sec;
+	node->disk.mtime_nsec = stats->st_mtim.tv_nsec;
+	node->path = path;
+	node->parent = parent;
+	node->dev = stats->st_dev;
+	node->ino = stats->st_ino;
+
+	b->n_nodes++;
+
+	return 0;
+}
+
+/*
+ * Symbolic links are followed, so a link to a parent directory would make the
+ * tree infinite.
+ */
+static int is_loop(const struct image_builder *b, size_t idx,
+		   const struct stat *stats)
+{
+	while (idx != SIZE_MAX) {
+		if (b->nodes[idx].dev == stats->st_dev
+		 && b->nodes[idx].ino == stats->st_ino)
+			return 1;
+
+		idx = b->nodes[idx].parent;
+	}
+
+	return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	const char *const *name_a = a;
+	const char *const *name_b = b;
+
+	return strcmp(*name_a, *name_b);
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	char *path;
+
+	path = malloc(strlen(dir) + strlen(name) + 2);
+	if (path == NULL)
+		return NULL;
+
+	strcpy(path, dir);
+	strcat(path, "/");
+	strcat(path, name);
+
+	return path;
+}
+
+/*
+ * Read the sorted names in a directory, excluding "." and "..".
+ */
+static int list_dir(const char *path, char ***out, size_t *n_out)
+{
+	struct dirent *dirent;
+	char **names = NULL, **tmp;
+	size_t n_names = 0, max_names = 0;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+			continue;
+
+		if (n_names >= max_names) {
+			max_names = max_names * 2 + 16;
+
+			tmp = realloc(names, sizeof(*names) * max_names);
+			if (tmp == NULL)
+				goto err;
+
+			names = tmp;
+		}
+
+		names[n_names] = strdup(dirent->d_name);
+		if (names[n_names] == NULL)
+			goto err;
+
+		n_names++;
+	}
+
+	closedir(dir);
+
+	if (n_names)
+		qsort(names, n_names, sizeof(*names), compare_names);
+
+	*out = names;
+	*n_out = n_names;
+
+	return 0;
+
+err:
+	perror("Could not list directory");
+	while (n_names--)
+		free(names[n_names]);
+	free(names);
+	closedir(dir);
+	return -1;
+}
+
+/*
+ * Add the children of a directory node at the end of the node table. Since
+ * directories are expanded in the order of the table, the children of every
+ * directory are consecutive and come after their parent.
+ */
+static int expand_dir(struct image_builder *b, size_t idx)
+{
+	struct stat stats;
+	char **names;
+	char *path;
+	size_t n_names, i;
+	int ret;
+
+	ret = list_dir(b->nodes[idx].path, &names, &n_names);
+	if (ret)
+		return ret;
+
+	b->nodes[idx].disk.first_child = b->n_nodes;
+
+	for (i = 0; i < n_names; i++) {
+		path = join_path(b->nodes[idx].path, names[i]);
+		if (path == NULL) {
+			perror("Could not allocate path");
+			ret = -1;
+			break;
+		}
+
+		if (stat(path, &stats)) {
+			fprintf(stderr, "Could not stat %s: %s\n",
+					path, strerror(errno));
+			free(path);
+			ret = -1;
+			break;
+		}
+
+		if (!S_ISDIR(stats.st_mode) && !S_ISREG(stats.st_mode)) {
+			fprintf(stderr, "Skipping %s: not a file or directory\n", path);
+			free(path);
+			continue;
+		}
+
+		if (S_ISDIR(stats.st_mode) && is_loop(b, idx, &stats)) {
+			fprintf(stderr, "Skipping %s: directory loop\n", path);
+			free(path);
+			continue;
+		}
+
+		ret = add_node(b, idx, names[i], path, &stats);
+		if (ret) {
+			free(path);
+			break;
+		}
+
+		b->nodes[idx].disk.n_children++;
+	}
+
+	for (i = 0; i < n_names; i++)
+		free(names[i]);
+	free(names);
+
+	return ret;
+}
+
+static uint64_t align_up(uint64_t off)
+{
+	return (off + HEXAGONFS_IMAGE_ALIGN - 1) & ~(uint64_t) (HEXAGONFS_IMAGE_ALIGN - 1);
+}
+
+static int write_padding(FILE *out, uint64_t *off)
+{
+	static const char zeros[HEXAGONFS_IMAGE_ALIGN];
+	uint64_t len = align_up(*off) - *off;
+
+	if (fwrite(zeros, 1, len, out) != len)
+		return -1;
+
+	*off += len;
+
+	return 0;
+}
+
+static int copy_file(FILE *out, const struct build_node *node)
+{
+	char buf[65536];
+	uint64_t left = node->disk.size;
+	size_t len;
+	FILE *in;
+
+	in = fopen(node->path, "rb");
+	if (in == NULL) {
+		fprintf(stderr, "Could not open %s: %s\n",
+				node->path, strerror(errno));
+		return -1;
+	}
+
+	while (left) {
+		len = left < sizeof(buf) ? left : sizeof(buf);
+
+		if (fread(buf, 1, len, in) != len) {
+			fprintf(stderr, "%s changed while reading it\n", node->path);
+			goto err;
+		}
+
+		if (fwrite(buf, 1, len, out) != len) {
+			perror("Could not write image");
+			goto err;
+		}
+
+		left -= len;
+	}
+
+	fclose(in);
+
+	return 0;
+
+err:
+	fclose(in);
+	return -1;
+}
+
+/*
+ * Nodes are built in host byte order, and converted when they are written.
+ */
+static void node_to_le(struct hexagonfs_image_node *le,
+		       const struct hexagonfs_image_node *node)
+{
+	le->name = htole32(node->name);
+	le->flags = htole32(node->flags);
+	le->first_child = htole32(node->first_child);
+	le->n_children = htole32(node->n_children);
+	le->data_off = htole64(node->data_off);
+	le->size = htole64(node->size);
+	le->mtime_sec = htole64((uint64_t) node->mtime_sec);
+	le->mtime_nsec = htole64((uint64_t) node->mtime_nsec);
+}
+
+static int write_image(FILE *out, struct image_builder *b)
+{
+	struct hexagonfs_image_header header, le_header;
+	struct hexagonfs_image_node le_node;
+	uint64_t off;
+	size_t i;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HEXAGONFS_IMAGE_MAGIC, sizeof(header.magic));
+	header.version = HEXAGONFS_IMAGE_VERSION;
+	header.n_nodes = b->n_nodes;
+	header.names_off = sizeof(header)
+			 + sizeof(struct hexagonfs_image_node) * b->n_nodes;
+	header.names_size = b->names_size;
+
+	off = align_up(header.names_off + header.names_size);
+	for (i = 0; i < b->n_nodes; i++) {
+		if (b->nodes[i].disk.flags & HEXAGONFS_IMAGE_NODE_DIR)
+			continue;
+
+		b->nodes[i].disk.data_off = off;
+		off = align_up(off + b->nodes[i].disk.size);
+	}
+
+	le_header = header;
+	le_header.version = htole32(header.version);
+	le_header.n_nodes = htole32(header.n_nodes);
+	le_header.names_off = htole64(header.names_off);
+	le_header.names_size = htole64(header.names_size);
+
+	if (fwrite(&le_header, sizeof(le_header), 1, out) != 1)
+		goto err;
+
+	for (i = 0; i < b->n_nodes; i++) {
+		node_to_le(&le_node, &b->nodes[i].disk);
+
+		if (fwrite(&le_node, sizeof(le_node), 1, out) != 1)
+			goto err;
+	}
+
+	if (fwrite(b->names, 1, b->names_size, out) != b->names_size)
+		goto err;
+
+	off = header.names_off + header.names_size;
+
+	for (i = 0; i < b->n_nodes; i++) {
+		if (b->nodes[i].disk.flags & HEXAGONFS_IMAGE_NODE_DIR)
+			continue;
+
+		if (write_padding(out, &off))
+			goto err;
+
+		if (copy_file(out, &b->nodes[i]))
+			return -1;
+
+		off += b->nodes[i].disk.size;
+	}
+
+	return 0;
+
+err:
+	perror("Could not write image");
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct image_builder b = {0};
+	struct stat stats;
+	char *root, *tmp_path;
+	FILE *out;
+	size_t i;
+	int ret;
+
+	if (argc < 3) {
+		printf("Usage: %s DIR IMAGE\n", argv[0]);
+		return 1;
+	}
+
+	if (stat(argv[1], &stats)) {
+		fprintf(stderr, "Could not stat %s: %s\n",
+				argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (!S_ISDIR(stats.st_mode)) {
+		fprintf(stderr, "%s is not a directory\n", argv[1]);
+		return 1;
+	}
+
+	root = strdup(argv[1]);
+	if (root == NULL) {
+		perror("Could not allocate path");
+		return 1;
+	}
+
+	ret = add_node(&b, SIZE_MAX, "", root, &stats);
+	if (ret) {
+		free(root);
+		return 1;
+	}
+
+	for (i = 0; i < b.n_nodes && !ret; i++) {
+		if (b.nodes[i].disk.flags & HEXAGONFS_IMAGE_NODE_DIR)
+			ret = expand_dir(&b, i);
+	}
+
+	if (ret)
+		goto out;
+
+	/*
+	 * The daemon maps the image, so replace it instead of overwriting it
+	 * while it may be in use.
+	 */
+	tmp_path = malloc(strlen(argv[2]) + sizeof(".tmp"));
+	if (tmp_path == NULL) {
+		perror("Could not allocate path");
+		ret = -1;
+		goto out;
+	}
+
+	strcpy(tmp_path, argv[2]);
+	strcat(tmp_path, ".tmp");
+
+	out = fopen(tmp_path, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Could not create %s: %s\n",
+				tmp_path, strerror(errno));
+		ret = -1;
+		goto out_free_tmp;
+	}
+
+	ret = write_image(out, &b);
+
+	if (fclose(out) && !ret) {
+		perror("Could not write image");
+		ret = -1;
+	}
+
+	if (!ret && rename(tmp_path, argv[2])) {
+		fprintf(stderr, "Could not create %s: %s\n",
+				argv[2], strerror(errno));
+		ret = -1;
+	}
+
+	if (ret)
+		remove(tmp_path);
+
+out_free_tmp:
+	free(tmp_path);
+out:
+	for (i = 0; i < b.n_nodes; i++)
+		free(b.nodes[i].path);
+	free(b.nodes);
+	free(b.names);
+
+	return ret ? 1 : 0;
+}